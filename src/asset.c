@@ -0,0 +1,435 @@
+/*  =========================================================================
+    asset - Rules bound to one asset
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    asset - Rules bound to one asset
+@discuss
+    Keeps list of rules evaluated for the asset together with an inverted
+    index from metric quantity id to the rules using that metric, so that
+    incoming metric is dispatched only to rules interested in it. Rules
+    must be interned (see rule_intern) before they are bound to an asset.
+    Asset does not own the rules. Every bound rule has its binding, which
+    keeps evaluation state of the rule for this asset; the binding is reset
+    when the rule is unbound.
+@end
+*/
+
+#include "zm_alert_classes.h"
+
+//  Structure of our class
+
+struct _asset_t {
+    char *name;                 //  Asset name
+    uint32_t id;                //  Interned asset name
+    zlist_t *bindings;          //  asset_binding_t * of bound rules
+    zhashx_t *by_rule;          //  rule_t * -> asset_binding_t *
+    zhashx_t *dispatch;         //  quantity id -> zlist_t of asset_binding_t *
+};
+
+//  Dispatch keys are quantity ids stored directly in the key pointer, keys
+//  of bindings by rule are the rule pointers
+
+static size_t
+s_id_hash (const void *key)
+{
+    return (size_t) (uintptr_t) key;
+}
+
+static int
+s_id_compare (const void *key1, const void *key2)
+{
+    uintptr_t k1 = (uintptr_t) key1;
+    uintptr_t k2 = (uintptr_t) key2;
+    return k1 < k2 ? -1 : (k1 > k2 ? 1 : 0);
+}
+
+static void
+s_bindings_destroy (zlist_t **bindings_p)
+{
+    zlist_destroy (bindings_p);
+}
+
+static void
+s_binding_destroy (asset_binding_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        asset_binding_t *self = *self_p;
+        zstr_free (&self->message);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Add binding to dispatch lists of metrics of its rule
+
+static void
+s_dispatch_add (asset_t *self, asset_binding_t *binding)
+{
+    size_t size;
+    const uint32_t *ids = rule_metric_ids (binding->rule, &size);
+    for (size_t i = 0; i < size; i++) {
+        void *key = (void *) (uintptr_t) ids [i];
+        zlist_t *bindings = (zlist_t *) zhashx_lookup (self->dispatch, key);
+        if (!bindings) {
+            bindings = zlist_new ();
+            zhashx_insert (self->dispatch, key, bindings);
+        }
+        if (!zlist_exists (bindings, binding))
+            zlist_append (bindings, binding);
+    }
+}
+
+//  Remove binding from dispatch lists of metrics of its rule
+
+static void
+s_dispatch_remove (asset_t *self, asset_binding_t *binding)
+{
+    size_t size;
+    const uint32_t *ids = rule_metric_ids (binding->rule, &size);
+    for (size_t i = 0; i < size; i++) {
+        void *key = (void *) (uintptr_t) ids [i];
+        zlist_t *bindings = (zlist_t *) zhashx_lookup (self->dispatch, key);
+        if (!bindings) continue;
+        zlist_remove (bindings, binding);
+        if (zlist_size (bindings) == 0)
+            zhashx_delete (self->dispatch, key);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new asset
+
+asset_t *
+asset_new (const char *name, uint32_t id)
+{
+    assert (name);
+    asset_t *self = (asset_t *) zmalloc (sizeof (asset_t));
+    assert (self);
+    //  Initialize class properties here
+    self->name = strdup (name);
+    self->id = id;
+    self->bindings = zlist_new ();
+    self->dispatch = zhashx_new ();
+    self->by_rule = zhashx_new ();
+    assert (self->name && self->bindings && self->dispatch && self->by_rule);
+    zhashx_set_key_duplicator (self->dispatch, NULL);
+    zhashx_set_key_destructor (self->dispatch, NULL);
+    zhashx_set_key_hasher (self->dispatch, s_id_hash);
+    zhashx_set_key_comparator (self->dispatch, s_id_compare);
+    zhashx_set_destructor (self->dispatch, (zhashx_destructor_fn *) s_bindings_destroy);
+    zhashx_set_key_duplicator (self->by_rule, NULL);
+    zhashx_set_key_destructor (self->by_rule, NULL);
+    zhashx_set_key_hasher (self->by_rule, s_id_hash);
+    zhashx_set_key_comparator (self->by_rule, s_id_compare);
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the asset
+
+void
+asset_destroy (asset_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        asset_t *self = *self_p;
+        //  Free class properties here
+        zhashx_destroy (&self->dispatch);
+        zhashx_destroy (&self->by_rule);
+        asset_binding_t *binding = (asset_binding_t *) zlist_first (self->bindings);
+        while (binding) {
+            s_binding_destroy (&binding);
+            binding = (asset_binding_t *) zlist_next (self->bindings);
+        }
+        zlist_destroy (&self->bindings);
+        zstr_free (&self->name);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Get asset name
+
+const char *
+asset_name (asset_t *self)
+{
+    assert (self);
+    return self->name;
+}
+
+//  --------------------------------------------------------------------------
+//  Get asset id
+
+uint32_t
+asset_id (asset_t *self)
+{
+    assert (self);
+    return self->id;
+}
+
+//  --------------------------------------------------------------------------
+//  Is the rule bound to this asset?
+
+bool
+asset_has_rule (asset_t *self, rule_t *rule)
+{
+    return asset_binding (self, rule) != NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Bind rule to this asset. Does nothing if the rule is already bound.
+
+void
+asset_bind_rule (asset_t *self, rule_t *rule)
+{
+    assert (self);
+    assert (rule);
+    if (asset_has_rule (self, rule)) return;
+
+    asset_binding_t *binding = (asset_binding_t *) zmalloc (sizeof (asset_binding_t));
+    assert (binding);
+    binding->rule = rule;
+    zlist_append (self->bindings, binding);
+    zhashx_insert (self->by_rule, rule, binding);
+    s_dispatch_add (self, binding);
+}
+
+//  --------------------------------------------------------------------------
+//  Unbind rule from this asset. Does nothing if the rule is not bound.
+
+void
+asset_unbind_rule (asset_t *self, rule_t *rule)
+{
+    assert (self);
+    asset_binding_t *binding = asset_binding (self, rule);
+    if (!binding) return;
+
+    zlist_remove (self->bindings, binding);
+    zhashx_delete (self->by_rule, rule);
+    s_dispatch_remove (self, binding);
+    s_binding_destroy (&binding);
+}
+
+//  --------------------------------------------------------------------------
+//  Bind newrule in place of rule, keeping evaluation state of the binding.
+//  Returns the binding, NULL if rule is not bound or newrule is bound
+//  already.
+
+asset_binding_t *
+asset_rebind_rule (asset_t *self, rule_t *rule, rule_t *newrule)
+{
+    assert (self);
+    assert (newrule);
+    asset_binding_t *binding = asset_binding (self, rule);
+    if (!binding || asset_has_rule (self, newrule)) return NULL;
+
+    s_dispatch_remove (self, binding);
+    zhashx_delete (self->by_rule, rule);
+    binding->rule = newrule;
+    zhashx_insert (self->by_rule, newrule, binding);
+    s_dispatch_add (self, binding);
+    return binding;
+}
+
+//  --------------------------------------------------------------------------
+//  Make the list of rules bound to this asset equal to rules. Rules which
+//  are not in the list are unbound, missing rules are bound.
+
+void
+asset_set_rules (asset_t *self, zlist_t *rules)
+{
+    assert (self);
+    assert (rules);
+
+    zlist_t *unbind = zlist_new ();
+    asset_binding_t *binding = (asset_binding_t *) zlist_first (self->bindings);
+    while (binding) {
+        if (!zlist_exists (rules, binding->rule))
+            zlist_append (unbind, binding->rule);
+        binding = (asset_binding_t *) zlist_next (self->bindings);
+    }
+    rule_t *rule = (rule_t *) zlist_first (unbind);
+    while (rule) {
+        asset_unbind_rule (self, rule);
+        rule = (rule_t *) zlist_next (unbind);
+    }
+    zlist_destroy (&unbind);
+
+    rule = (rule_t *) zlist_first (rules);
+    while (rule) {
+        asset_bind_rule (self, rule);
+        rule = (rule_t *) zlist_next (rules);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of rules bound to this asset
+
+size_t
+asset_rules_size (asset_t *self)
+{
+    assert (self);
+    return zlist_size (self->bindings);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the first rule bound to this asset or NULL
+
+rule_t *
+asset_rule_first (asset_t *self)
+{
+    assert (self);
+    asset_binding_t *binding = (asset_binding_t *) zlist_first (self->bindings);
+    return binding ? binding->rule : NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the next rule bound to this asset or NULL
+
+rule_t *
+asset_rule_next (asset_t *self)
+{
+    assert (self);
+    asset_binding_t *binding = (asset_binding_t *) zlist_next (self->bindings);
+    return binding ? binding->rule : NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Return binding of rule to this asset or NULL if the rule is not bound
+
+asset_binding_t *
+asset_binding (asset_t *self, rule_t *rule)
+{
+    assert (self);
+    return (asset_binding_t *) zhashx_lookup (self->by_rule, rule);
+}
+
+//  --------------------------------------------------------------------------
+//  Return list of bindings (asset_binding_t *) of rules using metric
+//  quantity id or NULL if there is no such rule. List is owned by asset and
+//  must not be modified.
+
+zlist_t *
+asset_bindings_for_metric (asset_t *self, uint32_t quantity_id)
+{
+    assert (self);
+    return (zlist_t *) zhashx_lookup (self->dispatch, (void *) (uintptr_t) quantity_id);
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static rule_t *
+s_test_rule (atoms_t *atoms, const char *json)
+{
+    rule_t *rule = rule_new ();
+    int r = rule_parse (rule, json);
+    assert (r == 0);
+    rule_intern (rule, atoms);
+    return rule;
+}
+
+static rule_t *
+s_test_first_rule (zlist_t *bindings)
+{
+    asset_binding_t *binding = (asset_binding_t *) zlist_first (bindings);
+    return binding ? binding->rule : NULL;
+}
+
+void
+asset_test (bool verbose)
+{
+    printf (" * asset: ");
+
+    //  @selftest
+    //  Simple create/destroy test
+    asset_t *self = asset_new ("ups-1", 1);
+    assert (self);
+    asset_destroy (&self);
+
+    atoms_t *atoms = atoms_new ();
+    rule_t *load = s_test_rule (atoms,
+        "{\"name\":\"load\",\"metrics\":[\"load.default\"],\"evaluation\":\"\"}");
+    rule_t *sts = s_test_rule (atoms,
+        "{\"name\":\"sts\",\"metrics\":[\"input.1\",\"input.2\"],\"evaluation\":\"\"}");
+    rule_t *input = s_test_rule (atoms,
+        "{\"name\":\"input\",\"metrics\":[\"input.2\"],\"evaluation\":\"\"}");
+    uint32_t load_id = atoms_find (atoms, "load.default");
+    uint32_t input1_id = atoms_find (atoms, "input.1");
+    uint32_t input2_id = atoms_find (atoms, "input.2");
+
+    self = asset_new ("sts-1", atoms_intern (atoms, "sts-1"));
+    assert (streq (asset_name (self), "sts-1"));
+    assert (asset_id (self) == atoms_find (atoms, "sts-1"));
+    assert (asset_bindings_for_metric (self, load_id) == NULL);
+
+    asset_bind_rule (self, sts);
+    asset_bind_rule (self, input);
+    asset_bind_rule (self, sts);
+    assert (asset_rules_size (self) == 2);
+    assert (zlist_size (asset_bindings_for_metric (self, input1_id)) == 1);
+    assert (zlist_size (asset_bindings_for_metric (self, input2_id)) == 2);
+    assert (asset_bindings_for_metric (self, load_id) == NULL);
+
+    asset_unbind_rule (self, sts);
+    assert (!asset_has_rule (self, sts));
+    assert (asset_bindings_for_metric (self, input1_id) == NULL);
+    assert (s_test_first_rule (asset_bindings_for_metric (self, input2_id)) == input);
+
+    zlist_t *rules = zlist_new ();
+    zlist_append (rules, load);
+    zlist_append (rules, sts);
+    asset_set_rules (self, rules);
+    zlist_destroy (&rules);
+    assert (asset_rules_size (self) == 2);
+    assert (!asset_has_rule (self, input));
+    assert (asset_has_rule (self, load) && asset_has_rule (self, sts));
+    assert (s_test_first_rule (asset_bindings_for_metric (self, load_id)) == load);
+    assert (s_test_first_rule (asset_bindings_for_metric (self, input2_id)) == sts);
+
+    asset_binding_t *binding = asset_binding (self, load);
+    assert (binding && binding->rule == load && !binding->memoized);
+    assert (asset_binding (self, input) == NULL);
+
+    //  rebinding keeps state and dispatches metrics of the new rule
+    binding->published_result = 2;
+    assert (asset_rebind_rule (self, load, input) == binding);
+    assert (!asset_has_rule (self, load));
+    assert (asset_binding (self, input) == binding);
+    assert (binding->rule == input && binding->published_result == 2);
+    assert (asset_bindings_for_metric (self, load_id) == NULL);
+    assert (zlist_size (asset_bindings_for_metric (self, input2_id)) == 2);
+    assert (asset_rules_size (self) == 2);
+    assert (asset_rebind_rule (self, load, sts) == NULL);
+    assert (asset_rebind_rule (self, input, sts) == NULL);
+
+    asset_destroy (&self);
+    rule_destroy (&load);
+    rule_destroy (&sts);
+    rule_destroy (&input);
+    atoms_destroy (&atoms);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,123 @@
+/*  =========================================================================
+    asset - Rules bound to one asset
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef ASSET_H_INCLUDED
+#define ASSET_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structures to allow forward references
+#ifndef ASSET_T_DEFINED
+typedef struct _asset_t asset_t;
+#define ASSET_T_DEFINED
+#endif
+
+//  Rule bound to the asset together with state of its evaluation
+typedef struct {
+    rule_t *rule;               //  Bound rule, not owned
+    bool memoized;              //  Fingerprint, result and message are valid
+    uint64_t fingerprint;       //  Hash of inputs of the last evaluation
+    int result;                 //  Result of the last evaluation
+    char *message;              //  Message of the last evaluation
+    uint64_t published;         //  Time the alert was last published
+    int published_result;       //  Result of the last published alert
+    uint64_t published_hash;    //  Hash of message of the last published alert
+    bool pending;               //  Evaluation is deferred, see rule_coalesce
+    int64_t deadline;           //  Monotonic time (ms) of deferred evaluation
+    uint64_t refreshed;         //  Bits of metrics received while pending
+    bool batched;               //  Evaluation waits for batch tick
+} asset_binding_t;
+
+//  @interface
+//  Create a new asset, id is the interned asset name
+ZM_ALERT_PRIVATE asset_t *
+    asset_new (const char *name, uint32_t id);
+
+//  Destroy the asset
+ZM_ALERT_PRIVATE void
+    asset_destroy (asset_t **self_p);
+
+//  Get asset name
+ZM_ALERT_PRIVATE const char *
+    asset_name (asset_t *self);
+
+//  Get asset id
+ZM_ALERT_PRIVATE uint32_t
+    asset_id (asset_t *self);
+
+//  Is the rule bound to this asset?
+ZM_ALERT_PRIVATE bool
+    asset_has_rule (asset_t *self, rule_t *rule);
+
+//  Bind rule to this asset. Does nothing if the rule is already bound.
+ZM_ALERT_PRIVATE void
+    asset_bind_rule (asset_t *self, rule_t *rule);
+
+//  Unbind rule from this asset. Does nothing if the rule is not bound.
+ZM_ALERT_PRIVATE void
+    asset_unbind_rule (asset_t *self, rule_t *rule);
+
+//  Bind newrule in place of rule, keeping evaluation state of the binding.
+//  Returns the binding, NULL if rule is not bound or newrule is bound
+//  already.
+ZM_ALERT_PRIVATE asset_binding_t *
+    asset_rebind_rule (asset_t *self, rule_t *rule, rule_t *newrule);
+
+//  Make the list of rules bound to this asset equal to rules. Rules which
+//  are not in the list are unbound, missing rules are bound.
+ZM_ALERT_PRIVATE void
+    asset_set_rules (asset_t *self, zlist_t *rules);
+
+//  Return number of rules bound to this asset
+ZM_ALERT_PRIVATE size_t
+    asset_rules_size (asset_t *self);
+
+//  Return the first rule bound to this asset or NULL
+ZM_ALERT_PRIVATE rule_t *
+    asset_rule_first (asset_t *self);
+
+//  Return the next rule bound to this asset or NULL
+ZM_ALERT_PRIVATE rule_t *
+    asset_rule_next (asset_t *self);
+
+//  Return binding of rule to this asset or NULL if the rule is not bound
+ZM_ALERT_PRIVATE asset_binding_t *
+    asset_binding (asset_t *self, rule_t *rule);
+
+//  Return list of bindings (asset_binding_t *) of rules using metric
+//  quantity id or NULL if there is no such rule. List is owned by asset and
+//  must not be modified.
+ZM_ALERT_PRIVATE zlist_t *
+    asset_bindings_for_metric (asset_t *self, uint32_t quantity_id);
+
+//  Self test of this class
+ZM_ALERT_PRIVATE void
+    asset_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,467 @@
+/*  =========================================================================
+    asset_index - Index of assets by matching attributes
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    asset_index - Index of assets by matching attributes
+@discuss
+    Keeps attributes of assets deciding which rules are valid for them, see
+    rule_index: asset name, groups (ext "group.*"), "model", "device.part",
+    "type" and "subtype". Attributes of an asset are stored in one buffer
+    and hashes from each value lead to the assets having it, so assets for
+    a new rule are found by a few lookups, without republishing assets.
+    Assets stay in the index, the agent gets no notice of deleted assets.
+@end
+*/
+
+#include "zm_alert_classes.h"
+
+//  Stored asset. Attributes are kind character ('g' group, 'm' model or
+//  device.part, 't' type or subtype) followed by value, each terminated by
+//  NUL, the list ends by empty string.
+
+typedef struct {
+    char *name;
+    char *attributes;
+    size_t size;                //  Size of attributes including end
+} entry_t;
+
+//  Structure of our class
+
+struct _asset_index_t {
+    zhashx_t *assets;           //  asset name -> entry_t, owned
+    zhashx_t *groups;           //  group -> zhashx_t of name -> entry_t
+    zhashx_t *models;           //  model or device.part -> zhashx_t
+    zhashx_t *types;            //  type or subtype -> zhashx_t
+};
+
+static void
+s_entry_destroy (entry_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        entry_t *self = *self_p;
+        zstr_free (&self->name);
+        free (self->attributes);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static void
+s_assets_destroy (zhashx_t **assets_p)
+{
+    zhashx_destroy (assets_p);
+}
+
+static zhashx_t *
+s_index_new (void)
+{
+    zhashx_t *index = zhashx_new ();
+    assert (index);
+    zhashx_set_destructor (index, (zhashx_destructor_fn *) s_assets_destroy);
+    return index;
+}
+
+static zhashx_t *
+s_index_of (asset_index_t *self, char kind)
+{
+    return kind == 'g' ? self->groups : kind == 'm' ? self->models : self->types;
+}
+
+static void
+s_index_add (zhashx_t *index, const char *key, entry_t *entry)
+{
+    zhashx_t *assets = (zhashx_t *) zhashx_lookup (index, key);
+    if (!assets) {
+        assets = zhashx_new ();
+        assert (assets);
+        zhashx_insert (index, key, assets);
+    }
+    zhashx_update (assets, entry->name, entry);
+}
+
+static void
+s_index_remove (zhashx_t *index, const char *key, entry_t *entry)
+{
+    zhashx_t *assets = (zhashx_t *) zhashx_lookup (index, key);
+    if (!assets) return;
+    zhashx_delete (assets, entry->name);
+    if (zhashx_size (assets) == 0)
+        zhashx_delete (index, key);
+}
+
+//  Append value of kind to attributes buffer
+
+static void
+s_attributes_append (char **data, size_t *size, size_t *capacity, char kind, const char *value)
+{
+    if (!value || !*value) return;
+    size_t length = strlen (value);
+    if (*size + length + 3 > *capacity) {
+        while (*size + length + 3 > *capacity)
+            *capacity = *capacity ? *capacity * 2 : 64;
+        *data = (char *) realloc (*data, *capacity);
+        assert (*data);
+    }
+    (*data) [(*size)++] = kind;
+    memcpy (*data + *size, value, length + 1);
+    *size += length + 1;
+}
+
+//  Return attributes buffer of asset message, size is set to its size
+
+static char *
+s_attributes (zm_proto_t *zmmsg, size_t *size)
+{
+    char *data = NULL;
+    size_t capacity = 0;
+    *size = 0;
+    zhash_t *ext = zm_proto_ext (zmmsg);
+    if (ext) {
+        const char *value = (const char *) zhash_first (ext);
+        while (value) {
+            if (strncmp ("group.", zhash_cursor (ext), 6) == 0)
+                s_attributes_append (&data, size, &capacity, 'g', value);
+            value = (const char *) zhash_next (ext);
+        }
+    }
+    s_attributes_append (&data, size, &capacity, 'm', zm_proto_ext_string (zmmsg, "model", NULL));
+    s_attributes_append (&data, size, &capacity, 'm', zm_proto_ext_string (zmmsg, "device.part", NULL));
+    s_attributes_append (&data, size, &capacity, 't', zm_proto_ext_string (zmmsg, "type", NULL));
+    s_attributes_append (&data, size, &capacity, 't', zm_proto_ext_string (zmmsg, "subtype", NULL));
+    if (!data) {
+        data = (char *) zmalloc (1);
+        assert (data);
+    }
+    data [(*size)++] = 0;
+    return data;
+}
+
+//  Add entry to reverse indexes, or remove it from them
+
+static void
+s_entry_index (asset_index_t *self, entry_t *entry, bool add)
+{
+    const char *p = entry->attributes;
+    while (*p) {
+        zhashx_t *index = s_index_of (self, *p);
+        if (add)
+            s_index_add (index, p + 1, entry);
+        else
+            s_index_remove (index, p + 1, entry);
+        p += strlen (p) + 1;
+    }
+}
+
+//  Store attributes of asset, takes ownership of attributes. Returns true
+//  if they changed.
+
+static bool
+s_store (asset_index_t *self, const char *name, char *attributes, size_t size)
+{
+    entry_t *entry = (entry_t *) zhashx_lookup (self->assets, name);
+    if (entry) {
+        if (entry->size == size && memcmp (entry->attributes, attributes, size) == 0) {
+            free (attributes);
+            return false;
+        }
+        s_entry_index (self, entry, false);
+        free (entry->attributes);
+    }
+    else {
+        entry = (entry_t *) zmalloc (sizeof (entry_t));
+        assert (entry);
+        entry->name = strdup (name);
+        zhashx_insert (self->assets, name, entry);
+    }
+    entry->attributes = attributes;
+    entry->size = size;
+    s_entry_index (self, entry, true);
+    return true;
+}
+
+//  Add names of assets in set to result, unless they are in seen
+
+static void
+s_match (zhashx_t *assets, zhashx_t *seen, zlist_t *result)
+{
+    if (!assets) return;
+    entry_t *entry = (entry_t *) zhashx_first (assets);
+    while (entry) {
+        if (zhashx_insert (seen, entry->name, entry) == 0)
+            zlist_append (result, entry->name);
+        entry = (entry_t *) zhashx_next (assets);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new asset_index
+
+asset_index_t *
+asset_index_new (void)
+{
+    asset_index_t *self = (asset_index_t *) zmalloc (sizeof (asset_index_t));
+    assert (self);
+    //  Initialize class properties here
+    self->assets = zhashx_new ();
+    assert (self->assets);
+    zhashx_set_destructor (self->assets, (zhashx_destructor_fn *) s_entry_destroy);
+    self->groups = s_index_new ();
+    self->models = s_index_new ();
+    self->types = s_index_new ();
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the asset_index
+
+void
+asset_index_destroy (asset_index_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        asset_index_t *self = *self_p;
+        //  Free class properties here
+        zhashx_destroy (&self->groups);
+        zhashx_destroy (&self->models);
+        zhashx_destroy (&self->types);
+        zhashx_destroy (&self->assets);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Store matching attributes of asset from asset message, replacing the
+//  ones stored before. Returns true if attributes changed.
+
+bool
+asset_index_update (asset_index_t *self, zm_proto_t *zmmsg)
+{
+    assert (self);
+    assert (zmmsg);
+
+    const char *name = zm_proto_device (zmmsg);
+    if (!name) return false;
+    size_t size;
+    char *attributes = s_attributes (zmmsg, &size);
+    return s_store (self, name, attributes, size);
+}
+
+//  --------------------------------------------------------------------------
+//  Store asset with attributes as returned by asset_index_attributes, used
+//  to restore the index. Returns -1 if attributes are malformed.
+
+int
+asset_index_insert (asset_index_t *self, const char *name, const char *attributes, size_t size)
+{
+    assert (self);
+    if (!name || !attributes || size == 0) return -1;
+    //  every value has kind and terminating NUL, list ends by empty string
+    size_t offset = 0;
+    while (offset < size && attributes [offset]) {
+        char kind = attributes [offset];
+        const char *end = (const char *) memchr (attributes + offset, 0, size - offset);
+        if (!end || (kind != 'g' && kind != 'm' && kind != 't'))
+            return -1;
+        offset = end - attributes + 1;
+    }
+    if (offset != size - 1) return -1;
+    char *copy = (char *) malloc (size);
+    assert (copy);
+    memcpy (copy, attributes, size);
+    s_store (self, name, copy, size);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Return attributes of asset in internal format, size is set to their
+//  size. Returns NULL if asset is not in the index.
+
+const char *
+asset_index_attributes (asset_index_t *self, const char *name, size_t *size)
+{
+    assert (self);
+    entry_t *entry = name ? (entry_t *) zhashx_lookup (self->assets, name) : NULL;
+    if (!entry) return NULL;
+    if (size) *size = entry->size;
+    return entry->attributes;
+}
+
+//  --------------------------------------------------------------------------
+//  Return name of first asset in the index, in no particular order, or NULL
+
+const char *
+asset_index_first (asset_index_t *self)
+{
+    assert (self);
+    entry_t *entry = (entry_t *) zhashx_first (self->assets);
+    return entry ? entry->name : NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Return name of next asset in the index or NULL
+
+const char *
+asset_index_next (asset_index_t *self)
+{
+    assert (self);
+    entry_t *entry = (entry_t *) zhashx_next (self->assets);
+    return entry ? entry->name : NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of assets in the index
+
+size_t
+asset_index_size (asset_index_t *self)
+{
+    assert (self);
+    return zhashx_size (self->assets);
+}
+
+//  --------------------------------------------------------------------------
+//  Return list of names of stored assets the rule is valid for. Each asset
+//  is listed once. Caller is responsible for destroying the return value.
+
+zlist_t *
+asset_index_match (asset_index_t *self, rule_t *rule)
+{
+    assert (self);
+    assert (rule);
+
+    zlist_t *result = zlist_new ();
+    zhashx_t *seen = zhashx_new ();
+    const char *key;
+    for (key = rule_asset_first (rule); key; key = rule_asset_next (rule)) {
+        entry_t *entry = (entry_t *) zhashx_lookup (self->assets, key);
+        if (entry && zhashx_insert (seen, entry->name, entry) == 0)
+            zlist_append (result, entry->name);
+    }
+    for (key = rule_group_first (rule); key; key = rule_group_next (rule))
+        s_match ((zhashx_t *) zhashx_lookup (self->groups, key), seen, result);
+    for (key = rule_model_first (rule); key; key = rule_model_next (rule))
+        s_match ((zhashx_t *) zhashx_lookup (self->models, key), seen, result);
+    for (key = rule_type_first (rule); key; key = rule_type_next (rule))
+        s_match ((zhashx_t *) zhashx_lookup (self->types, key), seen, result);
+    zhashx_destroy (&seen);
+    return result;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+//  Update index by asset, return true if attributes changed
+
+static bool
+s_test_update (asset_index_t *self, const char *name, const char *key, const char *value)
+{
+    zm_proto_t *zmmsg = rule_index_test_asset (name, key, value);
+    bool changed = asset_index_update (self, zmmsg);
+    zm_proto_destroy (&zmmsg);
+    return changed;
+}
+
+static size_t
+s_test_match (asset_index_t *self, rule_t *rule, const char *expected)
+{
+    zlist_t *names = asset_index_match (self, rule);
+    size_t size = zlist_size (names);
+    if (expected) {
+        bool found = false;
+        const char *name = (const char *) zlist_first (names);
+        while (name) {
+            if (streq (name, expected)) found = true;
+            name = (const char *) zlist_next (names);
+        }
+        assert (found);
+    }
+    zlist_destroy (&names);
+    return size;
+}
+
+void
+asset_index_test (bool verbose)
+{
+    printf (" * asset_index: ");
+
+    //  @selftest
+    //  Simple create/destroy test
+    asset_index_t *self = asset_index_new ();
+    assert (self);
+    asset_index_destroy (&self);
+
+    rule_t *byname = rule_new ();
+    rule_parse (byname, "{\"name\":\"byname\",\"assets\":[\"ups-1\",\"ups-2\"],\"groups\":[\"all-upses\"]}");
+    rule_t *bygroup = rule_new ();
+    rule_parse (bygroup, "{\"name\":\"bygroup\",\"groups\":[\"all-upses\"]}");
+    rule_t *bymodel = rule_new ();
+    rule_parse (bymodel, "{\"name\":\"bymodel\",\"models\":[\"ePDU\"]}");
+    rule_t *bytype = rule_new ();
+    rule_parse (bytype, "{\"name\":\"bytype\",\"types\":[\"sts\"]}");
+
+    self = asset_index_new ();
+    assert (s_test_update (self, "ups-1", "group.1", "all-upses"));
+    assert (!s_test_update (self, "ups-1", "group.1", "all-upses"));
+    assert (s_test_update (self, "ups-3", "group.2", "all-upses"));
+    assert (s_test_update (self, "epdu-1", "device.part", "ePDU"));
+    assert (s_test_update (self, "sts-1", "subtype", "sts"));
+    assert (s_test_update (self, "rack-1", NULL, NULL));
+    assert (asset_index_size (self) == 5);
+
+    //  ups-1 matches byname both by name and group, but is listed once
+    assert (s_test_match (self, byname, "ups-1") == 2);
+    assert (s_test_match (self, bygroup, "ups-3") == 2);
+    assert (s_test_match (self, bymodel, "epdu-1") == 1);
+    assert (s_test_match (self, bytype, "sts-1") == 1);
+
+    //  changed attributes move asset between groups
+    assert (s_test_update (self, "ups-3", "group.2", "all-racks"));
+    assert (s_test_match (self, bygroup, "ups-1") == 1);
+
+    //  attributes restored into other index match the same
+    asset_index_t *copy = asset_index_new ();
+    const char *name = asset_index_first (self);
+    while (name) {
+        size_t size;
+        const char *attributes = asset_index_attributes (self, name, &size);
+        assert (attributes);
+        assert (asset_index_insert (copy, name, attributes, size) == 0);
+        name = asset_index_next (self);
+    }
+    assert (asset_index_size (copy) == 5);
+    assert (s_test_match (copy, bygroup, "ups-1") == 1);
+    assert (s_test_match (copy, bytype, "sts-1") == 1);
+    assert (asset_index_insert (copy, "bad", "xbad\0", 6) == -1);
+    assert (asset_index_insert (copy, "bad", "gbad", 4) == -1);
+    assert (asset_index_insert (copy, "empty", "", 1) == 0);
+    asset_index_destroy (&copy);
+
+    asset_index_destroy (&self);
+    rule_destroy (&byname);
+    rule_destroy (&bygroup);
+    rule_destroy (&bymodel);
+    rule_destroy (&bytype);
+    //  @end
+    printf ("OK\n");
+}
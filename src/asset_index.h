@@ -0,0 +1,87 @@
+/*  =========================================================================
+    asset_index - Index of assets by matching attributes
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef ASSET_INDEX_H_INCLUDED
+#define ASSET_INDEX_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structures to allow forward references
+#ifndef ASSET_INDEX_T_DEFINED
+typedef struct _asset_index_t asset_index_t;
+#define ASSET_INDEX_T_DEFINED
+#endif
+
+//  @interface
+//  Create a new asset_index
+ZM_ALERT_PRIVATE asset_index_t *
+    asset_index_new (void);
+
+//  Destroy the asset_index
+ZM_ALERT_PRIVATE void
+    asset_index_destroy (asset_index_t **self_p);
+
+//  Store matching attributes of asset from asset message, replacing the
+//  ones stored before. Returns true if attributes changed.
+ZM_ALERT_PRIVATE bool
+    asset_index_update (asset_index_t *self, zm_proto_t *zmmsg);
+
+//  Store asset with attributes as returned by asset_index_attributes, used
+//  to restore the index. Returns -1 if attributes are malformed.
+ZM_ALERT_PRIVATE int
+    asset_index_insert (asset_index_t *self, const char *name, const char *attributes, size_t size);
+
+//  Return attributes of asset in internal format, size is set to their
+//  size. Returns NULL if asset is not in the index.
+ZM_ALERT_PRIVATE const char *
+    asset_index_attributes (asset_index_t *self, const char *name, size_t *size);
+
+//  Return name of first asset in the index, in no particular order, or NULL
+ZM_ALERT_PRIVATE const char *
+    asset_index_first (asset_index_t *self);
+
+//  Return name of next asset in the index or NULL
+ZM_ALERT_PRIVATE const char *
+    asset_index_next (asset_index_t *self);
+
+//  Return number of assets in the index
+ZM_ALERT_PRIVATE size_t
+    asset_index_size (asset_index_t *self);
+
+//  Return list of names of stored assets the rule is valid for. Each asset
+//  is listed once. Names are owned by the index and valid until the asset
+//  is updated. Caller is responsible for destroying the return value.
+ZM_ALERT_PRIVATE zlist_t *
+    asset_index_match (asset_index_t *self, rule_t *rule);
+
+//  Self test of this class
+ZM_ALERT_PRIVATE void
+    asset_index_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
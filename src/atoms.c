@@ -0,0 +1,183 @@
+/*  =========================================================================
+    atoms - Table of interned names
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    atoms - Table of interned names
+@discuss
+    Maps names (metric quantities, asset names) to small integer ids, so
+    the metric cache and rules can work with integers instead of building
+    and hashing "quantity@asset" strings for every message. Ids start at 1,
+    0 means unknown name. Names are never removed from the table.
+@end
+*/
+
+#include "zm_alert_classes.h"
+
+//  Structure of our class
+
+struct _atoms_t {
+    zhashx_t *ids;              //  name -> id
+    char **names;               //  id -> name, owns the strings
+    size_t size;
+    size_t capacity;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new atoms
+
+atoms_t *
+atoms_new (void)
+{
+    atoms_t *self = (atoms_t *) zmalloc (sizeof (atoms_t));
+    assert (self);
+    //  Initialize class properties here
+    self->ids = zhashx_new ();
+    assert (self->ids);
+    //  keys are owned by names array
+    zhashx_set_key_duplicator (self->ids, NULL);
+    zhashx_set_key_destructor (self->ids, NULL);
+    //  id 0 is reserved for unknown names
+    self->size = 1;
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the atoms
+
+void
+atoms_destroy (atoms_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        atoms_t *self = *self_p;
+        //  Free class properties here
+        zhashx_destroy (&self->ids);
+        for (size_t i = 1; i < self->size; i++)
+            free (self->names [i]);
+        free (self->names);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return id of the name, adding it to the table if it is not there yet.
+
+uint32_t
+atoms_intern (atoms_t *self, const char *name)
+{
+    assert (self);
+    assert (name);
+
+    uint32_t id = (uint32_t) (uintptr_t) zhashx_lookup (self->ids, name);
+    if (id)
+        return id;
+
+    if (self->size == self->capacity) {
+        size_t capacity = self->capacity ? self->capacity * 2 : 256;
+        char **names = (char **) realloc (self->names, capacity * sizeof (char *));
+        assert (names);
+        self->names = names;
+        self->capacity = capacity;
+    }
+    id = (uint32_t) self->size++;
+    self->names [id] = strdup (name);
+    assert (self->names [id]);
+    zhashx_insert (self->ids, self->names [id], (void *) (uintptr_t) id);
+    return id;
+}
+
+//  --------------------------------------------------------------------------
+//  Return id of the name or 0 if the name is not in the table.
+
+uint32_t
+atoms_find (atoms_t *self, const char *name)
+{
+    assert (self);
+    if (!name) return 0;
+    return (uint32_t) (uintptr_t) zhashx_lookup (self->ids, name);
+}
+
+//  --------------------------------------------------------------------------
+//  Return name of the id or NULL if the id is unknown.
+
+const char *
+atoms_name (atoms_t *self, uint32_t id)
+{
+    assert (self);
+    if (id == 0 || id >= self->size) return NULL;
+    return self->names [id];
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of names in the table
+
+size_t
+atoms_size (atoms_t *self)
+{
+    assert (self);
+    return self->size - 1;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+atoms_test (bool verbose)
+{
+    printf (" * atoms: ");
+
+    //  @selftest
+    //  Simple create/destroy test
+    atoms_t *self = atoms_new ();
+    assert (self);
+    atoms_destroy (&self);
+
+    self = atoms_new ();
+    assert (atoms_size (self) == 0);
+    assert (atoms_find (self, "load.default") == 0);
+    assert (atoms_name (self, 0) == NULL);
+
+    uint32_t load = atoms_intern (self, "load.default");
+    uint32_t ups = atoms_intern (self, "ups-1");
+    assert (load != 0 && ups != 0 && load != ups);
+    assert (atoms_intern (self, "load.default") == load);
+    assert (atoms_find (self, "ups-1") == ups);
+    assert (streq (atoms_name (self, load), "load.default"));
+    assert (atoms_name (self, 1000) == NULL);
+
+    //  grow over initial capacity
+    char name [32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf (name, sizeof (name), "asset-%i", i);
+        atoms_intern (self, name);
+    }
+    assert (atoms_size (self) == 1002);
+    assert (streq (atoms_name (self, atoms_find (self, "asset-999")), "asset-999"));
+    assert (streq (atoms_name (self, ups), "ups-1"));
+    atoms_destroy (&self);
+    //  @end
+    printf ("OK\n");
+}
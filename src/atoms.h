@@ -0,0 +1,70 @@
+/*  =========================================================================
+    atoms - Table of interned names
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef ATOMS_H_INCLUDED
+#define ATOMS_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structures to allow forward references
+#ifndef ATOMS_T_DEFINED
+typedef struct _atoms_t atoms_t;
+#define ATOMS_T_DEFINED
+#endif
+
+//  @interface
+//  Create a new atoms
+ZM_ALERT_PRIVATE atoms_t *
+    atoms_new (void);
+
+//  Destroy the atoms
+ZM_ALERT_PRIVATE void
+    atoms_destroy (atoms_t **self_p);
+
+//  Return id of the name, adding it to the table if it is not there yet.
+ZM_ALERT_PRIVATE uint32_t
+    atoms_intern (atoms_t *self, const char *name);
+
+//  Return id of the name or 0 if the name is not in the table.
+ZM_ALERT_PRIVATE uint32_t
+    atoms_find (atoms_t *self, const char *name);
+
+//  Return name of the id or NULL if the id is unknown.
+ZM_ALERT_PRIVATE const char *
+    atoms_name (atoms_t *self, uint32_t id);
+
+//  Return number of names in the table
+ZM_ALERT_PRIVATE size_t
+    atoms_size (atoms_t *self);
+
+//  Self test of this class
+ZM_ALERT_PRIVATE void
+    atoms_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
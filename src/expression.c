@@ -0,0 +1,597 @@
+/*  =========================================================================
+    expression - Compiled rule expression
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    expression - Compiled rule expression
+@discuss
+    Small C-like expression language for rules, cheaper than lua when the
+    rule only combines a few metrics, e.g.
+
+        load > high_critical ? HIGH_CRITICAL : load > high_warning ? HIGH_WARNING : OK
+
+    Operators, from the lowest priority: ?:, ||, &&, == !=, < <= > >=,
+    + -, * /, unary - and !. All values are numbers, comparisons and logical
+    operators give 1 or 0. Expression is parsed once into postfix code with
+    metrics resolved to their slots and variables and constants folded to
+    numbers, so evaluation is a single pass over the code with a fixed size
+    stack.
+@end
+*/
+
+#include "zm_alert_classes.h"
+
+//  Maximal depth of the evaluation stack, deeper expressions are refused
+
+#define EXPRESSION_STACK 32
+
+//  Maximal nesting of parentheses, unary operators and conditions, parser
+//  recursion is bounded by it
+
+#define EXPRESSION_NESTING 64
+
+typedef enum {
+    OP_CONST,                   //  push number
+    OP_SLOT,                    //  push metric value
+    OP_NEG,
+    OP_NOT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+    OP_SELECT                   //  condition ? a : b
+} s_opcode_t;
+
+typedef struct {
+    int op;                     //  s_opcode_t
+    int slot;                   //  metric index of OP_SLOT
+    double number;              //  value of OP_CONST
+} s_instruction_t;
+
+//  Structure of our class
+
+struct _expression_t {
+    s_instruction_t *code;
+    size_t size;
+};
+
+//  Parser state
+
+typedef struct {
+    const char *source;
+    const char *p;              //  current position
+    zlist_t *metrics;
+    zhashx_t *variables;
+    s_instruction_t *code;
+    size_t size;
+    size_t capacity;
+    int depth;                  //  stack depth after code so far
+    int nesting;                //  nesting of current parse
+    char *error;                //  first error, if any
+} s_parser_t;
+
+//  Result constants, same as in lua evaluation
+
+static struct {
+    const char *name;
+    double value;
+} s_constants [] = {
+    { "OK", 0 },
+    { "WARNING", 1 },
+    { "HIGH_WARNING", 1 },
+    { "CRITICAL", 2 },
+    { "HIGH_CRITICAL", 2 },
+    { "LOW_WARNING", -1 },
+    { "LOW_CRITICAL", -2 },
+    { NULL, 0 }
+};
+
+static void
+s_error (s_parser_t *parser, const char *reason)
+{
+    if (!parser->error)
+        parser->error = zsys_sprintf ("%s at position %d of expression '%s'",
+                                      reason, (int) (parser->p - parser->source), parser->source);
+}
+
+//  --------------------------------------------------------------------------
+//  Apply operator to numbers
+
+static inline double
+s_apply (int op, double a, double b, double c)
+{
+    switch (op) {
+        case OP_NEG: return -a;
+        case OP_NOT: return a == 0;
+        case OP_ADD: return a + b;
+        case OP_SUB: return a - b;
+        case OP_MUL: return a * b;
+        case OP_DIV: return a / b;
+        case OP_LT: return a < b;
+        case OP_LE: return a <= b;
+        case OP_GT: return a > b;
+        case OP_GE: return a >= b;
+        case OP_EQ: return a == b;
+        case OP_NE: return a != b;
+        case OP_AND: return a != 0 && b != 0;
+        case OP_OR: return a != 0 || b != 0;
+        case OP_SELECT: return a != 0 ? b : c;
+    }
+    return 0;
+}
+
+static int
+s_operands (int op)
+{
+    if (op == OP_CONST || op == OP_SLOT) return 0;
+    if (op == OP_NEG || op == OP_NOT) return 1;
+    if (op == OP_SELECT) return 3;
+    return 2;
+}
+
+//  --------------------------------------------------------------------------
+//  Append instruction to code. Operator with constant operands is folded
+//  to constant, operand of postfix code which is a single OP_CONST is
+//  a whole subexpression.
+
+static void
+s_emit (s_parser_t *parser, int op, int slot, double number)
+{
+    int operands = s_operands (op);
+    if (operands && parser->size >= (size_t) operands) {
+        s_instruction_t *args = parser->code + parser->size - operands;
+        bool constant = true;
+        for (int i = 0; i < operands; i++)
+            constant = constant && args [i].op == OP_CONST;
+        if (constant) {
+            double value = s_apply (op,
+                args [0].number,
+                operands > 1 ? args [1].number : 0,
+                operands > 2 ? args [2].number : 0);
+            parser->size -= operands;
+            parser->depth -= operands;
+            op = OP_CONST;
+            number = value;
+            operands = 0;
+        }
+    }
+    if (parser->size == parser->capacity) {
+        parser->capacity = parser->capacity ? parser->capacity * 2 : 16;
+        parser->code = (s_instruction_t *) realloc (parser->code, parser->capacity * sizeof (s_instruction_t));
+        assert (parser->code);
+    }
+    s_instruction_t *instruction = &parser->code [parser->size++];
+    instruction->op = op;
+    instruction->slot = slot;
+    instruction->number = number;
+    parser->depth += 1 - operands;
+    if (parser->depth > EXPRESSION_STACK)
+        s_error (parser, "expression too complex");
+}
+
+//  --------------------------------------------------------------------------
+//  Recursive descent parser, each level emits code of its operands first
+
+static void
+s_skip_spaces (s_parser_t *parser)
+{
+    while (isspace ((unsigned char) *parser->p)) parser->p++;
+}
+
+//  Consume token if it is next in the source
+
+static bool
+s_accept (s_parser_t *parser, const char *token)
+{
+    s_skip_spaces (parser);
+    size_t size = strlen (token);
+    if (strncmp (parser->p, token, size) != 0) return false;
+    //  do not take < from <= or ! from !=
+    if (size == 1 && strchr ("<>=!", *token) && parser->p [1] == '=') return false;
+    parser->p += size;
+    return true;
+}
+
+static void s_parse_select (s_parser_t *parser);
+
+//  Enter nested parse, returns false past the nesting limit. Caller
+//  decrements nesting when it returns true.
+
+static bool
+s_nest (s_parser_t *parser)
+{
+    if (parser->nesting >= EXPRESSION_NESTING) {
+        s_error (parser, "expression nested too deep");
+        return false;
+    }
+    parser->nesting++;
+    return true;
+}
+
+static void
+s_parse_identifier (s_parser_t *parser)
+{
+    const char *start = parser->p;
+    while (isalnum ((unsigned char) *parser->p) || (*parser->p && strchr ("_.@", *parser->p)))
+        parser->p++;
+    char *name = (char *) zmalloc (parser->p - start + 1);
+    memcpy (name, start, parser->p - start);
+
+    int slot = 0;
+    const char *metric = (const char *) zlist_first (parser->metrics);
+    while (metric && !streq (metric, name)) {
+        metric = (const char *) zlist_next (parser->metrics);
+        slot++;
+    }
+    const char *variable = parser->variables ? (const char *) zhashx_lookup (parser->variables, name) : NULL;
+    if (metric)
+        s_emit (parser, OP_SLOT, slot, 0);
+    else
+    if (variable) {
+        rule_param_t param;
+        rule_param_set (&param, variable);
+        if (param.text)
+            s_error (parser, "variable is not a number");
+        else
+            s_emit (parser, OP_CONST, 0, param.number);
+    }
+    else {
+        int i;
+        for (i = 0; s_constants [i].name; i++)
+            if (streq (s_constants [i].name, name)) break;
+        if (s_constants [i].name)
+            s_emit (parser, OP_CONST, 0, s_constants [i].value);
+        else
+            s_error (parser, "unknown identifier");
+    }
+    zstr_free (&name);
+}
+
+static void
+s_parse_primary (s_parser_t *parser)
+{
+    s_skip_spaces (parser);
+    const char *p = parser->p;
+    if (isdigit ((unsigned char) *p) || (*p == '.' && isdigit ((unsigned char) p [1]))) {
+        char *end;
+        double number = strtod (p, &end);
+        parser->p = end;
+        s_emit (parser, OP_CONST, 0, number);
+    }
+    else
+    if (isalpha ((unsigned char) *p) || *p == '_')
+        s_parse_identifier (parser);
+    else
+    if (s_accept (parser, "(")) {
+        if (!s_nest (parser)) return;
+        s_parse_select (parser);
+        parser->nesting--;
+        if (!s_accept (parser, ")"))
+            s_error (parser, "missing )");
+    }
+    else
+        s_error (parser, "syntax error");
+}
+
+static void
+s_parse_unary (s_parser_t *parser)
+{
+    if (parser->error) return;
+    if (s_accept (parser, "-")) {
+        if (!s_nest (parser)) return;
+        s_parse_unary (parser);
+        parser->nesting--;
+        s_emit (parser, OP_NEG, 0, 0);
+    }
+    else
+    if (s_accept (parser, "!")) {
+        if (!s_nest (parser)) return;
+        s_parse_unary (parser);
+        parser->nesting--;
+        s_emit (parser, OP_NOT, 0, 0);
+    }
+    else
+        s_parse_primary (parser);
+}
+
+//  Binary operators by priority, from the lowest
+
+static struct {
+    const char *token;
+    int op;
+} s_binary [5][5] = {
+    {{ "||", OP_OR }},
+    {{ "&&", OP_AND }},
+    {{ "==", OP_EQ }, { "!=", OP_NE }},
+    {{ "<=", OP_LE }, { ">=", OP_GE }, { "<", OP_LT }, { ">", OP_GT }},
+    {{ "+", OP_ADD }, { "-", OP_SUB }},
+};
+
+static void
+s_parse_binary (s_parser_t *parser, int level)
+{
+    if (level == 5) {
+        //  * and / bind tighter than any entry of the table
+        s_parse_unary (parser);
+        while (!parser->error) {
+            int op;
+            if (s_accept (parser, "*")) op = OP_MUL;
+            else
+            if (s_accept (parser, "/")) op = OP_DIV;
+            else break;
+            s_parse_unary (parser);
+            s_emit (parser, op, 0, 0);
+        }
+        return;
+    }
+    s_parse_binary (parser, level + 1);
+    while (!parser->error) {
+        int i;
+        for (i = 0; s_binary [level][i].token; i++)
+            if (s_accept (parser, s_binary [level][i].token)) break;
+        if (!s_binary [level][i].token) break;
+        s_parse_binary (parser, level + 1);
+        s_emit (parser, s_binary [level][i].op, 0, 0);
+    }
+}
+
+static void
+s_parse_select (s_parser_t *parser)
+{
+    if (parser->error) return;
+    s_parse_binary (parser, 0);
+    if (s_accept (parser, "?")) {
+        if (!s_nest (parser)) return;
+        s_parse_select (parser);
+        if (!s_accept (parser, ":")) {
+            s_error (parser, "missing :");
+            parser->nesting--;
+            return;
+        }
+        s_parse_select (parser);
+        parser->nesting--;
+        s_emit (parser, OP_SELECT, 0, 0);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Compile expression
+
+expression_t *
+expression_new (const char *source, zlist_t *metrics, zhashx_t *variables)
+{
+    assert (source);
+    assert (metrics);
+    s_parser_t parser = { source, source, metrics, variables, NULL, 0, 0, 0, 0, NULL };
+    s_parse_select (&parser);
+    s_skip_spaces (&parser);
+    if (*parser.p)
+        s_error (&parser, "unexpected input");
+    if (parser.error) {
+        zsys_error ("%s", parser.error);
+        zstr_free (&parser.error);
+        free (parser.code);
+        return NULL;
+    }
+    expression_t *self = (expression_t *) zmalloc (sizeof (expression_t));
+    assert (self);
+    self->code = parser.code;
+    self->size = parser.size;
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the expression
+
+void
+expression_destroy (expression_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        expression_t *self = *self_p;
+        free (self->code);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Evaluate expression
+
+int
+expression_evaluate (expression_t *self, const rule_param_t *params, size_t params_size, double *result)
+{
+    assert (self);
+    assert (result);
+    double stack [EXPRESSION_STACK];
+    int top = -1;
+    const s_instruction_t *instruction = self->code;
+    const s_instruction_t *end = self->code + self->size;
+    for (; instruction < end; instruction++) {
+        switch (instruction->op) {
+            case OP_CONST:
+                stack [++top] = instruction->number;
+                break;
+            case OP_SLOT:
+                if ((size_t) instruction->slot >= params_size || params [instruction->slot].text)
+                    return -1;
+                stack [++top] = params [instruction->slot].number;
+                break;
+            case OP_NEG:
+            case OP_NOT:
+                stack [top] = s_apply (instruction->op, stack [top], 0, 0);
+                break;
+            case OP_SELECT:
+                top -= 2;
+                stack [top] = stack [top] != 0 ? stack [top + 1] : stack [top + 2];
+                break;
+            default:
+                top--;
+                stack [top] = s_apply (instruction->op, stack [top], stack [top + 1], 0);
+                break;
+        }
+    }
+    assert (top == 0);
+    if (!isfinite (stack [0])) return -1;
+    *result = stack [0];
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static double
+s_test_evaluate (const char *source, zlist_t *metrics, zhashx_t *variables, const rule_param_t *params, size_t size)
+{
+    expression_t *self = expression_new (source, metrics, variables);
+    assert (self);
+    double result;
+    int rv = expression_evaluate (self, params, size, &result);
+    assert (rv == 0);
+    expression_destroy (&self);
+    return result;
+}
+
+void
+expression_test (bool verbose)
+{
+    printf (" * expression: ");
+
+    //  @selftest
+    zlist_t *metrics = zlist_new ();
+    zlist_append (metrics, (void *) "load.default");
+    zlist_append (metrics, (void *) "realpower");
+    zhashx_t *variables = zhashx_new ();
+    zhashx_insert (variables, "high_warning", (void *) "60");
+    zhashx_insert (variables, "high_critical", (void *) "90");
+    zhashx_insert (variables, "name", (void *) "ups");
+    rule_param_t params [2];
+    rule_param_set (&params [0], "75");
+    rule_param_set (&params [1], "1500.5");
+
+    //  operators and priorities
+    assert (s_test_evaluate ("1 + 2 * 3", metrics, NULL, NULL, 0) == 7);
+    assert (s_test_evaluate ("(1 + 2) * 3", metrics, NULL, NULL, 0) == 9);
+    assert (s_test_evaluate ("10 - 4 - 3", metrics, NULL, NULL, 0) == 3);
+    assert (s_test_evaluate ("-2 * -3", metrics, NULL, NULL, 0) == 6);
+    assert (s_test_evaluate ("1 < 2 && 2 <= 2 && 3 > 2 && 3 >= 4 == 0", metrics, NULL, NULL, 0) == 1);
+    assert (s_test_evaluate ("0 || !0", metrics, NULL, NULL, 0) == 1);
+    assert (s_test_evaluate ("1 != 1 ? 5 : 1 ? 6 : 7", metrics, NULL, NULL, 0) == 6);
+    assert (s_test_evaluate (".5 + 1e1", metrics, NULL, NULL, 0) == 10.5);
+    assert (s_test_evaluate ("LOW_CRITICAL", metrics, NULL, NULL, 0) == -2);
+
+    //  metrics and variables
+    const char *source =
+        "load.default > high_critical ? HIGH_CRITICAL :"
+        " load.default > high_warning || realpower > 2000 ? HIGH_WARNING : OK";
+    assert (s_test_evaluate (source, metrics, variables, params, 2) == 1);
+    rule_param_set (&params [0], "95");
+    assert (s_test_evaluate (source, metrics, variables, params, 2) == 2);
+    rule_param_set (&params [0], "5");
+    assert (s_test_evaluate (source, metrics, variables, params, 2) == 0);
+    rule_param_set (&params [1], "2500");
+    assert (s_test_evaluate (source, metrics, variables, params, 2) == 1);
+    assert (s_test_evaluate ("realpower / load.default", metrics, NULL, params, 2) == 500);
+
+    //  constants are folded
+    expression_t *self = expression_new ("high_warning * 2 > 100 ? -(1 + 1) : 3", metrics, variables);
+    assert (self);
+    assert (self->size == 1);
+    assert (self->code [0].op == OP_CONST && self->code [0].number == -2);
+    expression_destroy (&self);
+
+    //  evaluation errors
+    double result;
+    self = expression_new ("realpower / load.default", metrics, NULL);
+    assert (self);
+    rule_param_set (&params [0], "0");
+    assert (expression_evaluate (self, params, 2, &result) == -1);
+    rule_param_set (&params [0], "dead");
+    assert (expression_evaluate (self, params, 2, &result) == -1);
+    assert (expression_evaluate (self, params, 1, &result) == -1);
+    expression_destroy (&self);
+
+    //  syntax errors
+    const char *invalid [] = {
+        "", "1 +", "(1", "1 ? 2", "1 2", "unknown > 1", "name > 1", "1 = 2", "$", NULL
+    };
+    for (int i = 0; invalid [i]; i++) {
+        self = expression_new (invalid [i], metrics, variables);
+        assert (self == NULL);
+    }
+    char deep [EXPRESSION_STACK * 16 + 16] = "";
+    for (int i = 0; i <= EXPRESSION_STACK; i++)
+        strcat (deep, "realpower + (");
+    strcat (deep, "1");
+    for (int i = 0; i <= EXPRESSION_STACK; i++)
+        strcat (deep, ")");
+    self = expression_new (deep, metrics, variables);
+    assert (self == NULL);
+
+    //  nesting which does not deepen evaluation stack is limited too, or
+    //  long input would overflow the stack of parser
+    const char *nested [] = { "(", "-", "!", "1 ? 1 : ", NULL };
+    for (int i = 0; nested [i]; i++) {
+        char *input = (char *) zmalloc (100000 * strlen (nested [i]) + 16);
+        assert (input);
+        for (int j = 0; j < 100000; j++)
+            strcat (input + j * strlen (nested [i]), nested [i]);
+        strcat (input, "1");
+        self = expression_new (input, metrics, variables);
+        assert (self == NULL);
+        free (input);
+    }
+    self = expression_new ("((((-(!1)))))", metrics, variables);
+    assert (self);
+    expression_destroy (&self);
+
+    if (verbose) {
+        self = expression_new (source, metrics, variables);
+        const int count = 1000000;
+        int64_t start = zclock_usecs ();
+        double sum = 0;
+        for (int i = 0; i < count; i++) {
+            params [0].number = i % 100;
+            params [0].text = NULL;
+            expression_evaluate (self, params, 2, &result);
+            sum += result;
+        }
+        printf ("\n    %.1f ns per evaluation (%.0f) ... ",
+                (zclock_usecs () - start) * 1000.0 / count, sum);
+        expression_destroy (&self);
+    }
+
+    zhashx_destroy (&variables);
+    zlist_destroy (&metrics);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,64 @@
+/*  =========================================================================
+    expression - Compiled rule expression
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef EXPRESSION_H_INCLUDED
+#define EXPRESSION_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structures to allow forward references
+#ifndef EXPRESSION_T_DEFINED
+typedef struct _expression_t expression_t;
+#define EXPRESSION_T_DEFINED
+#endif
+
+//  @interface
+//  Compile expression. Identifiers are names of metrics, which are taken
+//  from evaluate params in the order of the metrics list, names of
+//  variables, whose values must be numbers, or result constants (OK,
+//  HIGH_WARNING, ...). Returns NULL and logs the reason if source is not
+//  a valid expression.
+ZM_ALERT_PRIVATE expression_t *
+    expression_new (const char *source, zlist_t *metrics, zhashx_t *variables);
+
+//  Destroy the expression
+ZM_ALERT_PRIVATE void
+    expression_destroy (expression_t **self_p);
+
+//  Evaluate expression with metric values, does not allocate. Returns 0
+//  and stores value to result, -1 if metric is missing or is not a number
+//  or if the value is not finite.
+ZM_ALERT_PRIVATE int
+    expression_evaluate (expression_t *self, const rule_param_t *params, size_t params_size, double *result);
+
+//  Self test of this class
+ZM_ALERT_PRIVATE void
+    expression_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,21 +23,245 @@
 @header
     flexible_alert - Main class for evaluating alerts
 @discuss
+    By default the actor receives, evaluates and publishes in one thread.
+    After "WORKERS"/count command it only decodes incoming messages and
+    hands them to count worker actors, choosing the worker by hash of the
+    asset name. Every worker has its own rules, lua states, assets and
+    metric cache, and passes alerts back to the actor which publishes them.
+    After "SHAREDLUA" command all rules (of every worker) are compiled into
+    one lua state, each into its own environment table, instead of a lua
+    state per rule.
+    Alert of rule and asset is published only when its result or message
+    changes, or to refresh it when half of its ttl passed. Mailbox command
+    STATS returns numbers of sent and suppressed alerts.
+    Evaluation of rule with several metrics and coalescing window (see
+    rule_coalesce) is deferred until the window closes or all its metrics
+    arrive, so a burst of metrics evaluates the rule once.
+    Rules are compiled when loaded. After "LUACACHE"/dir command compiled
+    bytecode is cached in dir, which makes the next start faster.
+    After "BATCH"/ms command native threshold rules are not evaluated when
+    their metric arrives, but once per ms tick for all their assets with
+    new values at once, see rule_evaluate_batch.
+    Directory given by "LOADRULES" is watched with inotify. Rule file
+    written, moved in or deleted there is loaded or removed alone, other
+    rules keep their compiled state.
+    After "SNAPSHOT"/path command (sent after "LOADRULES") asset
+    attributes, cached metrics and state of published alerts are restored
+    from path and written there every minute and when the actor ends, so
+    rules fire right after restart. Expired metrics are not restored. The
+    agent restores the snapshot with the first message it handles, with
+    "WORKERS" each worker restores its own shard of it.
+    Matching attributes of every announced asset are kept in asset_index,
+    so rule added, replaced or deleted is bound to or unbound from just the
+    assets it is valid for, without waiting for assets to be republished.
 @end
 */
 
 #include "zm_alert_classes.h"
+#include <sys/inotify.h>
+#include <sys/mman.h>
+
+#include <lauxlib.h>
+#include <lualib.h>
+
+//  Inputs of threshold rule evaluation gathered from its assets with new
+//  values, see s_flush_batch
+
+typedef struct {
+    double *values;             //  Metric values
+    int *results;               //  Results of rule_evaluate_batch
+    asset_t **assets;
+    asset_binding_t **bindings;
+    int *ttls;                  //  TTL of metrics
+    size_t capacity;
+} batch_t;
 
 //  Structure of our class
 
 struct _flexible_alert_t {
     zhash_t *rules;
+    rule_index_t *index;
     zhash_t *assets;
-    zhash_t *metrics;
+    asset_index_t *asset_index; //  Matching attributes of known assets
+    metrics_t *metrics;
     zhash_t *enames;
-    mlm_client_t *mlm;
+    atoms_t *atoms;
+    mlm_client_t *mlm;          //  Malamute client, NULL in worker
+    zsock_t *pipe;              //  Worker pipe for alerts, not owned
+    zactor_t **workers;         //  Evaluation workers
+    size_t workers_size;
+    size_t stats_pending;       //  Workers yet to reply STATS
+    uint64_t stats_sent;        //  Sums of STATS replies of workers
+    uint64_t stats_suppressed;
+    lua_State *lua;             //  Shared lua state, NULL means state per rule
+    char *luacache;             //  Bytecode cache directory, NULL means none
+    rule_param_t *params;       //  Evaluation parameters, reused
+    size_t params_capacity;
+    uint64_t alerts_sent;       //  Published alerts
+    uint64_t alerts_suppressed; //  Alerts not published, nothing changed
+    zlist_t *pending;           //  Deferred evaluations, pending_queue_t
+    int batch;                  //  Batch tick in ms, 0 means no batching
+    int64_t batch_deadline;     //  Monotonic time (ms) of the next tick
+    zhashx_t *batches;          //  rule_t * -> zlist_t of pending_t
+    batch_t gather;             //  Inputs of one batch, reused
+    uint64_t generation;        //  Rule set generation, bumped on change
+    uint64_t horizon;           //  Oldest generation LIST/since can answer
+    zhashx_t *generations;      //  Rule name -> generation of last change
+    zlist_t *removed;           //  Log of removed rules, removed_t
+    zmsg_t *list;               //  Prebuilt LIST reply rules, NULL if none
+    uint64_t list_generation;   //  Generation of prebuilt LIST reply
+    rule_t **sorted;            //  Rules ordered by name for LIST pages
+    size_t sorted_size;
+    uint64_t sorted_generation; //  Generation of sorted, 0 if never built
+    zhashx_t *files;            //  Rule file path -> file_t
+    zactor_t *watcher;          //  Rule directory watcher, NULL if none
+    char *snapshot;             //  Snapshot file, NULL means none
+    bool snapshot_loaded;       //  Snapshot restored, state is saved to it
+    int64_t snapshot_deadline;  //  Monotonic time (ms) of the next snapshot
 };
 
+//  Snapshot is written this often (ms) and when agent terminates
+#define SNAPSHOT_INTERVAL 60000
+#define SNAPSHOT_MAGIC "ZMAS"
+#define SNAPSHOT_VERSION 1
+
+//  Rule file as it was loaded, to skip events caused by the agent itself
+//  and to find the rule of deleted file
+
+typedef struct {
+    char *name;                 //  Rule name
+    uint64_t generation;        //  Generation of rule loaded from file
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} file_t;
+
+static void
+s_file_destroy (file_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        file_t *self = *self_p;
+        zstr_free (&self->name);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Maximal number of rules in one page of LIST reply
+#define LIST_PAGE_LIMIT 500
+
+//  Removed rules are remembered for LIST/since, only last ones are kept
+#define REMOVED_LOG_SIZE 1024
+
+typedef struct {
+    uint64_t generation;        //  Generation of removal
+    char *name;                 //  Rule name
+} removed_t;
+
+static void
+s_removed_destroy (removed_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        removed_t *self = *self_p;
+        zstr_free (&self->name);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Generations are 64 bit even where pointers are not, so they are stored
+//  in own allocation rather than in the item pointer
+
+static void *
+s_generation_dup (const void *generation)
+{
+    uint64_t *self = (uint64_t *) malloc (sizeof (uint64_t));
+    assert (self);
+    *self = *(const uint64_t *) generation;
+    return self;
+}
+
+static void
+s_generation_destroy (uint64_t **self_p)
+{
+    assert (self_p);
+    free (*self_p);
+    *self_p = NULL;
+}
+
+//  Generation of the last change of rule, 0 if it is unknown
+
+static uint64_t
+s_generation (flexible_alert_t *self, const char *name)
+{
+    const uint64_t *generation = (const uint64_t *) zhashx_lookup (self->generations, name);
+    return generation ? *generation : 0;
+}
+
+//  Deferred evaluation of rule for asset. Binding is looked up again when
+//  the evaluation is due, entries of unbound rules or deleted assets are
+//  just dropped then.
+
+typedef struct {
+    char *asset;                //  Asset name
+    rule_t *rule;               //  Rule, used only to find the binding
+    int64_t deadline;           //  Deadline of binding when deferred
+} pending_t;
+
+static void
+s_pending_destroy (pending_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        pending_t *self = *self_p;
+        zstr_free (&self->asset);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Deferred evaluations of rules with the same coalescing window. Entries
+//  are appended when their window opens, so deadlines never decrease and
+//  only the first entry can be due.
+
+typedef struct {
+    int window;                 //  Coalescing window in ms
+    zlist_t *queue;             //  Deferred evaluations, pending_t
+} pending_queue_t;
+
+static void
+s_batch_list_destroy (zlist_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        pending_t *pending = (pending_t *) zlist_first (*self_p);
+        while (pending) {
+            s_pending_destroy (&pending);
+            pending = (pending_t *) zlist_next (*self_p);
+        }
+        zlist_destroy (self_p);
+    }
+}
+
+//  Batches are keyed by rule pointers
+
+static size_t
+s_id_hash (const void *key)
+{
+    return (size_t) (uintptr_t) key;
+}
+
+static int
+s_id_compare (const void *key1, const void *key2)
+{
+    uintptr_t k1 = (uintptr_t) key1;
+    uintptr_t k2 = (uintptr_t) key2;
+    return k1 < k2 ? -1 : (k1 > k2 ? 1 : 0);
+}
+
 static void rule_freefn (void *rule)
 {
     if (rule) {
@@ -49,41 +273,64 @@ static void rule_freefn (void *rule)
 static void asset_freefn (void *asset)
 {
     if (asset) {
-        zlist_t *self = (zlist_t *) asset;
-        zlist_destroy (&self);
+        asset_t *self = (asset_t *) asset;
+        asset_destroy (&self);
     }
 }
 
-void zmmsg_freefn (void *ptr)
-{
-    if (!ptr) return;
-    zm_proto_t *zm = (zm_proto_t *)ptr;
-    zm_proto_destroy (&zm);
-}
-
 static void ename_freefn (void *ename)
 {
     if (ename) free (ename);
 }
 
 //  --------------------------------------------------------------------------
-//  Create a new flexible_alert
+//  Create a new flexible_alert, worker does not connect to malamute
 
-flexible_alert_t *
-flexible_alert_new (void)
+static flexible_alert_t *
+s_flexible_alert_new (bool worker)
 {
     flexible_alert_t *self = (flexible_alert_t *) zmalloc (sizeof (flexible_alert_t));
     assert (self);
     //  Initialize class properties here
     self->rules = zhash_new ();
+    self->index = rule_index_new ();
     self->assets = zhash_new ();
-    self->metrics = zhash_new ();
+    self->asset_index = asset_index_new ();
+    self->metrics = metrics_new ();
     self->enames = zhash_new ();
     zhash_autofree (self->enames);
-    self->mlm = mlm_client_new ();
+    self->atoms = atoms_new ();
+    self->pending = zlist_new ();
+    self->batches = zhashx_new ();
+    zhashx_set_key_duplicator (self->batches, NULL);
+    zhashx_set_key_destructor (self->batches, NULL);
+    zhashx_set_key_hasher (self->batches, s_id_hash);
+    zhashx_set_key_comparator (self->batches, s_id_compare);
+    zhashx_set_destructor (self->batches, (zhashx_destructor_fn *) s_batch_list_destroy);
+    //  Generations start at wall clock time, so generation from previous
+    //  run of agent is older than horizon and is never taken for current
+    self->generation = (uint64_t) zclock_time ();
+    self->horizon = self->generation;
+    self->generations = zhashx_new ();
+    zhashx_set_duplicator (self->generations, s_generation_dup);
+    zhashx_set_destructor (self->generations, (zhashx_destructor_fn *) s_generation_destroy);
+    self->removed = zlist_new ();
+    self->files = zhashx_new ();
+    zhashx_set_destructor (self->files, (zhashx_destructor_fn *) s_file_destroy);
+    if (!worker)
+        self->mlm = mlm_client_new ();
     return self;
 }
 
+//  --------------------------------------------------------------------------
+//  Create a new flexible_alert
+
+flexible_alert_t *
+flexible_alert_new (void)
+{
+    return s_flexible_alert_new (false);
+}
+
 //  --------------------------------------------------------------------------
 //  Destroy the flexible_alert
 
@@ -94,34 +341,409 @@ flexible_alert_destroy (flexible_alert_t **self_p)
     if (*self_p) {
         flexible_alert_t *self = *self_p;
         //  Free class properties here
-        zhash_destroy (&self->rules);
+        for (size_t i = 0; i < self->workers_size; i++)
+            zactor_destroy (&self->workers [i]);
+        free (self->workers);
         zhash_destroy (&self->assets);
-        zhash_destroy (&self->metrics);
+        asset_index_destroy (&self->asset_index);
+        rule_index_destroy (&self->index);
+        zhash_destroy (&self->rules);
+        metrics_destroy (&self->metrics);
         zhash_destroy (&self->enames);
-        mlm_client_destroy (&self->mlm);
+        atoms_destroy (&self->atoms);
+        if (self->lua)
+            lua_close (self->lua);
+        zstr_free (&self->luacache);
+        free (self->params);
+        pending_queue_t *queue = (pending_queue_t *) zlist_first (self->pending);
+        while (queue) {
+            s_batch_list_destroy (&queue->queue);
+            free (queue);
+            queue = (pending_queue_t *) zlist_next (self->pending);
+        }
+        zlist_destroy (&self->pending);
+        zhashx_destroy (&self->batches);
+        zhashx_destroy (&self->generations);
+        removed_t *removed = (removed_t *) zlist_first (self->removed);
+        while (removed) {
+            s_removed_destroy (&removed);
+            removed = (removed_t *) zlist_next (self->removed);
+        }
+        zlist_destroy (&self->removed);
+        zmsg_destroy (&self->list);
+        free (self->sorted);
+        zactor_destroy (&self->watcher);
+        zhashx_destroy (&self->files);
+        zstr_free (&self->snapshot);
+        free (self->gather.values);
+        free (self->gather.results);
+        free (self->gather.assets);
+        free (self->gather.bindings);
+        free (self->gather.ttls);
+        if (self->mlm)
+            mlm_client_destroy (&self->mlm);
         //  Free object itself
         free (self);
         *self_p = NULL;
     }
 }
 
+//  --------------------------------------------------------------------------
+//  Point deferred and batched evaluations of rule to newrule, which replaces
+//  it under the same name.
+
+static void
+s_repoint_deferred (flexible_alert_t *self, rule_t *rule, rule_t *newrule)
+{
+    pending_queue_t *queue = (pending_queue_t *) zlist_first (self->pending);
+    while (queue) {
+        pending_t *pending = (pending_t *) zlist_first (queue->queue);
+        while (pending) {
+            if (pending->rule == rule)
+                pending->rule = newrule;
+            pending = (pending_t *) zlist_next (queue->queue);
+        }
+        queue = (pending_queue_t *) zlist_next (self->pending);
+    }
+    zlist_t *pendings = (zlist_t *) zhashx_lookup (self->batches, rule);
+    if (pendings) {
+        pending_t *pending = (pending_t *) zlist_first (pendings);
+        while (pending) {
+            pending->rule = newrule;
+            pending = (pending_t *) zlist_next (pendings);
+        }
+        zhashx_rename (self->batches, rule, newrule);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Unbind rule from its assets and bind newrule to assets it is valid for.
+//  Either can be NULL. Only assets found for the rules in asset index are
+//  touched, asset left without rules is dropped. If newrule replaces rule,
+//  assets matching both keep the evaluation state of their binding, the
+//  memoized result only if the rule did not change at all.
+
+static void
+s_rebind_rule (flexible_alert_t *self, rule_t *rule, rule_t *newrule)
+{
+    bool same = false;
+    if (rule && newrule) {
+        size_t size, newsize;
+        const char *json = rule_json_cached (rule, &size);
+        const char *newjson = rule_json_cached (newrule, &newsize);
+        same = json && newjson && size == newsize && memcmp (json, newjson, size) == 0;
+        s_repoint_deferred (self, rule, newrule);
+    }
+    else
+    if (rule)
+        //  batch is keyed by rule pointer, which is freed with the rule
+        zhashx_delete (self->batches, rule);
+
+    if (newrule) {
+        zlist_t *names = asset_index_match (self->asset_index, newrule);
+        const char *name = (const char *) zlist_first (names);
+        while (name) {
+            asset_t *asset = (asset_t *) zhash_lookup (self->assets, name);
+            if (!asset) {
+                asset = asset_new (name, atoms_intern (self->atoms, name));
+                zhash_update (self->assets, name, asset);
+                zhash_freefn (self->assets, name, asset_freefn);
+            }
+            asset_binding_t *binding = rule ? asset_rebind_rule (asset, rule, newrule) : NULL;
+            if (binding) {
+                //  metrics of new rule may differ, window waits for deadline
+                binding->refreshed = 0;
+                if (!same) binding->memoized = false;
+            }
+            else
+            if (!asset_has_rule (asset, newrule))
+                asset_bind_rule (asset, newrule);
+            name = (const char *) zlist_next (names);
+        }
+        zlist_destroy (&names);
+    }
+    if (rule) {
+        zlist_t *names = asset_index_match (self->asset_index, rule);
+        const char *name = (const char *) zlist_first (names);
+        while (name) {
+            asset_t *asset = (asset_t *) zhash_lookup (self->assets, name);
+            if (asset && asset_has_rule (asset, rule)) {
+                asset_unbind_rule (asset, rule);
+                if (asset_rules_size (asset) == 0)
+                    zhash_delete (self->assets, name);
+            }
+            name = (const char *) zlist_next (names);
+        }
+        zlist_destroy (&names);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Receive message from worker. Alert is published, STATS reply is added
+//  to the stats being collected.
+
+static void
+s_workers_recv (flexible_alert_t *self, zactor_t *worker)
+{
+    zmsg_t *msg = zmsg_recv (worker);
+    if (!msg) return;
+    char *cmd = zmsg_popstr (msg);
+    if (cmd && streq (cmd, "ALERT")) {
+        char *topic = zmsg_popstr (msg);
+        if (topic)
+            mlm_client_send (self->mlm, topic, &msg);
+        zstr_free (&topic);
+    }
+    else
+    if (cmd && streq (cmd, "STATS")) {
+        char *value = zmsg_popstr (msg);
+        self->stats_sent += value ? strtoull (value, NULL, 10) : 0;
+        zstr_free (&value);
+        value = zmsg_popstr (msg);
+        self->stats_suppressed += value ? strtoull (value, NULL, 10) : 0;
+        zstr_free (&value);
+        if (self->stats_pending) self->stats_pending--;
+    }
+    zstr_free (&cmd);
+    zmsg_destroy (&msg);
+}
+
+//  --------------------------------------------------------------------------
+//  Wait up to timeout ms for messages of workers and receive them. If
+//  target is not NULL, return as soon as it can accept a message.
+
+static void
+s_workers_poll (flexible_alert_t *self, zactor_t *target, int timeout)
+{
+    size_t size = self->workers_size;
+    zmq_pollitem_t items [size + 1];
+    for (size_t i = 0; i < size; i++)
+        items [i] = (zmq_pollitem_t) { zsock_resolve (self->workers [i]), 0, ZMQ_POLLIN, 0 };
+    if (target)
+        items [size] = (zmq_pollitem_t) { zsock_resolve (target), 0, ZMQ_POLLOUT, 0 };
+    if (zmq_poll (items, size + (target ? 1 : 0), timeout) <= 0) return;
+    for (size_t i = 0; i < size; i++)
+        if (items [i].revents & ZMQ_POLLIN)
+            s_workers_recv (self, self->workers [i]);
+}
+
+//  --------------------------------------------------------------------------
+//  Send message to worker without blocking on full pipe. Worker blocks too
+//  when its alerts are not read, so alerts of all workers are published
+//  while waiting for the pipe.
+
+static void
+s_workers_send (flexible_alert_t *self, zactor_t *worker, zmsg_t **msg_p)
+{
+    while (!(zsock_events (worker) & ZMQ_POLLOUT)) {
+        if (zsys_interrupted) {
+            zmsg_destroy (msg_p);
+            return;
+        }
+        s_workers_poll (self, worker, 100);
+    }
+    zmsg_send (msg_p, worker);
+}
+
+//  --------------------------------------------------------------------------
+//  Send command with one string argument to all workers
+
+static void
+s_workers_broadcast (flexible_alert_t *self, const char *command, const char *arg)
+{
+    for (size_t i = 0; i < self->workers_size; i++) {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, command);
+        if (arg) zmsg_addstr (msg, arg);
+        s_workers_send (self, self->workers [i], &msg);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Compile rule ahead of the first metric. Agent dispatching to workers does
+//  not evaluate, so it does not compile either.
+
+static void
+s_compile_rule (flexible_alert_t *self, rule_t *rule)
+{
+    if (!self->workers_size)
+        rule_compile (rule, self->luacache);
+}
+
+//  --------------------------------------------------------------------------
+//  Set bytecode cache directory
+
+static void
+s_set_luacache (flexible_alert_t *self, const char *dir)
+{
+    s_workers_broadcast (self, "LUACACHE", dir);
+    zstr_free (&self->luacache);
+    if (dir && *dir) {
+        if (zsys_dir_create (dir) != 0)
+            zsys_error ("can't create lua cache directory %s", dir);
+        self->luacache = strdup (dir);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Compile all rules into one shared lua state
+
+static void
+s_share_lua (flexible_alert_t *self)
+{
+    s_workers_broadcast (self, "SHAREDLUA", NULL);
+    if (self->lua) return;
+
+    self->lua = luaL_newstate ();
+    assert (self->lua);
+    luaL_openlibs (self->lua);
+    rule_t *rule = (rule_t *) zhash_first (self->rules);
+    while (rule) {
+        rule_set_lua (rule, self->lua);
+        s_compile_rule (self, rule);
+        rule = (rule_t *) zhash_next (self->rules);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Set batch tick of threshold rules, 0 evaluates them on metric arrival
+
+static void
+s_set_batch (flexible_alert_t *self, const char *ms)
+{
+    s_workers_broadcast (self, "BATCH", ms);
+    self->batch = ms ? atoi (ms) : 0;
+    if (self->batch < 0) self->batch = 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Bump rule set generation after rule was loaded or removed. Generation of
+//  loaded rule is remembered, removed one goes to the removed log.
+
+static void
+s_rule_changed (flexible_alert_t *self, const char *name, bool removed)
+{
+    self->generation++;
+    if (!removed) {
+        zhashx_update (self->generations, name, &self->generation);
+        return;
+    }
+    zhashx_delete (self->generations, name);
+    removed_t *entry = (removed_t *) zmalloc (sizeof (removed_t));
+    assert (entry);
+    entry->generation = self->generation;
+    entry->name = strdup (name);
+    zlist_append (self->removed, entry);
+    if (zlist_size (self->removed) > REMOVED_LOG_SIZE) {
+        entry = (removed_t *) zlist_pop (self->removed);
+        self->horizon = entry->generation;
+        s_removed_destroy (&entry);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Remove rule from the agent, rule file is not touched
+
+static void
+s_remove_rule (flexible_alert_t *self, rule_t *rule)
+{
+    s_rule_changed (self, rule_name (rule), true);
+    s_rebind_rule (self, rule, NULL);
+    rule_index_remove (self->index, rule);
+    zhash_delete (self->rules, rule_name (rule));
+}
+
 //  --------------------------------------------------------------------------
 //  Load all rules in directory. Rule MUST have ".rule" extension.
 
+//  Add rule loaded from path to the agent, replacing rule of the same name.
+//  Rule is compiled unless loader did it already.
+
+static void
+s_add_rule (flexible_alert_t *self, rule_t *rule, bool compiled, const char *path)
+{
+    rule_intern (rule, self->atoms);
+    if (self->lua) rule_set_lua (rule, self->lua);
+    if (!compiled) s_compile_rule (self, rule);
+    rule_t *old = (rule_t *) zhash_lookup (self->rules, rule_name (rule));
+    if (old)
+        rule_index_remove (self->index, old);
+    s_rebind_rule (self, old, rule);
+    rule_index_add (self->index, rule);
+    zhash_update (self->rules, rule_name (rule), rule);
+    zhash_freefn (self->rules, rule_name (rule), rule_freefn);
+    s_rule_changed (self, rule_name (rule), false);
+
+    struct stat st;
+    if (stat (path, &st) == 0) {
+        file_t *file = (file_t *) zmalloc (sizeof (file_t));
+        assert (file);
+        file->name = strdup (rule_name (rule));
+        file->generation = self->generation;
+        file->dev = st.st_dev;
+        file->ino = st.st_ino;
+        file->size = st.st_size;
+        file->mtime = st.st_mtim;
+        zhashx_update (self->files, path, file);
+    }
+}
+
 void
 flexible_alert_load_one_rule (flexible_alert_t *self, const char *fullpath)
 {
+    s_workers_broadcast (self, "LOADRULE", fullpath);
+
     rule_t *rule = rule_new();
     if (rule_load (rule, fullpath) == 0) {
         zsys_debug ("rule %s loaded", fullpath);
-        zhash_update (self->rules, rule_name (rule), rule);
-        zhash_freefn (self->rules, rule_name (rule), rule_freefn);
+        s_add_rule (self, rule, false, fullpath);
     } else {
         zsys_error ("failed to load rule '%s'", fullpath);
         rule_destroy (&rule);
     }
 }
 
+//  --------------------------------------------------------------------------
+//  Parallel loading of rule directory. Files are split between loader
+//  threads, each one reads, parses and compiles its share into its own
+//  slots of rules array. Agent thread merges them when all are done.
+
+//  Files per loader thread, smaller directories are loaded in one thread
+#define LOADER_CHUNK 64
+
+typedef struct {
+    char **paths;               //  Rule files, not owned
+    rule_t **rules;             //  Loaded rules, NULL for failed file
+    size_t size;
+    const char *luacache;       //  Bytecode cache directory, not owned
+    bool compile;               //  Compile rules, false for shared lua
+} loader_t;
+
+static void
+s_loader_run (loader_t *self)
+{
+    for (size_t i = 0; i < self->size; i++) {
+        rule_t *rule = rule_new ();
+        if (rule_load (rule, self->paths [i]) != 0)
+            rule_destroy (&rule);
+        else
+        if (self->compile)
+            rule_compile (rule, self->luacache);
+        self->rules [i] = rule;
+    }
+}
+
+static void
+s_loader_actor (zsock_t *pipe, void *args)
+{
+    zsock_signal (pipe, 0);
+    s_loader_run ((loader_t *) args);
+    zsock_signal (pipe, 0);
+    // wait for $TERM
+    char *cmd = zstr_recv (pipe);
+    zstr_free (&cmd);
+}
+
 //  --------------------------------------------------------------------------
 //  Load all rules in directory. Rule MUST have ".rule" extension.
 
@@ -129,28 +751,235 @@ void
 flexible_alert_load_rules (flexible_alert_t *self, const char *path)
 {
     if (!self || !path) return;
-    char fullpath [PATH_MAX];
 
     DIR *dir = opendir(path);
     if (!dir) {
         zsys_error ("cannot open rule dir '%s'", path);
         return;
     }
+    zlist_t *files = zlist_new ();
+    zlist_autofree (files);
     struct dirent * entry;
     while ((entry = readdir(dir)) != NULL) {
         zsys_debug ("checking dir entry %s type %i", entry -> d_name, entry -> d_type);
         if (entry -> d_type == DT_LNK || entry -> d_type == DT_REG || entry -> d_type == 0) {
             // file or link
             int l = strlen (entry -> d_name);
-            zsys_debug ("loading rule file: %s", entry -> d_name);
             if ( l > 5 && streq (&(entry -> d_name[l - 5]), ".rule")) {
                 // json file
-                snprintf (fullpath, PATH_MAX, "%s/%s", path, entry -> d_name);
-                flexible_alert_load_one_rule (self, fullpath);
+                char *fullpath = zsys_sprintf ("%s/%s", path, entry -> d_name);
+                zlist_append (files, fullpath);
+                zstr_free (&fullpath);
             }
         }
     }
     closedir(dir);
+
+    // workers load the directory on their own
+    s_workers_broadcast (self, "LOADRULES", path);
+
+    size_t size = zlist_size (files);
+    char **paths = (char **) zmalloc ((size + 1) * sizeof (char *));
+    rule_t **rules = (rule_t **) zmalloc ((size + 1) * sizeof (rule_t *));
+    assert (paths && rules);
+    size_t i = 0;
+    char *fullpath = (char *) zlist_first (files);
+    while (fullpath) {
+        paths [i++] = fullpath;
+        fullpath = (char *) zlist_next (files);
+    }
+
+    // agent dispatching to workers does not compile, shared lua state
+    // can be used only from this thread
+    bool compile = !self->workers_size && !self->lua;
+    long cores = sysconf (_SC_NPROCESSORS_ONLN);
+    size_t count = (size + LOADER_CHUNK - 1) / LOADER_CHUNK;
+    if (cores < 1) cores = 1;
+    if (count > (size_t) cores) count = cores;
+    if (count < 1) count = 1;
+
+    loader_t *loaders = (loader_t *) zmalloc (count * sizeof (loader_t));
+    assert (loaders);
+    size_t first = 0;
+    for (i = 0; i < count; i++) {
+        size_t share = size / count + (i < size % count ? 1 : 0);
+        loaders [i].paths = paths + first;
+        loaders [i].rules = rules + first;
+        loaders [i].size = share;
+        loaders [i].luacache = self->luacache;
+        loaders [i].compile = compile;
+        first += share;
+    }
+    if (count == 1)
+        s_loader_run (&loaders [0]);
+    else {
+        zactor_t **actors = (zactor_t **) zmalloc (count * sizeof (zactor_t *));
+        assert (actors);
+        for (i = 0; i < count; i++) {
+            actors [i] = zactor_new (s_loader_actor, &loaders [i]);
+            assert (actors [i]);
+        }
+        for (i = 0; i < count; i++) {
+            zsock_wait (actors [i]);
+            zactor_destroy (&actors [i]);
+        }
+        free (actors);
+    }
+
+    size_t failed = 0;
+    for (i = 0; i < size; i++) {
+        if (rules [i]) {
+            zsys_debug ("rule %s loaded", paths [i]);
+            s_add_rule (self, rules [i], compile, paths [i]);
+        } else {
+            zsys_error ("failed to load rule '%s'", paths [i]);
+            failed++;
+        }
+    }
+    zsys_info ("loaded %zu rules from %s using %zu threads, %zu failed", size - failed, path, count, failed);
+    free (loaders);
+    free (rules);
+    free (paths);
+    zlist_destroy (&files);
+}
+
+//  --------------------------------------------------------------------------
+//  Rule directory watcher. Sends CHANGED/path for rule file written or moved
+//  to directory, REMOVED/path for rule file deleted or moved away and
+//  OVERFLOW when inotify dropped events.
+
+static void
+s_watcher_actor (zsock_t *pipe, void *args)
+{
+    char *dir = strdup ((const char *) args);
+    int fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch (fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0) {
+        close (fd);
+        fd = -1;
+    }
+    if (fd < 0)
+        zsys_error ("cannot watch rule dir '%s': %s", dir, strerror (errno));
+    zsock_signal (pipe, 0);
+
+    zmq_pollitem_t items [] = {
+        { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 },
+        { NULL, fd, ZMQ_POLLIN, 0 }
+    };
+    char buffer [4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    while (!zsys_interrupted) {
+        if (zmq_poll (items, fd >= 0 ? 2 : 1, -1) == -1)
+            break;
+        if (items [0].revents & ZMQ_POLLIN) {
+            char *cmd = zstr_recv (pipe);
+            bool term = !cmd || streq (cmd, "$TERM");
+            zstr_free (&cmd);
+            if (term) break;
+        }
+        if (!(items [1].revents & ZMQ_POLLIN))
+            continue;
+        ssize_t size;
+        while ((size = read (fd, buffer, sizeof (buffer))) > 0) {
+            char *p = buffer;
+            while (p < buffer + size) {
+                struct inotify_event *event = (struct inotify_event *) p;
+                p += sizeof (struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    zstr_send (pipe, "OVERFLOW");
+                    continue;
+                }
+                size_t l = event->len ? strlen (event->name) : 0;
+                if (l <= 5 || !streq (&event->name [l - 5], ".rule"))
+                    continue;
+                char *path = zsys_sprintf ("%s/%s", dir, event->name);
+                bool removed = event->mask & (IN_DELETE | IN_MOVED_FROM);
+                zstr_sendx (pipe, removed ? "REMOVED" : "CHANGED", path, NULL);
+                zstr_free (&path);
+            }
+        }
+    }
+    if (fd >= 0) close (fd);
+    free (dir);
+}
+
+//  Start watching rule directory, watcher replaces the previous one
+
+static void
+s_watch_rules (flexible_alert_t *self, zpoller_t *poller, const char *dir)
+{
+    if (self->watcher) {
+        zpoller_remove (poller, self->watcher);
+        zactor_destroy (&self->watcher);
+    }
+    self->watcher = zactor_new (s_watcher_actor, (void *) dir);
+    assert (self->watcher);
+    zpoller_add (poller, self->watcher);
+}
+
+//  Apply one event of rule directory watcher. Changed file is loaded only
+//  when it differs from the file rule was loaded from, so rules saved by
+//  ADD are not loaded twice. Rule of removed file is removed when it was
+//  not replaced from another file since.
+
+static void
+s_watcher_event (flexible_alert_t *self, const char *dir)
+{
+    zmsg_t *msg = zmsg_recv (self->watcher);
+    char *event = zmsg_popstr (msg);
+    char *path = zmsg_popstr (msg);
+    if (event && streq (event, "OVERFLOW")) {
+        zsys_warning ("rule dir '%s' changed too much, loading it again", dir);
+        flexible_alert_load_rules (self, dir);
+    }
+    else
+    if (event && path && streq (event, "CHANGED")) {
+        file_t *file = (file_t *) zhashx_lookup (self->files, path);
+        struct stat st;
+        if (stat (path, &st) != 0)
+            ;   // gone already, REMOVED follows
+        else
+        if (file
+        &&  zhash_lookup (self->rules, file->name)
+        &&  file->dev == st.st_dev && file->ino == st.st_ino && file->size == st.st_size
+        &&  file->mtime.tv_sec == st.st_mtim.tv_sec && file->mtime.tv_nsec == st.st_mtim.tv_nsec)
+            zsys_debug ("rule file %s not changed", path);
+        else {
+            zsys_info ("rule file %s changed, loading it", path);
+            char *oldname = file ? strdup (file->name) : NULL;
+            uint64_t oldgeneration = file ? file->generation : 0;
+            flexible_alert_load_one_rule (self, path);
+
+            //  rule was renamed in the file, remove the old one unless it
+            //  was replaced from another file since
+            file = (file_t *) zhashx_lookup (self->files, path);
+            if (oldname && file && !streq (file->name, oldname)) {
+                uint64_t current = s_generation (self, oldname);
+                rule_t *rule = (rule_t *) zhash_lookup (self->rules, oldname);
+                if (rule && current == oldgeneration) {
+                    zsys_info ("rule %s renamed to %s, removing it", oldname, file->name);
+                    s_workers_broadcast (self, "DELETERULE", oldname);
+                    s_remove_rule (self, rule);
+                }
+            }
+            zstr_free (&oldname);
+        }
+    }
+    else
+    if (event && path && streq (event, "REMOVED")) {
+        file_t *file = (file_t *) zhashx_lookup (self->files, path);
+        if (file) {
+            uint64_t current = s_generation (self, file->name);
+            rule_t *rule = (rule_t *) zhash_lookup (self->rules, file->name);
+            if (rule && current == file->generation) {
+                zsys_info ("rule file %s removed, removing rule %s", path, file->name);
+                s_workers_broadcast (self, "DELETERULE", file->name);
+                s_remove_rule (self, rule);
+            }
+            zhashx_delete (self->files, path);
+        }
+    }
+    zstr_free (&event);
+    zstr_free (&path);
+    zmsg_destroy (&msg);
 }
 
 void
@@ -174,56 +1003,710 @@ flexible_alert_send_alert (flexible_alert_t *self, const char *rulename, const c
         severity,
         message);
 
-    mlm_client_send (self -> mlm, topic, &alert);
+    self->alerts_sent++;
+    if (self->mlm) {
+        mlm_client_send (self -> mlm, topic, &alert);
+    }
+    else
+    if (self->pipe) {
+        // worker, actor publishes the alert
+        zmsg_pushstr (alert, topic);
+        zmsg_pushstr (alert, "ALERT");
+        zmsg_send (&alert, self->pipe);
+    }
 
     zstr_free (&topic);
     zmsg_destroy (&alert);
 }
 
 
+//  --------------------------------------------------------------------------
+//  FNV-1a hash of data, continuing from hash
+
+#define FNV_OFFSET 14695981039346656037ULL
+
+static uint64_t
+s_hash (uint64_t hash, const void *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ ((const byte *) data) [i]) * 1099511628211ULL;
+    return hash;
+}
+
+//  Fingerprint of evaluation inputs, parameters and ename
+
+static uint64_t
+s_fingerprint (const rule_param_t *params, size_t size, const char *ename)
+{
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < size; i++) {
+        //  texts include terminating zero to separate parameters
+        if (params [i].text)
+            hash = s_hash (hash, params [i].text, strlen (params [i].text) + 1);
+        else
+            hash = s_hash (hash, &params [i].number, sizeof (params [i].number));
+    }
+    if (ename)
+        hash = s_hash (hash, ename, strlen (ename));
+    return hash;
+}
+
+//  --------------------------------------------------------------------------
+//  Publish result of rule evaluated for asset, if it differs from the last
+//  published one or the last alert is about to expire
+
+static void
+s_publish (flexible_alert_t *self, asset_binding_t *binding, const char *assetname, int result, const char *message, int ttl)
+{
+    uint64_t now = (uint64_t) time (NULL);
+    uint64_t hash = message ? s_hash (FNV_OFFSET, message, strlen (message)) : 0;
+    if (binding->published
+    &&  binding->published_result == result
+    &&  binding->published_hash == hash
+    &&  now < binding->published + ttl * 5 / 4) {
+        self->alerts_suppressed++;
+        return;
+    }
+    binding->published_result = result;
+    binding->published_hash = hash;
+    flexible_alert_send_alert (
+        self,
+        rule_name (binding->rule),
+        rule_result_actions (binding->rule, result),
+        assetname,
+        result,
+        message, ttl * 5 / 2
+    );
+    binding->published = now;
+}
+
+//  --------------------------------------------------------------------------
+//  Evaluate rule bound to asset. Result of memoized rule is reused while
+//  its inputs do not change.
+
 void
-flexible_alert_evaluate (flexible_alert_t *self, rule_t *rule, const char *assetname, const char *ename)
+flexible_alert_evaluate (flexible_alert_t *self, asset_binding_t *binding, asset_t *asset, const char *ename)
 {
-    zlist_t *params = zlist_new ();
-    zlist_autofree (params);
+    rule_t *rule = binding->rule;
+    const char *assetname = asset_name (asset);
 
-    // prepare lua function parameters
+    // prepare lua function parameters, texts are owned by metrics cache
     int ttl = 0;
 
-    const char *param = rule_metric_first (rule);
-    while (param) {
-        char *topic = zsys_sprintf ("%s@%s", param, assetname);
-        zm_proto_t *zmmsg = (zm_proto_t *) zhash_lookup (self->metrics, topic);
+    size_t size;
+    const uint32_t *metric_ids = rule_metric_ids (rule, &size);
+    if (size > self->params_capacity) {
+        free (self->params);
+        self->params = (rule_param_t *) zmalloc (size * sizeof (rule_param_t));
+        assert (self->params);
+        self->params_capacity = size;
+    }
+    for (size_t i = 0; i < size; i++) {
+        zm_proto_t *zmmsg = metrics_lookup (self->metrics, METRICS_KEY (asset_id (asset), metric_ids [i]), &self->params [i]);
         if (!zmmsg) {
             // some metrics are missing
-            zlist_destroy (&params);
-            zsys_debug ("missing metric %s", topic);
-            zstr_free (&topic);
+            zsys_debug ("missing metric %s@%s", atoms_name (self->atoms, metric_ids [i]), assetname);
             return;
         }
         // TTL should be set accorning shortest ttl in metric
         if (ttl == 0 || ttl > zm_proto_ttl (zmmsg)) ttl = zm_proto_ttl (zmmsg);
-        zstr_free (&topic);
-        zlist_append (params, (char *) zm_proto_value (zmmsg));
-        param = rule_metric_next (rule);
+    }
+
+    uint64_t fingerprint = 0;
+    if (rule_memoize (rule)) {
+        fingerprint = s_fingerprint (self->params, size, ename);
+        if (binding->memoized && binding->fingerprint == fingerprint) {
+            s_publish (self, binding, assetname, binding->result, binding->message, ttl);
+            return;
+        }
     }
 
     // call the lua function
     char *message;
     int result;
 
-    rule_evaluate (rule, params, assetname, ename, &result, &message);
+    rule_evaluate (rule, self->params, size, assetname, ename, &result, &message);
     if (result != RULE_ERROR);
-    flexible_alert_send_alert (
-        self,
-        rule_name (rule),
-        rule_result_actions (rule, result),
-        assetname,
-        result,
-        message, ttl * 5 / 2
-    );
-    zstr_free (&message);
-    zlist_destroy (&params);
+    s_publish (self, binding, assetname, result, message, ttl);
+    if (rule_memoize (rule)) {
+        zstr_free (&binding->message);
+        binding->message = message;
+        binding->result = result;
+        binding->fingerprint = fingerprint;
+        binding->memoized = true;
+    }
+    else
+        zstr_free (&message);
+}
+
+//  --------------------------------------------------------------------------
+//  Defer evaluation of rule with coalescing window after arrival of metric.
+//  Returns true if evaluation is deferred, false if rule shall be evaluated
+//  now, because it does not coalesce or all its metrics were refreshed.
+
+static bool
+s_coalesce (flexible_alert_t *self, asset_binding_t *binding, asset_t *asset, uint32_t metric_id)
+{
+    int window = rule_coalesce (binding->rule);
+    size_t size;
+    const uint32_t *ids = rule_metric_ids (binding->rule, &size);
+    if (window <= 0 || size < 2) return false;
+
+    if (!binding->pending) {
+        binding->pending = true;
+        binding->refreshed = 0;
+        binding->deadline = zclock_mono () + window;
+        pending_queue_t *queue = (pending_queue_t *) zlist_first (self->pending);
+        while (queue && queue->window != window)
+            queue = (pending_queue_t *) zlist_next (self->pending);
+        if (!queue) {
+            queue = (pending_queue_t *) zmalloc (sizeof (pending_queue_t));
+            assert (queue);
+            queue->window = window;
+            queue->queue = zlist_new ();
+            zlist_append (self->pending, queue);
+        }
+        pending_t *pending = (pending_t *) zmalloc (sizeof (pending_t));
+        assert (pending);
+        pending->asset = strdup (asset_name (asset));
+        pending->rule = binding->rule;
+        pending->deadline = binding->deadline;
+        zlist_append (queue->queue, pending);
+    }
+    //  rules with more than 64 metrics wait for the window to close
+    for (size_t i = 0; i < size && i < 64; i++)
+        if (ids [i] == metric_id)
+            binding->refreshed |= 1ULL << i;
+    if (size > 64 || binding->refreshed != (size == 64 ? UINT64_MAX : (1ULL << size) - 1))
+        return true;
+    binding->pending = false;
+    return false;
+}
+
+//  --------------------------------------------------------------------------
+//  Evaluate deferred rules whose window closed. Returns time to the next
+//  deferred evaluation in ms, -1 if there is none.
+
+static int
+s_flush_pending (flexible_alert_t *self)
+{
+    int64_t now = zclock_mono ();
+    int64_t next = -1;
+    pending_queue_t *queue = (pending_queue_t *) zlist_first (self->pending);
+    while (queue) {
+        pending_t *pending = (pending_t *) zlist_first (queue->queue);
+        while (pending && pending->deadline <= now) {
+            zlist_pop (queue->queue);
+            //  binding completed its window early or opened a new one
+            //  meanwhile, if the deadline differs
+            asset_t *asset = (asset_t *) zhash_lookup (self->assets, pending->asset);
+            asset_binding_t *binding = asset ? asset_binding (asset, pending->rule) : NULL;
+            if (binding && binding->pending && binding->deadline == pending->deadline) {
+                binding->pending = false;
+                const char *ename = (const char *) zhash_lookup (self->enames, pending->asset);
+                flexible_alert_evaluate (self, binding, asset, ename);
+            }
+            s_pending_destroy (&pending);
+            pending = (pending_t *) zlist_first (queue->queue);
+        }
+        if (pending) {
+            if (next < 0 || pending->deadline - now < next)
+                next = pending->deadline - now;
+        }
+        else {
+            //  drop queue of window no rule has used lately
+            zlist_remove (self->pending, queue);
+            zlist_destroy (&queue->queue);
+            free (queue);
+        }
+        queue = (pending_queue_t *) zlist_next (self->pending);
+    }
+    return (int) next;
+}
+
+//  --------------------------------------------------------------------------
+//  Queue threshold rule for the next batch tick after arrival of metric.
+//  Returns true if evaluation is batched.
+
+static bool
+s_batch (flexible_alert_t *self, asset_binding_t *binding, asset_t *asset)
+{
+    if (self->batch <= 0 || !rule_threshold (binding->rule)) return false;
+    if (binding->batched) return true;
+
+    if (zhashx_size (self->batches) == 0)
+        self->batch_deadline = zclock_mono () + self->batch;
+    zlist_t *pendings = (zlist_t *) zhashx_lookup (self->batches, binding->rule);
+    if (!pendings) {
+        pendings = zlist_new ();
+        zhashx_insert (self->batches, binding->rule, pendings);
+    }
+    pending_t *pending = (pending_t *) zmalloc (sizeof (pending_t));
+    assert (pending);
+    pending->asset = strdup (asset_name (asset));
+    pending->rule = binding->rule;
+    zlist_append (pendings, pending);
+    binding->batched = true;
+    return true;
+}
+
+//  Make room for count inputs in gather arrays
+
+static void
+s_gather_reserve (batch_t *gather, size_t count)
+{
+    if (count <= gather->capacity) return;
+    size_t capacity = gather->capacity ? gather->capacity : 64;
+    while (capacity < count) capacity *= 2;
+    gather->values = (double *) realloc (gather->values, capacity * sizeof (double));
+    gather->results = (int *) realloc (gather->results, capacity * sizeof (int));
+    gather->assets = (asset_t **) realloc (gather->assets, capacity * sizeof (asset_t *));
+    gather->bindings = (asset_binding_t **) realloc (gather->bindings, capacity * sizeof (asset_binding_t *));
+    gather->ttls = (int *) realloc (gather->ttls, capacity * sizeof (int));
+    assert (gather->values && gather->results && gather->assets && gather->bindings && gather->ttls);
+    gather->capacity = capacity;
+}
+
+//  --------------------------------------------------------------------------
+//  Evaluate batched threshold rules when tick comes. Values of each rule
+//  are gathered into arrays and classified at once, alerts are published
+//  as usual. Returns time to the next tick in ms, -1 if nothing is batched.
+
+static int
+s_flush_batch (flexible_alert_t *self)
+{
+    if (zhashx_size (self->batches) == 0) return -1;
+    int64_t now = zclock_mono ();
+    if (now < self->batch_deadline)
+        return (int) (self->batch_deadline - now);
+
+    batch_t *gather = &self->gather;
+    zlist_t *pendings = (zlist_t *) zhashx_first (self->batches);
+    while (pendings) {
+        s_gather_reserve (gather, zlist_size (pendings));
+        size_t count = 0;
+        pending_t *pending = (pending_t *) zlist_first (pendings);
+        while (pending) {
+            asset_t *asset = (asset_t *) zhash_lookup (self->assets, pending->asset);
+            asset_binding_t *binding = asset ? asset_binding (asset, pending->rule) : NULL;
+            if (binding && binding->batched) {
+                binding->batched = false;
+                size_t size;
+                const uint32_t *ids = rule_metric_ids (binding->rule, &size);
+                rule_param_t value;
+                zm_proto_t *zmmsg = metrics_lookup (self->metrics, METRICS_KEY (asset_id (asset), ids [0]), &value);
+                if (zmmsg && !value.text) {
+                    gather->values [count] = value.number;
+                    gather->assets [count] = asset;
+                    gather->bindings [count] = binding;
+                    gather->ttls [count] = zm_proto_ttl (zmmsg);
+                    count++;
+                }
+                else
+                if (zmmsg) {
+                    //  text value, evaluate as usual to get the error
+                    const char *ename = (const char *) zhash_lookup (self->enames, pending->asset);
+                    flexible_alert_evaluate (self, binding, asset, ename);
+                }
+            }
+            pending = (pending_t *) zlist_next (pendings);
+        }
+        rule_t *rule = count ? gather->bindings [0]->rule : NULL;
+        if (rule && rule_evaluate_batch (rule, gather->values, count, gather->results) != 0) {
+            //  rule was replaced by one which is not a threshold
+            for (size_t i = 0; i < count; i++) {
+                const char *ename = (const char *) zhash_lookup (self->enames, asset_name (gather->assets [i]));
+                flexible_alert_evaluate (self, gather->bindings [i], gather->assets [i], ename);
+            }
+        }
+        else
+        if (rule) {
+            for (size_t i = 0; i < count; i++) {
+                const char *assetname = asset_name (gather->assets [i]);
+                const char *ename = (const char *) zhash_lookup (self->enames, assetname);
+                char *message = rule_message (rule, gather->results [i], gather->values [i], assetname, ename);
+                s_publish (self, gather->bindings [i], assetname, gather->results [i], message, gather->ttls [i]);
+                zstr_free (&message);
+            }
+        }
+        pendings = (zlist_t *) zhashx_next (self->batches);
+    }
+    zhashx_purge (self->batches);
+    return -1;
+}
+
+//  --------------------------------------------------------------------------
+//  Warm restart snapshot of asset attributes, asset names, cached metrics
+//  and published alert state, so rules can fire right after restart without
+//  waiting for every asset and metric to be published again.
+//
+//  File starts with magic and version (uint32), followed by records: kind
+//  byte, payload size (uint32) and payload. Strings are NUL terminated,
+//  numbers are in host byte order.
+//      'A' asset, attributes (see asset_index_attributes)
+//      'E' asset, ename
+//      'M' time (uint64), ttl (uint32), asset, quantity, value
+//      'S' published (uint64), published result (int32), published
+//          message hash (uint64), asset, rule
+//  Unknown records are skipped. Metrics which expired are not restored,
+//  nor anything the agent received since its start.
+
+typedef struct {
+    byte *data;                 //  NULL when only measuring the size
+    size_t size;
+} writer_t;
+
+static void
+s_put (writer_t *writer, const void *data, size_t size)
+{
+    if (writer->data)
+        memcpy (writer->data + writer->size, data, size);
+    writer->size += size;
+}
+
+static void
+s_put_string (writer_t *writer, const char *string)
+{
+    s_put (writer, string, strlen (string) + 1);
+}
+
+//  Start record, returns offset of its size to be set by s_end_record
+
+static size_t
+s_begin_record (writer_t *writer, char kind)
+{
+    s_put (writer, &kind, 1);
+    size_t offset = writer->size;
+    uint32_t size = 0;
+    s_put (writer, &size, sizeof (size));
+    return offset;
+}
+
+static void
+s_end_record (writer_t *writer, size_t offset)
+{
+    uint32_t size = (uint32_t) (writer->size - offset - sizeof (size));
+    if (writer->data)
+        memcpy (writer->data + offset, &size, sizeof (size));
+}
+
+static void
+s_snapshot_write (flexible_alert_t *self, writer_t *writer)
+{
+    uint32_t version = SNAPSHOT_VERSION;
+    s_put (writer, SNAPSHOT_MAGIC, 4);
+    s_put (writer, &version, sizeof (version));
+
+    const char *name = asset_index_first (self->asset_index);
+    while (name) {
+        size_t size;
+        const char *attributes = asset_index_attributes (self->asset_index, name, &size);
+        size_t record = s_begin_record (writer, 'A');
+        s_put_string (writer, name);
+        s_put (writer, attributes, size);
+        s_end_record (writer, record);
+        name = asset_index_next (self->asset_index);
+    }
+    const char *ename = (const char *) zhash_first (self->enames);
+    while (ename) {
+        size_t record = s_begin_record (writer, 'E');
+        s_put_string (writer, zhash_cursor (self->enames));
+        s_put_string (writer, ename);
+        s_end_record (writer, record);
+        ename = (const char *) zhash_next (self->enames);
+    }
+    zm_proto_t *metric = metrics_first (self->metrics);
+    while (metric) {
+        uint64_t time = zm_proto_time (metric);
+        uint32_t ttl = zm_proto_ttl (metric);
+        size_t record = s_begin_record (writer, 'M');
+        s_put (writer, &time, sizeof (time));
+        s_put (writer, &ttl, sizeof (ttl));
+        s_put_string (writer, zm_proto_device (metric));
+        s_put_string (writer, zm_proto_type (metric));
+        s_put_string (writer, zm_proto_value (metric));
+        s_end_record (writer, record);
+        metric = metrics_next (self->metrics);
+    }
+    asset_t *asset = (asset_t *) zhash_first (self->assets);
+    while (asset) {
+        rule_t *rule = asset_rule_first (asset);
+        while (rule) {
+            asset_binding_t *binding = asset_binding (asset, rule);
+            if (binding && binding->published) {
+                int32_t result = binding->published_result;
+                size_t record = s_begin_record (writer, 'S');
+                s_put (writer, &binding->published, sizeof (binding->published));
+                s_put (writer, &result, sizeof (result));
+                s_put (writer, &binding->published_hash, sizeof (binding->published_hash));
+                s_put_string (writer, asset_name (asset));
+                s_put_string (writer, rule_name (rule));
+                s_end_record (writer, record);
+            }
+            rule = asset_rule_next (asset);
+        }
+        asset = (asset_t *) zhash_next (self->assets);
+    }
+}
+
+//  Write snapshot to memory mapped temporary file and rename it over the
+//  snapshot, so a crash never leaves half written snapshot behind.
+//  Returns 0 on success, -1 otherwise.
+
+static int
+s_snapshot_save (flexible_alert_t *self)
+{
+    if (!self->snapshot) return -1;
+    writer_t writer = { NULL, 0 };
+    s_snapshot_write (self, &writer);
+    size_t size = writer.size;
+
+    char *tmp = zsys_sprintf ("%s.XXXXXX", self->snapshot);
+    int fd = mkstemp (tmp);
+    void *data = MAP_FAILED;
+    //  blocks are allocated before writing, full disk is an error here
+    //  instead of SIGBUS on write to a hole of the mapping
+    if (fd >= 0 && posix_fallocate (fd, 0, size) == 0)
+        data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int rv = -1;
+    if (data != MAP_FAILED) {
+        writer.data = (byte *) data;
+        writer.size = 0;
+        s_snapshot_write (self, &writer);
+        assert (writer.size == size);
+        if (msync (data, size, MS_SYNC) == 0 && munmap (data, size) == 0)
+            rv = 0;
+    }
+    if (fd >= 0 && close (fd) != 0)
+        rv = -1;
+    if (rv == 0 && rename (tmp, self->snapshot) != 0)
+        rv = -1;
+    if (rv != 0) {
+        zsys_error ("can't write snapshot %s", self->snapshot);
+        if (fd >= 0) unlink (tmp);
+    }
+    zstr_free (&tmp);
+    return rv;
+}
+
+//  Read string from record, returns NULL if it is not terminated
+
+static const char *
+s_get_string (const byte **data, const byte *end)
+{
+    const byte *nul = *data < end ? (const byte *) memchr (*data, 0, end - *data) : NULL;
+    if (!nul) return NULL;
+    const char *string = (const char *) *data;
+    *data = nul + 1;
+    return string;
+}
+
+static bool
+s_get (const byte **data, const byte *end, void *value, size_t size)
+{
+    if ((size_t) (end - *data) < size) return false;
+    memcpy (value, *data, size);
+    *data += size;
+    return true;
+}
+
+//  Apply records of snapshot. Assets and enames are restored in first
+//  pass, metrics and alert state in second one, when assets are bound to
+//  rules. Returns number of records applied.
+
+static size_t
+s_snapshot_apply (flexible_alert_t *self, const byte *data, size_t size, int pass)
+{
+    const byte *end = data + size;
+    const byte *p = data + 4 + sizeof (uint32_t);
+    uint64_t now = (uint64_t) time (NULL);
+    size_t applied = 0;
+    while (p < end) {
+        char kind = (char) *p++;
+        uint32_t record_size;
+        if (!s_get (&p, end, &record_size, sizeof (record_size))
+        ||  (size_t) (end - p) < record_size) {
+            zsys_error ("snapshot %s is truncated", self->snapshot);
+            break;
+        }
+        const byte *record = p;
+        const byte *record_end = p + record_size;
+        p = record_end;
+
+        if (pass == 1 && kind == 'A') {
+            const char *name = s_get_string (&record, record_end);
+            if (name && !asset_index_attributes (self->asset_index, name, NULL)
+            &&  asset_index_insert (self->asset_index, name,
+                    (const char *) record, record_end - record) == 0)
+                applied++;
+        }
+        else
+        if (pass == 1 && kind == 'E') {
+            const char *name = s_get_string (&record, record_end);
+            const char *ename = s_get_string (&record, record_end);
+            if (name && ename && !zhash_lookup (self->enames, name)) {
+                zhash_update (self->enames, name, (void *) ename);
+                zhash_freefn (self->enames, name, ename_freefn);
+                applied++;
+            }
+        }
+        else
+        if (pass == 2 && kind == 'M') {
+            uint64_t time;
+            uint32_t ttl;
+            if (!s_get (&record, record_end, &time, sizeof (time))
+            ||  !s_get (&record, record_end, &ttl, sizeof (ttl))
+            ||  time + ttl < now)
+                continue;
+            const char *name = s_get_string (&record, record_end);
+            const char *quantity = s_get_string (&record, record_end);
+            const char *value = s_get_string (&record, record_end);
+            if (!name || !quantity || !value)
+                continue;
+            asset_t *asset = (asset_t *) zhash_lookup (self->assets, name);
+            uint32_t metric_id = atoms_find (self->atoms, quantity);
+            if (!asset || !metric_id || !asset_bindings_for_metric (asset, metric_id))
+                continue;
+            uint64_t key = METRICS_KEY (asset_id (asset), metric_id);
+            if (metrics_lookup (self->metrics, key, NULL))
+                continue;   // received since start, it is newer
+            zmsg_t *msg = zm_proto_encode_metric_v1 (name, time, ttl, NULL, quantity, value, "");
+            zm_proto_t *zmmsg = zm_proto_decode (&msg);
+            if (zmmsg) {
+                metrics_update (self->metrics, key, &zmmsg);
+                applied++;
+            }
+            zm_proto_destroy (&zmmsg);
+        }
+        else
+        if (pass == 2 && kind == 'S') {
+            uint64_t published, hash;
+            int32_t result;
+            if (!s_get (&record, record_end, &published, sizeof (published))
+            ||  !s_get (&record, record_end, &result, sizeof (result))
+            ||  !s_get (&record, record_end, &hash, sizeof (hash)))
+                continue;
+            const char *name = s_get_string (&record, record_end);
+            const char *rulename = s_get_string (&record, record_end);
+            asset_t *asset = name ? (asset_t *) zhash_lookup (self->assets, name) : NULL;
+            rule_t *rule = rulename ? (rule_t *) zhash_lookup (self->rules, rulename) : NULL;
+            asset_binding_t *binding = asset && rule ? asset_binding (asset, rule) : NULL;
+            if (binding && !binding->published) {
+                binding->published = published;
+                binding->published_result = result;
+                binding->published_hash = hash;
+                applied++;
+            }
+        }
+    }
+    return applied;
+}
+
+//  Load snapshot, rules must be loaded already. Returns 0 on success, -1
+//  if there is no usable snapshot.
+
+static int
+s_snapshot_load (flexible_alert_t *self)
+{
+    int fd = open (self->snapshot, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && (size_t) st.st_size >= 4 + sizeof (uint32_t))
+        data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (data == MAP_FAILED) {
+        zsys_error ("can't read snapshot %s", self->snapshot);
+        return -1;
+    }
+    uint32_t version;
+    memcpy (&version, (byte *) data + 4, sizeof (version));
+    if (memcmp (data, SNAPSHOT_MAGIC, 4) != 0 || version != SNAPSHOT_VERSION) {
+        zsys_error ("%s is not a snapshot of this version", self->snapshot);
+        munmap (data, st.st_size);
+        return -1;
+    }
+    size_t assets = s_snapshot_apply (self, (const byte *) data, st.st_size, 1);
+    rule_t *rule = (rule_t *) zhash_first (self->rules);
+    while (rule) {
+        s_rebind_rule (self, NULL, rule);
+        rule = (rule_t *) zhash_next (self->rules);
+    }
+    size_t state = s_snapshot_apply (self, (const byte *) data, st.st_size, 2);
+    munmap (data, st.st_size);
+    zsys_info ("snapshot %s restored, %zu asset records, %zu metric and alert records",
+        self->snapshot, assets, state);
+    return 0;
+}
+
+//  Restore snapshot before the first message is handled, unless workers
+//  keep the state
+
+static void
+s_snapshot_ready (flexible_alert_t *self)
+{
+    if (!self->snapshot || self->snapshot_loaded || self->workers_size) return;
+    s_snapshot_load (self);
+    self->snapshot_loaded = true;
+    self->snapshot_deadline = zclock_mono () + SNAPSHOT_INTERVAL;
+}
+
+//  Set snapshot file. Workers keep a snapshot file each, named by the
+//  worker index and count, as assets are spread to workers by hash of
+//  their name. Agent restores the snapshot when it handles the first
+//  message, as WORKERS may still come and hand the snapshot to workers.
+
+static void
+s_set_snapshot (flexible_alert_t *self, const char *path)
+{
+    zstr_free (&self->snapshot);
+    self->snapshot_loaded = false;
+    if (!path || !*path) return;
+    self->snapshot = strdup (path);
+    if (self->workers_size) {
+        for (size_t i = 0; i < self->workers_size; i++) {
+            zmsg_t *msg = zmsg_new ();
+            zmsg_addstr (msg, "SNAPSHOT");
+            zmsg_addstrf (msg, "%s.%zu-of-%zu", path, i, self->workers_size);
+            s_workers_send (self, self->workers [i], &msg);
+        }
+        return;
+    }
+    if (self->pipe)
+        s_snapshot_ready (self);
+}
+
+//  Write snapshot when it is due, returns ms to the next one or -1
+
+static int
+s_flush_snapshot (flexible_alert_t *self)
+{
+    if (!self->snapshot_loaded || self->workers_size) return -1;
+    int64_t now = zclock_mono ();
+    if (now >= self->snapshot_deadline) {
+        s_snapshot_save (self);
+        self->snapshot_deadline = now + SNAPSHOT_INTERVAL;
+    }
+    return (int) (self->snapshot_deadline - now);
+}
+
+//  --------------------------------------------------------------------------
+//  Run deferred and batched evaluations which are due. Returns time to the
+//  next one in ms, -1 if there is none.
+
+static int
+s_flush (flexible_alert_t *self)
+{
+    int timeouts [] = {
+        s_flush_pending (self),
+        s_flush_batch (self),
+        s_flush_snapshot (self)
+    };
+    int timeout = -1;
+    for (size_t i = 0; i < sizeof (timeouts) / sizeof (timeouts [0]); i++)
+        if (timeouts [i] >= 0 && (timeout < 0 || timeouts [i] < timeout))
+            timeout = timeouts [i];
+    return timeout;
 }
 
 //  --------------------------------------------------------------------------
@@ -232,16 +1715,7 @@ flexible_alert_evaluate (flexible_alert_t *self, rule_t *rule, const char *asset
 void
 flexible_alert_clean_metrics (flexible_alert_t *self)
 {
-    zlist_t *topics = zhash_keys (self->metrics);
-    char *topic = (char *) zlist_first (topics);
-    while (topic) {
-        zm_proto_t *zmmsg = (zm_proto_t *) zhash_lookup (self->metrics, topic);
-        if (zm_proto_time (zmmsg) + zm_proto_ttl (zmmsg) < time (NULL)) {
-            zhash_delete (self->metrics, topic);
-        }
-        topic = (char *) zlist_next (topics);
-    }
-    zlist_destroy (&topics);
+    metrics_expire (self->metrics, time (NULL));
 }
 
 //  --------------------------------------------------------------------------
@@ -254,9 +1728,7 @@ flexible_alert_handle_metric (flexible_alert_t *self, zm_proto_t **zmmsg_p)
     zm_proto_t *zmmsg = *zmmsg_p;
     if (zm_proto_id (zmmsg) != ZM_PROTO_METRIC) return;
 
-    if (zhash_lookup (self->metrics, mlm_client_subject (self->mlm))) {
-        flexible_alert_clean_metrics (self);
-    }
+    flexible_alert_clean_metrics (self);
 
     const char *assetname = zm_proto_device (zmmsg);
     const char *quantity = zm_proto_type (zmmsg);
@@ -279,71 +1751,29 @@ flexible_alert_handle_metric (flexible_alert_t *self, zm_proto_t **zmmsg_p)
             return;
         }
     }
-    zlist_t *functions_for_asset = (zlist_t *) zhash_lookup (self->assets, assetname);
-    if (! functions_for_asset) return;
-
-    // this asset has some evaluation functions
-    char *func = (char *) zlist_first (functions_for_asset);
-    bool metric_saved =  false;
-    while (func) {
-        rule_t *rule = (rule_t *) zhash_lookup (self -> rules, func);
-        if (rule_metric_exists (rule, quantity)) {
-            // we have to evaluate this function for our asset
-            // save metric into cache
-            if (! metric_saved) {
-                zm_proto_set_time (zmmsg, time (NULL));
-                char *topic = zsys_sprintf ("%s@%s", quantity, assetname);
-                zhash_update (self->metrics, topic, zmmsg);
-                zhash_freefn (self->metrics, topic, zmmsg_freefn);
-                *zmmsg_p = NULL;
-                zstr_free (&topic);
-                metric_saved = true;
-            }
-            // evaluate
-            flexible_alert_evaluate (self, rule, assetname, ename);
-        }
-        func = (char *) zlist_next (functions_for_asset);
-    }
-}
-
-//  --------------------------------------------------------------------------
-//  Function returns true if function should be evaluated for particular asset.
-//  This is decided by asset name (json "assets": []) or group (json "groups":[])
-
-static int
-is_rule_for_this_asset (rule_t *rule, zm_proto_t *zmmsg)
-{
-    if (!rule || !zmmsg) return 0;
-
-    if (rule_asset_exists (rule, zm_proto_device (zmmsg)))
-        return 1;
-
-    zhash_t *ext = zm_proto_ext (zmmsg);
-    zlist_t *keys = zhash_keys (ext);
-    char *key = (char *)zlist_first (keys);
-    while (key) {
-        if (strncmp ("group.", key, 6) == 0) {
-            // this is group
-            if (rule_group_exists (rule, (char *) zhash_lookup (ext, key))) {
-                zlist_destroy (&keys);
-                return 1;
-            }
-        }
-        key = (char *)zlist_next (keys);
+    asset_t *asset = (asset_t *) zhash_lookup (self->assets, assetname);
+    if (! asset) return;
+
+    // quantity is unknown when no rule uses it
+    uint32_t metric_id = atoms_find (self->atoms, quantity);
+    if (! metric_id) return;
+
+    // rules of this asset using the metric
+    zlist_t *bindings = asset_bindings_for_metric (asset, metric_id);
+    if (! bindings) return;
+
+    // save metric into cache
+    zm_proto_set_time (zmmsg, time (NULL));
+    metrics_update (self->metrics, METRICS_KEY (asset_id (asset), metric_id), zmmsg_p);
+
+    // evaluate
+    asset_binding_t *binding = (asset_binding_t *) zlist_first (bindings);
+    while (binding) {
+        if (!s_batch (self, binding, asset)
+        &&  !s_coalesce (self, binding, asset, metric_id))
+            flexible_alert_evaluate (self, binding, asset, ename);
+        binding = (asset_binding_t *) zlist_next (bindings);
     }
-    zlist_destroy (&keys);
-
-    if (rule_model_exists (rule, zm_proto_ext_string (zmmsg, "model", "")))
-        return 1;
-    if (rule_model_exists (rule, zm_proto_ext_string (zmmsg, "device.part", "")))
-        return 1;
-
-    if (rule_type_exists (rule, zm_proto_ext_string (zmmsg, "type", "")))
-        return 1;
-    if (rule_type_exists (rule, zm_proto_ext_string (zmmsg, "subtype", "")))
-        return 1;
-
-    return 0;
 }
 
 //  --------------------------------------------------------------------------
@@ -371,30 +1801,32 @@ flexible_alert_handle_asset (flexible_alert_t *self, zm_proto_t *zmmsg)
     }
     */
 
-    zlist_t *functions_for_asset = zlist_new ();
-    zlist_autofree (functions_for_asset);
-
-    rule_t *rule = (rule_t *)zhash_first (self->rules);
-    while (rule) {
-        if (is_rule_for_this_asset (rule, zmmsg)) {
-            zlist_append (functions_for_asset, (char *)rule_name (rule));
-            zsys_debug ("rule '%s' is valid for '%s'", rule_name (rule), assetname);
-        }
-        rule = (rule_t *)zhash_next (self->rules);
+    // attributes are kept also for assets without rules, rule added later
+    // is bound to them without waiting for the asset to be republished
+    asset_index_update (self->asset_index, zmmsg);
+    const char *ename = zm_proto_ext_string (zmmsg, "name", NULL);
+    if (ename) {
+        zhash_update (self->enames, assetname, (void *)ename);
+        zhash_freefn (self->enames, assetname, ename_freefn);
     }
+
+    // rules valid for this asset, decided by asset name (json "assets": []),
+    // group (json "groups": []), model or type
+    zlist_t *functions_for_asset = rule_index_match (self->index, zmmsg);
     if (! zlist_size (functions_for_asset)) {
         zsys_debug ("no rule for %s", assetname);
         zhash_delete (self->assets, assetname);
         zlist_destroy (&functions_for_asset);
         return;
     }
-    zhash_update (self->assets, assetname, functions_for_asset);
-    zhash_freefn (self->assets, assetname, asset_freefn);
-    const char *ename = zm_proto_ext_string (zmmsg, "name", NULL);
-    if (ename) {
-        zhash_update (self->enames, assetname, (void *)ename);
-        zhash_freefn (self->enames, assetname, ename_freefn);
+    asset_t *asset = (asset_t *) zhash_lookup (self->assets, assetname);
+    if (! asset) {
+        asset = asset_new (assetname, atoms_intern (self->atoms, assetname));
+        zhash_update (self->assets, assetname, asset);
+        zhash_freefn (self->assets, assetname, asset_freefn);
     }
+    asset_set_rules (asset, functions_for_asset);
+    zlist_destroy (&functions_for_asset);
 }
 
 //  --------------------------------------------------------------------------
@@ -402,32 +1834,176 @@ flexible_alert_handle_asset (flexible_alert_t *self, zm_proto_t *zmmsg)
 //  type can be all or flexible in this agent
 //  class is just for compatibility with alert engine protocol
 
+//  Add json of rule wrapped for UI as { "flexible": json } to message
+
+static void
+s_add_uistyle (zmsg_t *msg, rule_t *rule)
+{
+    static const char head [] = "{\"flexible\": ";
+    static const char tail [] = " }";
+    size_t size;
+    const char *json = rule_json_cached (rule, &size);
+    if (!json) return;
+    zframe_t *frame = zframe_new (NULL, sizeof (head) - 1 + size + sizeof (tail) - 1);
+    byte *data = zframe_data (frame);
+    memcpy (data, head, sizeof (head) - 1);
+    memcpy (data + sizeof (head) - 1, json, size);
+    memcpy (data + sizeof (head) - 1 + size, tail, sizeof (tail) - 1);
+    zmsg_append (msg, &frame);
+}
+
 zmsg_t *
 flexible_alert_list_rules (flexible_alert_t *self, char *type, char *ruleclass)
 {
     if (! self || ! type) return NULL;
 
+    if (! streq (type, "all") && ! streq (type, "flexible")) {
+        zmsg_t *reply = zmsg_new ();
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, "INVALID_TYPE");
+        return reply;
+    }
+    // rules part of reply is rebuilt only when rule set changed
+    if (! self->list || self->list_generation != self->generation) {
+        zmsg_destroy (&self->list);
+        self->list = zmsg_new ();
+        rule_t *rule = (rule_t *) zhash_first (self->rules);
+        while (rule) {
+            s_add_uistyle (self->list, rule);
+            rule = (rule_t *) zhash_next (self->rules);
+        }
+        self->list_generation = self->generation;
+    }
+    zmsg_t *reply = zmsg_dup (self->list);
+    zmsg_pushstr (reply, ruleclass ? ruleclass : "");
+    zmsg_pushstr (reply, type);
+    zmsg_pushstr (reply, "LIST");
+    return reply;
+}
+
+//  --------------------------------------------------------------------------
+//  handling requests for page of rules. Rules are ordered by name, view is
+//  rebuilt only when rule set changed. Page starts at the first rule named
+//  after cursor, empty cursor is the first page. Reply is
+//  LIST/type/class/next followed by at most limit rules, next is the name
+//  of the last rule of page, cursor of the next one, or empty string for
+//  last page. Rules added or deleted between pages do not make client skip
+//  or repeat other rules. Limit 0 or above LIST_PAGE_LIMIT means
+//  LIST_PAGE_LIMIT.
+
+static int
+s_rule_name_compare (const void *a, const void *b)
+{
+    return strcmp (rule_name (*(rule_t **) a), rule_name (*(rule_t **) b));
+}
+
+zmsg_t *
+flexible_alert_list_rules_page (flexible_alert_t *self, char *type, char *ruleclass, const char *cursor, const char *limit)
+{
+    if (! self || ! type || ! cursor) return NULL;
+
     zmsg_t *reply = zmsg_new ();
     if (! streq (type, "all") && ! streq (type, "flexible")) {
         zmsg_addstr (reply, "ERROR");
         zmsg_addstr (reply, "INVALID_TYPE");
         return reply;
     }
+    size_t count = LIST_PAGE_LIMIT;
+    if (limit) {
+        char *end = NULL;
+        count = strtoul (limit, &end, 10);
+        if (end == limit || *end || limit [0] == '-') {
+            zmsg_addstr (reply, "ERROR");
+            zmsg_addstr (reply, "INVALID_PAGE");
+            return reply;
+        }
+    }
+    if (count == 0 || count > LIST_PAGE_LIMIT) count = LIST_PAGE_LIMIT;
+
+    if (self->sorted_generation != self->generation) {
+        self->sorted_size = zhash_size (self->rules);
+        self->sorted = (rule_t **) realloc (self->sorted, (self->sorted_size + 1) * sizeof (rule_t *));
+        assert (self->sorted);
+        size_t i = 0;
+        rule_t *rule = (rule_t *) zhash_first (self->rules);
+        while (rule) {
+            self->sorted [i++] = rule;
+            rule = (rule_t *) zhash_next (self->rules);
+        }
+        qsort (self->sorted, self->sorted_size, sizeof (rule_t *), s_rule_name_compare);
+        self->sorted_generation = self->generation;
+    }
+    //  first rule named strictly after cursor
+    size_t first = 0, last = self->sorted_size;
+    while (*cursor && first < last) {
+        size_t middle = first + (last - first) / 2;
+        if (strcmp (rule_name (self->sorted [middle]), cursor) <= 0)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    if (count > self->sorted_size - first) count = self->sorted_size - first;
+
     zmsg_addstr (reply, "LIST");
     zmsg_addstr (reply, type);
     zmsg_addstr (reply, ruleclass ? ruleclass : "");
-    rule_t *rule = (rule_t *) zhash_first (self->rules);
-    while (rule) {
-        char *json = rule_json (rule);
-        if (json) {
-            char *uistyle = zsys_sprintf ("{\"flexible\": %s }", json);
-            if (uistyle) {
-                zmsg_addstr (reply, uistyle);
-                zstr_free (&uistyle);
+    if (first + count < self->sorted_size)
+        zmsg_addstr (reply, rule_name (self->sorted [first + count - 1]));
+    else
+        zmsg_addstr (reply, "");
+    for (size_t i = first; i < first + count; i++)
+        s_add_uistyle (reply, self->sorted [i]);
+    return reply;
+}
+
+//  --------------------------------------------------------------------------
+//  handling requests for rules changed since generation.
+//  Reply is LIST/since/generation followed by { "deleted": "name" } for
+//  every removed rule and then { "flexible": json } for every added or
+//  changed rule. Generation 0 means all rules. Generation older than the
+//  removed log or newer than current one is refused, client shall ask for
+//  all rules then.
+
+zmsg_t *
+flexible_alert_list_rules_since (flexible_alert_t *self, const char *generation)
+{
+    if (! self) return NULL;
+
+    zmsg_t *reply = zmsg_new ();
+    char *end = NULL;
+    uint64_t since = generation ? strtoull (generation, &end, 10) : 0;
+    if (! generation || end == generation || *end) {
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, "INVALID_GENERATION");
+        return reply;
+    }
+    if (since && (since < self->horizon || since > self->generation)) {
+        zmsg_addstr (reply, "ERROR");
+        zmsg_addstr (reply, "GENERATION_EXPIRED");
+        return reply;
+    }
+    zmsg_addstr (reply, "LIST");
+    zmsg_addstr (reply, "since");
+    zmsg_addstrf (reply, "%llu", (unsigned long long) self->generation);
+    if (since) {
+        removed_t *removed = (removed_t *) zlist_first (self->removed);
+        while (removed) {
+            if (removed->generation > since) {
+                char *name = vsjson_encode_string (removed->name);
+                zmsg_addstrf (reply, "{\"deleted\": %s }", name);
+                zstr_free (&name);
             }
-            zstr_free (&json);
+            removed = (removed_t *) zlist_next (self->removed);
         }
-        rule = (rule_t *) zhash_next (self->rules);
+    }
+    const uint64_t *changed = (const uint64_t *) zhashx_first (self->generations);
+    while (changed) {
+        if (*changed > since) {
+            const char *name = (const char *) zhashx_cursor (self->generations);
+            rule_t *rule = (rule_t *) zhash_lookup (self->rules, name);
+            if (rule) s_add_uistyle (reply, rule);
+        }
+        changed = (const uint64_t *) zhashx_next (self->generations);
     }
     return reply;
 }
@@ -443,10 +2019,10 @@ flexible_alert_get_rule (flexible_alert_t *self, char *name)
     rule_t *rule = (rule_t *) zhash_lookup (self->rules, name);
     zmsg_t *reply = zmsg_new ();
     if (rule) {
-        char *json = rule_json (rule);
+        size_t size;
+        const char *json = rule_json_cached (rule, &size);
         zmsg_addstr (reply, "OK");
-        zmsg_addstr (reply, json);
-        zstr_free (&json);
+        zmsg_addmem (reply, json, size);
     } else {
         zmsg_addstr (reply, "ERROR");
         zmsg_addstr (reply, "NOT_FOUND");
@@ -471,7 +2047,8 @@ flexible_alert_delete_rule (flexible_alert_t *self, const char *name, const char
         char *path = zsys_sprintf ("%s/%s.rule", dir, name);
         if (unlink (path) == 0) {
             zmsg_addstr (reply, "OK");
-            zhash_delete (self->rules, name);
+            s_workers_broadcast (self, "DELETERULE", name);
+            s_remove_rule (self, rule);
         } else {
             zsys_error ("Can't remove %s", path);
             zmsg_addstr (reply, "ERROR");
@@ -502,13 +2079,15 @@ flexible_alert_add_rule (flexible_alert_t *self, const char *json, const char *o
         rule_destroy (&newrule);
         return reply;
     };
-    if (old_name) {
+    // rule replaced under the same name keeps its assets
+    bool replace = old_name && streq (old_name, rule_name (newrule));
+    if (old_name && !replace) {
         zsys_info ("deleting rule %s", old_name);
         zmsg_t *msg = flexible_alert_delete_rule (self, old_name, dir);
         zmsg_destroy (&msg);
     }
     rule_t *rule = (rule_t *) zhash_lookup (self->rules, rule_name (newrule));
-    if (rule) {
+    if (rule && !replace) {
         zsys_error ("Rule %s exists", rule_name (rule));
         zmsg_addstr (reply, "ERROR");
         zmsg_addstr (reply, "ALREADY_EXISTS");
@@ -526,10 +2105,181 @@ flexible_alert_add_rule (flexible_alert_t *self, const char *json, const char *o
             flexible_alert_load_one_rule (self, path);
             zsys_info ("Loading rule %s done", path);
         }
-        zstr_free (&path);
+        zstr_free (&path);
+    }
+
+    rule_destroy (&newrule);
+    return reply;
+}
+
+//  --------------------------------------------------------------------------
+//  Evaluation worker, owns its own rules, assets and metrics. Commands:
+//      LOADRULES/dir, LOADRULE/path, DELETERULE/name, SHAREDLUA, LUACACHE/dir,
+//      BATCH/ms, SNAPSHOT/path, STATS (replies STATS/sent/suppressed),
+//      ASSET/zm_proto_t *, METRIC/zm_proto_t * (worker takes the ownership)
+//  Alerts are sent back to the pipe as ALERT/topic/alert frames.
+
+static void
+s_worker_actor (zsock_t *pipe, void *args)
+{
+    flexible_alert_t *self = s_flexible_alert_new (true);
+    assert (self);
+    self->pipe = pipe;
+    zsock_signal (pipe, 0);
+
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+    int timeout = -1;
+    while (!zsys_interrupted) {
+        void *which = zpoller_wait (poller, timeout);
+        if (!which) {
+            if (zpoller_terminated (poller)) break;
+            timeout = s_flush (self);
+            continue;
+        }
+        zmsg_t *msg = zmsg_recv (pipe);
+        if (!msg) break;
+        char *cmd = zmsg_popstr (msg);
+        if (cmd) {
+            if (streq (cmd, "$TERM")) {
+                zstr_free (&cmd);
+                zmsg_destroy (&msg);
+                break;
+            }
+            else if (streq (cmd, "ASSET") || streq (cmd, "METRIC")) {
+                zm_proto_t *fmsg = NULL;
+                zframe_t *frame = zmsg_pop (msg);
+                if (frame && zframe_size (frame) == sizeof (fmsg))
+                    memcpy (&fmsg, zframe_data (frame), sizeof (fmsg));
+                zframe_destroy (&frame);
+                if (streq (cmd, "ASSET"))
+                    flexible_alert_handle_asset (self, fmsg);
+                else
+                    flexible_alert_handle_metric (self, &fmsg);
+                zm_proto_destroy (&fmsg);
+            }
+            else if (streq (cmd, "LOADRULES")) {
+                char *ruledir = zmsg_popstr (msg);
+                flexible_alert_load_rules (self, ruledir);
+                zstr_free (&ruledir);
+            }
+            else if (streq (cmd, "LOADRULE")) {
+                char *path = zmsg_popstr (msg);
+                if (path) flexible_alert_load_one_rule (self, path);
+                zstr_free (&path);
+            }
+            else if (streq (cmd, "SHAREDLUA")) {
+                s_share_lua (self);
+            }
+            else if (streq (cmd, "LUACACHE")) {
+                char *dir = zmsg_popstr (msg);
+                s_set_luacache (self, dir);
+                zstr_free (&dir);
+            }
+            else if (streq (cmd, "BATCH")) {
+                char *ms = zmsg_popstr (msg);
+                s_set_batch (self, ms);
+                zstr_free (&ms);
+            }
+            else if (streq (cmd, "SNAPSHOT")) {
+                char *path = zmsg_popstr (msg);
+                s_set_snapshot (self, path);
+                zstr_free (&path);
+            }
+            else if (streq (cmd, "STATS")) {
+                zmsg_t *reply = zmsg_new ();
+                zmsg_addstr (reply, "STATS");
+                zmsg_addstrf (reply, "%llu", (unsigned long long) self->alerts_sent);
+                zmsg_addstrf (reply, "%llu", (unsigned long long) self->alerts_suppressed);
+                zmsg_send (&reply, pipe);
+            }
+            else if (streq (cmd, "DELETERULE")) {
+                char *name = zmsg_popstr (msg);
+                rule_t *rule = name ? (rule_t *) zhash_lookup (self->rules, name) : NULL;
+                if (rule) s_remove_rule (self, rule);
+                zstr_free (&name);
+            }
+            zstr_free (&cmd);
+        }
+        zmsg_destroy (&msg);
+        timeout = s_flush (self);
     }
+    //  also when interrupted by signal, loop ends without $TERM then
+    if (self->snapshot_loaded) s_snapshot_save (self);
+    zpoller_destroy (&poller);
+    flexible_alert_destroy (&self);
+}
 
-    rule_destroy (&newrule);
+//  --------------------------------------------------------------------------
+//  Start evaluation workers. Returns -1 if workers are already running.
+
+static int
+s_workers_start (flexible_alert_t *self, size_t count, const char *ruledir)
+{
+    if (self->workers_size) return -1;
+
+    self->workers = (zactor_t **) zmalloc (count * sizeof (zactor_t *));
+    assert (self->workers);
+    for (size_t i = 0; i < count; i++) {
+        self->workers [i] = zactor_new (s_worker_actor, NULL);
+        assert (self->workers [i]);
+        if (self->lua) zstr_send (self->workers [i], "SHAREDLUA");
+        if (self->luacache) zstr_sendx (self->workers [i], "LUACACHE", self->luacache, NULL);
+        if (self->batch) {
+            char ms [16];
+            snprintf (ms, sizeof (ms), "%d", self->batch);
+            zstr_sendx (self->workers [i], "BATCH", ms, NULL);
+        }
+        if (ruledir) zstr_sendx (self->workers [i], "LOADRULES", ruledir, NULL);
+        if (self->snapshot) {
+            char *shard = zsys_sprintf ("%s.%zu-of-%zu", self->snapshot, i, count);
+            zstr_sendx (self->workers [i], "SNAPSHOT", shard, NULL);
+            zstr_free (&shard);
+        }
+    }
+    self->workers_size = count;
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Pass asset or metric to the worker owning its asset
+
+static void
+s_workers_dispatch (flexible_alert_t *self, const char *command, zm_proto_t **fmsg_p)
+{
+    zm_proto_t *fmsg = *fmsg_p;
+    const char *assetname = zm_proto_device (fmsg);
+
+    //  FNV-1a hash of asset name selects the worker
+    uint32_t hash = 2166136261u;
+    for (const char *p = assetname ? assetname : ""; *p; p++)
+        hash = (hash ^ (unsigned char) *p) * 16777619u;
+
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addstr (msg, command);
+    zmsg_addmem (msg, &fmsg, sizeof (fmsg));
+    s_workers_send (self, self->workers [hash % self->workers_size], &msg);
+    *fmsg_p = NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Return statistics of agent summed over its workers. Alerts coming from
+//  workers meanwhile are published.
+
+static zmsg_t *
+s_stats (flexible_alert_t *self)
+{
+    self->stats_sent = self->alerts_sent;
+    self->stats_suppressed = self->alerts_suppressed;
+    self->stats_pending = self->workers_size;
+    s_workers_broadcast (self, "STATS", NULL);
+    while (self->stats_pending && !zsys_interrupted)
+        s_workers_poll (self, NULL, 100);
+    self->stats_pending = 0;
+
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, "STATS");
+    zmsg_addstrf (reply, "%llu", (unsigned long long) self->stats_sent);
+    zmsg_addstrf (reply, "%llu", (unsigned long long) self->stats_suppressed);
     return reply;
 }
 
@@ -545,8 +2295,9 @@ flexible_alert_actor (zsock_t *pipe, void *args)
     char *ruledir = NULL;
 
     zpoller_t *poller = zpoller_new (mlm_client_msgpipe(self->mlm), pipe, NULL);
+    int timeout = -1;
     while (!zsys_interrupted) {
-        void *which = zpoller_wait (poller, -1);
+        void *which = zpoller_wait (poller, timeout);
         if (which == pipe) {
             zmsg_t *msg = zmsg_recv (pipe);
             char *cmd = zmsg_popstr (msg);
@@ -582,8 +2333,40 @@ flexible_alert_actor (zsock_t *pipe, void *args)
                     zstr_free (&ruledir);
                     ruledir = zmsg_popstr (msg);
                     assert (ruledir);
+                    s_watch_rules (self, poller, ruledir);
                     flexible_alert_load_rules (self, ruledir);
                 }
+                else if (streq (cmd, "WORKERS")) {
+                    char *count = zmsg_popstr (msg);
+                    int workers = count ? atoi (count) : 0;
+                    if (workers > 0) {
+                        if (s_workers_start (self, workers, ruledir) == 0) {
+                            for (size_t i = 0; i < self->workers_size; i++)
+                                zpoller_add (poller, self->workers [i]);
+                        } else {
+                            zsys_error ("evaluation workers already running");
+                        }
+                    }
+                    zstr_free (&count);
+                }
+                else if (streq (cmd, "SHAREDLUA")) {
+                    s_share_lua (self);
+                }
+                else if (streq (cmd, "LUACACHE")) {
+                    char *dir = zmsg_popstr (msg);
+                    s_set_luacache (self, dir);
+                    zstr_free (&dir);
+                }
+                else if (streq (cmd, "BATCH")) {
+                    char *ms = zmsg_popstr (msg);
+                    s_set_batch (self, ms);
+                    zstr_free (&ms);
+                }
+                else if (streq (cmd, "SNAPSHOT")) {
+                    char *path = zmsg_popstr (msg);
+                    s_set_snapshot (self, path);
+                    zstr_free (&path);
+                }
 
 
                 zstr_free (&cmd);
@@ -595,11 +2378,22 @@ flexible_alert_actor (zsock_t *pipe, void *args)
             if (streq (mlm_client_command (self->mlm), "STREAM DELIVER")) {
                 // This was publish, should be zm_proto
                 zm_proto_t *fmsg = zm_proto_decode (&msg);
-                if (zm_proto_id (fmsg) == ZM_PROTO_DEVICE) {
-                    flexible_alert_handle_asset (self, fmsg);
+                if (fmsg && self->workers_size) {
+                    if (zm_proto_id (fmsg) == ZM_PROTO_DEVICE)
+                        s_workers_dispatch (self, "ASSET", &fmsg);
+                    else
+                    if (zm_proto_id (fmsg) == ZM_PROTO_METRIC)
+                        s_workers_dispatch (self, "METRIC", &fmsg);
                 }
-                if (zm_proto_id (fmsg) == ZM_PROTO_METRIC) {
-                    flexible_alert_handle_metric (self, &fmsg);
+                else
+                if (fmsg) {
+                    s_snapshot_ready (self);
+                    if (zm_proto_id (fmsg) == ZM_PROTO_DEVICE) {
+                        flexible_alert_handle_asset (self, fmsg);
+                    }
+                    if (zm_proto_id (fmsg) == ZM_PROTO_METRIC) {
+                        flexible_alert_handle_metric (self, &fmsg);
+                    }
                 }
                 zm_proto_destroy (&fmsg);
             } else if (streq (mlm_client_command (self->mlm), "MAILBOX DELIVER")) {
@@ -608,9 +2402,23 @@ flexible_alert_actor (zsock_t *pipe, void *args)
                 char *cmd = zmsg_popstr (msg);
                 char *p1 = zmsg_popstr (msg);
                 char *p2 = zmsg_popstr (msg);
+                char *p3 = zmsg_popstr (msg);
+                char *p4 = zmsg_popstr (msg);
                 zmsg_t *reply = NULL;
                 if (cmd) {
-                    if (streq (cmd, "LIST")) {
+                    if (streq (cmd, "LIST") && p1 && streq (p1, "since")) {
+                        // request: LIST/since/generation
+                        // reply: LIST/since/generation/deleted1/.../rule1/...
+                        // reply: ERROR/reason
+                        reply = flexible_alert_list_rules_since (self, p2);
+                    }
+                    else if (streq (cmd, "LIST") && p3) {
+                        // request: LIST/type/class/cursor/limit
+                        // reply: LIST/type/class/next/name1/name2/...nameX
+                        // reply: ERROR/reason
+                        reply = flexible_alert_list_rules_page (self, p1, p2, p3, p4);
+                    }
+                    else if (streq (cmd, "LIST")) {
                         // request: LIST/type/class
                         // reply: LIST/type/class/name1/name2/...nameX
                         // reply: ERROR/reason
@@ -635,6 +2443,11 @@ flexible_alert_actor (zsock_t *pipe, void *args)
                         // reply: DELETE/name/ERROR/reason
                         reply = flexible_alert_delete_rule (self, p1, ruledir);
                     }
+                    else if (streq (cmd, "STATS")) {
+                        // request: STATS
+                        // reply: STATS/sent/suppressed
+                        reply = s_stats (self);
+                    }
                 }
                 if (reply) {
                     mlm_client_sendto (
@@ -653,10 +2466,24 @@ flexible_alert_actor (zsock_t *pipe, void *args)
                 zstr_free (&cmd);
                 zstr_free (&p1);
                 zstr_free (&p2);
+                zstr_free (&p3);
+                zstr_free (&p4);
             }
             zmsg_destroy (&msg);
         }
+        else if (which && which == self->watcher) {
+            s_watcher_event (self, ruledir);
+        }
+        else if (which) {
+            // alert from evaluation worker
+            s_workers_recv (self, (zactor_t *) which);
+        }
+        timeout = s_flush (self);
     }
+    //  also when interrupted by signal, workers save their own shards;
+    //  snapshot not restored yet is kept as it is
+    if (self->snapshot_loaded && !self->workers_size)
+        s_snapshot_save (self);
     zstr_free (&ruledir);
     zpoller_destroy (&poller);
     flexible_alert_destroy (&self);
@@ -665,6 +2492,237 @@ flexible_alert_actor (zsock_t *pipe, void *args)
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
+//  Publish metrics for ups rule and wait for alerts. Returns number of
+//  received alerts, rate is set to alerts per second.
+
+static int
+s_test_throughput (const char *endpoint, const char *rules_dir, int workers, bool shared, int assets, int metrics, double *rate)
+{
+    char *name = zsys_sprintf ("throughput-%i", workers);
+    char *count = zsys_sprintf ("%i", workers);
+    zactor_t *fs = zactor_new (flexible_alert_actor, NULL);
+    assert (fs);
+    if (shared) zstr_send (fs, "SHAREDLUA");
+    zstr_sendx (fs, "WORKERS", count, NULL);
+    zstr_sendx (fs, "BIND", endpoint, name, NULL);
+    zstr_sendx (fs, "PRODUCER", ZM_PROTO_ALERT_STREAM, NULL);
+    zstr_sendx (fs, "CONSUMER", ZM_PROTO_DEVICE_STREAM, ".*", NULL);
+    zstr_sendx (fs, "CONSUMER", ZM_PROTO_METRIC_STREAM, ".*", NULL);
+    zstr_sendx (fs, "LOADRULES", rules_dir, NULL);
+    zstr_free (&count);
+    zstr_free (&name);
+
+    mlm_client_t *producer = mlm_client_new ();
+    mlm_client_connect (producer, endpoint, 5000, "throughput-producer");
+    mlm_client_set_producer (producer, ZM_PROTO_DEVICE_STREAM);
+    mlm_client_t *metric = mlm_client_new ();
+    mlm_client_connect (metric, endpoint, 5000, "throughput-metric");
+    mlm_client_set_producer (metric, ZM_PROTO_METRIC_STREAM);
+    mlm_client_t *consumer = mlm_client_new ();
+    mlm_client_connect (consumer, endpoint, 5000, "throughput-consumer");
+    mlm_client_set_consumer (consumer, ZM_PROTO_ALERT_STREAM, ".*");
+    zclock_sleep (200);
+
+    zhash_t *ext = zhash_new ();
+    zhash_autofree (ext);
+    zhash_insert (ext, "group.1", "all-upses");
+    for (int i = 0; i < assets; i++) {
+        char *asset = zsys_sprintf ("ups-%i", i);
+        zmsg_t *msg = zm_proto_encode_device_v1 (asset, time (NULL), 3600, ext);
+        mlm_client_send (producer, asset, &msg);
+        zmsg_destroy (&msg);
+        zstr_free (&asset);
+    }
+    zhash_destroy (&ext);
+    zclock_sleep (500);
+
+    int64_t start = zclock_mono ();
+    for (int i = 0; i < metrics; i++) {
+        char *asset = zsys_sprintf ("ups-%i", i % assets);
+        char *subject = zsys_sprintf ("status.ups@%s", asset);
+        // alternate value, so every evaluation changes the alert
+        zmsg_t *msg = zm_proto_encode_metric_v1 (
+            asset, time (NULL), 60, NULL, "status.ups", (i / assets) % 2 ? "64" : "16", "");
+        mlm_client_send (metric, subject, &msg);
+        zmsg_destroy (&msg);
+        zstr_free (&subject);
+        zstr_free (&asset);
+    }
+    zpoller_t *poller = zpoller_new (mlm_client_msgpipe (consumer), NULL);
+    int received = 0;
+    while (received < metrics && zpoller_wait (poller, 5000)) {
+        zmsg_t *alert = mlm_client_recv (consumer);
+        zmsg_destroy (&alert);
+        ++received;
+    }
+    int64_t elapsed = zclock_mono () - start;
+    zpoller_destroy (&poller);
+
+    mlm_client_destroy (&consumer);
+    mlm_client_destroy (&metric);
+    mlm_client_destroy (&producer);
+    zactor_destroy (&fs);
+    *rate = elapsed ? received * 1000.0 / elapsed : 0;
+    return received;
+}
+
+//  Write rule into rules directory
+
+static void
+s_test_write_rule (const char *rules_dir, const char *name, const char *json)
+{
+    zsys_dir_create (rules_dir);
+    char *path = zsys_sprintf ("%s/%s.rule", rules_dir, name);
+    FILE *file = fopen (path, "w");
+    assert (file);
+    fputs (json, file);
+    fclose (file);
+    zstr_free (&path);
+}
+
+//  Start agent with rules from directory, batch tick and workers (NULL is
+//  default), announce asset and publish its metrics, given as NULL
+//  terminated array of quantity, value pairs. Returns list of descriptions
+//  of received alerts, stats are set to sent and suppressed alerts reported
+//  by agent.
+
+static zlist_t *
+s_test_alerts (const char *endpoint, const char *rules_dir, const char *batch, const char *workers, const char *assetname, const char **metrics, uint64_t *stats)
+{
+    zactor_t *fs = zactor_new (flexible_alert_actor, NULL);
+    assert (fs);
+    if (batch) zstr_sendx (fs, "BATCH", batch, NULL);
+    if (workers) zstr_sendx (fs, "WORKERS", workers, NULL);
+    zstr_sendx (fs, "BIND", endpoint, "alerts-agent", NULL);
+    zstr_sendx (fs, "PRODUCER", ZM_PROTO_ALERT_STREAM, NULL);
+    zstr_sendx (fs, "CONSUMER", ZM_PROTO_DEVICE_STREAM, ".*", NULL);
+    zstr_sendx (fs, "CONSUMER", ZM_PROTO_METRIC_STREAM, ".*", NULL);
+    zstr_sendx (fs, "LOADRULES", rules_dir, NULL);
+
+    mlm_client_t *producer = mlm_client_new ();
+    mlm_client_connect (producer, endpoint, 5000, "alerts-producer");
+    mlm_client_set_producer (producer, ZM_PROTO_DEVICE_STREAM);
+    mlm_client_t *metric = mlm_client_new ();
+    mlm_client_connect (metric, endpoint, 5000, "alerts-metric");
+    mlm_client_set_producer (metric, ZM_PROTO_METRIC_STREAM);
+    mlm_client_t *consumer = mlm_client_new ();
+    mlm_client_connect (consumer, endpoint, 5000, "alerts-consumer");
+    mlm_client_set_consumer (consumer, ZM_PROTO_ALERT_STREAM, ".*");
+    zclock_sleep (200);
+
+    zhash_t *ext = zhash_new ();
+    zmsg_t *msg = zm_proto_encode_device_v1 (assetname, time (NULL), 3600, ext);
+    mlm_client_send (producer, assetname, &msg);
+    zmsg_destroy (&msg);
+    zhash_destroy (&ext);
+    zclock_sleep (200);
+
+    for (int i = 0; metrics [i] && metrics [i + 1]; i += 2) {
+        char *subject = zsys_sprintf ("%s@%s", metrics [i], assetname);
+        msg = zm_proto_encode_metric_v1 (
+            assetname, time (NULL), 60, NULL, metrics [i], metrics [i + 1], "");
+        mlm_client_send (metric, subject, &msg);
+        zmsg_destroy (&msg);
+        zstr_free (&subject);
+    }
+
+    zlist_t *alerts = zlist_new ();
+    zlist_autofree (alerts);
+    zpoller_t *poller = zpoller_new (mlm_client_msgpipe (consumer), NULL);
+    while (zpoller_wait (poller, 1000)) {
+        msg = mlm_client_recv (consumer);
+        zm_proto_t *alert = zm_proto_decode (&msg);
+        if (alert)
+            zlist_append (alerts, (void *) zm_proto_description (alert));
+        zm_proto_destroy (&alert);
+        zmsg_destroy (&msg);
+    }
+    zpoller_destroy (&poller);
+
+    mlm_client_sendtox (consumer, "alerts-agent", "stats", "STATS", NULL);
+    char *command = NULL, *sent = NULL, *suppressed = NULL;
+    mlm_client_recvx (consumer, &command, &sent, &suppressed, NULL);
+    assert (command && streq (command, "STATS") && sent && suppressed);
+    stats [0] = strtoull (sent, NULL, 10);
+    stats [1] = strtoull (suppressed, NULL, 10);
+    zstr_free (&command);
+    zstr_free (&sent);
+    zstr_free (&suppressed);
+
+    mlm_client_destroy (&consumer);
+    mlm_client_destroy (&metric);
+    mlm_client_destroy (&producer);
+    zactor_destroy (&fs);
+    return alerts;
+}
+
+//  Start agent with rules and snapshot (may be NULL), optionally announce
+//  asset and publish metrics, as NULL terminated array of quantity, value
+//  pairs. Returns description of the first alert or NULL if there is none
+//  within a second, elapsed is set to ms from publishing to the alert.
+//  Agent writes the snapshot when it ends.
+
+static char *
+s_test_restart (const char *endpoint, const char *rules_dir, const char *snapshot, const char *assetname, bool announce, const char **metrics, double *elapsed)
+{
+    zactor_t *fs = zactor_new (flexible_alert_actor, NULL);
+    assert (fs);
+    zstr_sendx (fs, "BIND", endpoint, "restart-agent", NULL);
+    zstr_sendx (fs, "PRODUCER", ZM_PROTO_ALERT_STREAM, NULL);
+    zstr_sendx (fs, "CONSUMER", ZM_PROTO_DEVICE_STREAM, ".*", NULL);
+    zstr_sendx (fs, "CONSUMER", ZM_PROTO_METRIC_STREAM, ".*", NULL);
+    zstr_sendx (fs, "LOADRULES", rules_dir, NULL);
+    if (snapshot) zstr_sendx (fs, "SNAPSHOT", snapshot, NULL);
+
+    mlm_client_t *producer = mlm_client_new ();
+    mlm_client_connect (producer, endpoint, 5000, "restart-producer");
+    mlm_client_set_producer (producer, ZM_PROTO_DEVICE_STREAM);
+    mlm_client_t *metric = mlm_client_new ();
+    mlm_client_connect (metric, endpoint, 5000, "restart-metric");
+    mlm_client_set_producer (metric, ZM_PROTO_METRIC_STREAM);
+    mlm_client_t *consumer = mlm_client_new ();
+    mlm_client_connect (consumer, endpoint, 5000, "restart-consumer");
+    mlm_client_set_consumer (consumer, ZM_PROTO_ALERT_STREAM, ".*");
+    zclock_sleep (200);
+
+    int64_t start = zclock_usecs ();
+    zmsg_t *msg;
+    if (announce) {
+        zhash_t *ext = zhash_new ();
+        msg = zm_proto_encode_device_v1 (assetname, time (NULL), 3600, ext);
+        mlm_client_send (producer, assetname, &msg);
+        zmsg_destroy (&msg);
+        zhash_destroy (&ext);
+    }
+    for (int i = 0; metrics [i] && metrics [i + 1]; i += 2) {
+        char *subject = zsys_sprintf ("%s@%s", metrics [i], assetname);
+        msg = zm_proto_encode_metric_v1 (
+            assetname, time (NULL), 60, NULL, metrics [i], metrics [i + 1], "");
+        mlm_client_send (metric, subject, &msg);
+        zmsg_destroy (&msg);
+        zstr_free (&subject);
+    }
+
+    char *description = NULL;
+    zpoller_t *poller = zpoller_new (mlm_client_msgpipe (consumer), NULL);
+    if (zpoller_wait (poller, 1000)) {
+        *elapsed = (zclock_usecs () - start) / 1000.0;
+        msg = mlm_client_recv (consumer);
+        zm_proto_t *alert = zm_proto_decode (&msg);
+        if (alert)
+            description = strdup (zm_proto_description (alert));
+        zm_proto_destroy (&alert);
+        zmsg_destroy (&msg);
+    }
+    zpoller_destroy (&poller);
+
+    mlm_client_destroy (&consumer);
+    mlm_client_destroy (&metric);
+    mlm_client_destroy (&producer);
+    zactor_destroy (&fs);
+    return description;
+}
+
 void
 flexible_alert_test (bool verbose)
 {
@@ -859,6 +2917,611 @@ flexible_alert_test (bool verbose)
     mlm_client_destroy (&asset);
     // destroy actor
     zactor_destroy (&fs);
+    {
+        // test evaluation workers
+        printf ("\t#6 WORKERS ");
+        char *rules_dir = zsys_sprintf ("%s/rules", SELFTEST_DIR_RO);
+        double rate;
+        int received = s_test_throughput (endpoint, rules_dir, 2, false, 10, 100, &rate);
+        assert (received == 100);
+        // burst over pipe high water mark, every metric gives an alert, so
+        // worker and agent both send full pipes to each other; the mark is
+        // lowered to get there with a burst the broker still buffers whole
+        size_t pipehwm = zsys_pipehwm ();
+        zsys_set_pipehwm (10);
+        received = s_test_throughput (endpoint, rules_dir, 1, false, 10, 500, &rate);
+        zsys_set_pipehwm (pipehwm);
+        assert (received == 500);
+        if (verbose) {
+            printf ("\n");
+            int workers [] = { 0, 1, 2, 4, 8, -1 };
+            for (int i = 0; workers [i] >= 0; i++) {
+                received = s_test_throughput (endpoint, rules_dir, workers [i], false, 1000, 20000, &rate);
+                printf ("\t   %i workers: %.0f alerts/s (%i alerts)\n", workers [i], rate, received);
+            }
+        }
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test rules compiled in one shared lua state
+        printf ("\t#7 SHAREDLUA ");
+        char *rules_dir = zsys_sprintf ("%s/rules", SELFTEST_DIR_RO);
+        double rate;
+        int received = s_test_throughput (endpoint, rules_dir, 0, true, 10, 100, &rate);
+        assert (received == 100);
+        received = s_test_throughput (endpoint, rules_dir, 2, true, 10, 100, &rate);
+        assert (received == 100);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test memoized rule is not evaluated again for the same inputs
+        printf ("\t#8 MEMOIZE ");
+        char *rules_dir = zsys_sprintf ("%s/memoize", SELFTEST_DIR_RW);
+        s_test_write_rule (rules_dir, "counter",
+            "{\"name\":\"counter\",\"metrics\":[\"load.default\"],\"assets\":[\"counted\"],"
+            "\"memoize\":true,\"evaluation\":\"calls = 0 function main (load) "
+            "calls = calls + 1 return OK, 'call ' .. calls end\"}");
+        const char *metrics [] = {
+            "load.default", "42",
+            "load.default", "42",
+            "load.default", "42.0",
+            "load.default", "43",
+            NULL
+        };
+        uint64_t stats [2];
+        zlist_t *alerts = s_test_alerts (endpoint, rules_dir, NULL, NULL, "counted", metrics, stats);
+        assert (zlist_size (alerts) == 2);
+        assert (streq ((char *) zlist_first (alerts), "call 1"));
+        assert (streq ((char *) zlist_next (alerts), "call 2"));
+        assert (stats [0] == 2 && stats [1] == 2);
+        zlist_destroy (&alerts);
+
+        char *path = zsys_sprintf ("%s/counter.rule", rules_dir);
+        zsys_file_delete (path);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&path);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test alert is published only when it changes
+        printf ("\t#9 STATS ");
+        char *rules_dir = zsys_sprintf ("%s/stats", SELFTEST_DIR_RW);
+        s_test_write_rule (rules_dir, "limit",
+            "{\"name\":\"limit\",\"metrics\":[\"load.default\"],\"assets\":[\"limited\"],"
+            "\"evaluation\":\"function main (load) if load > 90 then "
+            "return CRITICAL, 'high' end return OK, 'fine' end\"}");
+        const char *metrics [] = {
+            "load.default", "10",
+            "load.default", "20",
+            "load.default", "95",
+            "load.default", "96",
+            "load.default", "10",
+            NULL
+        };
+        uint64_t stats [2];
+        // the same summed over evaluation workers
+        const char *workers [] = { NULL, "2" };
+        for (int i = 0; i < 2; i++) {
+            zlist_t *alerts = s_test_alerts (endpoint, rules_dir, NULL, workers [i], "limited", metrics, stats);
+            assert (zlist_size (alerts) == 3);
+            assert (streq ((char *) zlist_first (alerts), "fine"));
+            assert (streq ((char *) zlist_next (alerts), "high"));
+            assert (streq ((char *) zlist_next (alerts), "fine"));
+            assert (stats [0] == 3 && stats [1] == 2);
+            zlist_destroy (&alerts);
+        }
+
+        char *path = zsys_sprintf ("%s/limit.rule", rules_dir);
+        zsys_file_delete (path);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&path);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test burst of metrics evaluates coalescing rule once
+        printf ("\t#10 COALESCE ");
+        char *rules_dir = zsys_sprintf ("%s/coalesce", SELFTEST_DIR_RW);
+        s_test_write_rule (rules_dir, "inputs",
+            "{\"name\":\"inputs\",\"metrics\":[\"input.1\",\"input.2\"],\"assets\":[\"sts\"],"
+            "\"coalesce\":300,\"evaluation\":\"calls = 0 function main (i1, i2) "
+            "calls = calls + 1 return OK, 'call ' .. calls end\"}");
+        const char *metrics [] = {
+            "input.1", "1",
+            "input.2", "1",     // all inputs arrived, evaluated
+            "input.2", "2",
+            "input.1", "2",     // all inputs arrived, evaluated
+            "input.1", "3",     // evaluated when window closes
+            NULL
+        };
+        uint64_t stats [2];
+        zlist_t *alerts = s_test_alerts (endpoint, rules_dir, NULL, NULL, "sts", metrics, stats);
+        assert (zlist_size (alerts) == 3);
+        assert (streq ((char *) zlist_first (alerts), "call 1"));
+        assert (streq ((char *) zlist_next (alerts), "call 2"));
+        assert (streq ((char *) zlist_next (alerts), "call 3"));
+        zlist_destroy (&alerts);
+
+        char *path = zsys_sprintf ("%s/inputs.rule", rules_dir);
+        zsys_file_delete (path);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&path);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test burst of metrics evaluates batched threshold rule once
+        printf ("\t#11 BATCH ");
+        char *rules_dir = zsys_sprintf ("%s/batch", SELFTEST_DIR_RW);
+        s_test_write_rule (rules_dir, "load",
+            "{\"name\":\"load\",\"kind\":\"threshold\",\"metrics\":[\"load.default\"],"
+            "\"assets\":[\"batched\"],\"variables\":{\"high_warning\":\"60\",\"high_critical\":\"90\"},"
+            "\"results\":{\"high_critical\":{\"description\":\"$NAME load is $VALUE\"}}}");
+        const char *metrics [] = {
+            "load.default", "50",
+            "load.default", "55",
+            "load.default", "70",
+            "load.default", "95",
+            NULL
+        };
+        uint64_t stats [2];
+        zlist_t *alerts = s_test_alerts (endpoint, rules_dir, "500", NULL, "batched", metrics, stats);
+        assert (zlist_size (alerts) == 1);
+        assert (streq ((char *) zlist_first (alerts), "batched load is 95"));
+        assert (stats [0] == 1 && stats [1] == 0);
+        zlist_destroy (&alerts);
+
+        char *path = zsys_sprintf ("%s/load.rule", rules_dir);
+        zsys_file_delete (path);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&path);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test LIST reuses prebuilt reply and LIST/since returns changes
+        printf ("\t#12 LIST since ");
+        char *rules_dir = zsys_sprintf ("%s/since", SELFTEST_DIR_RW);
+        zsys_dir_create (rules_dir);
+        flexible_alert_t *self = flexible_alert_new ();
+        zmsg_t *reply = flexible_alert_add_rule (self,
+            "{\"name\":\"first\",\"evaluation\":\"function main(x) return OK, 'yes' end\"}",
+            NULL, rules_dir);
+        zmsg_destroy (&reply);
+
+        reply = flexible_alert_list_rules (self, "all", "myclass");
+        assert (zmsg_size (reply) == 4);
+        zmsg_destroy (&reply);
+        zmsg_t *list = self->list;
+        reply = flexible_alert_list_rules (self, "flexible", NULL);
+        assert (zmsg_size (reply) == 4);
+        assert (self->list == list);
+        char *item = zmsg_popstr (reply);
+        assert (streq (item, "LIST"));
+        zstr_free (&item);
+        item = zmsg_popstr (reply);
+        assert (streq (item, "flexible"));
+        zstr_free (&item);
+        zmsg_destroy (&reply);
+
+        char *generation = zsys_sprintf ("%llu", (unsigned long long) self->generation);
+        reply = flexible_alert_add_rule (self,
+            "{\"name\":\"second\",\"evaluation\":\"function main(x) return OK, 'yes' end\"}",
+            NULL, rules_dir);
+        zmsg_destroy (&reply);
+        reply = flexible_alert_delete_rule (self, "first", rules_dir);
+        zmsg_destroy (&reply);
+
+        reply = flexible_alert_list_rules_since (self, generation);
+        assert (zmsg_size (reply) == 5);
+        item = zmsg_popstr (reply);
+        assert (streq (item, "LIST"));
+        zstr_free (&item);
+        item = zmsg_popstr (reply);
+        assert (streq (item, "since"));
+        zstr_free (&item);
+        item = zmsg_popstr (reply);
+        assert (strtoull (item, NULL, 10) == self->generation);
+        zstr_free (&item);
+        item = zmsg_popstr (reply);
+        assert (streq (item, "{\"deleted\": \"first\" }"));
+        zstr_free (&item);
+        item = zmsg_popstr (reply);
+        assert (strstr (item, "\"second\""));
+        zstr_free (&item);
+        zmsg_destroy (&reply);
+        zstr_free (&generation);
+
+        // nothing changed since current generation
+        generation = zsys_sprintf ("%llu", (unsigned long long) self->generation);
+        reply = flexible_alert_list_rules_since (self, generation);
+        assert (zmsg_size (reply) == 3);
+        zmsg_destroy (&reply);
+        zstr_free (&generation);
+
+        // full LIST is rebuilt after change
+        reply = flexible_alert_list_rules (self, "all", "");
+        assert (zmsg_size (reply) == 4);
+        assert (self->list_generation == self->generation);
+        zmsg_destroy (&reply);
+
+        reply = flexible_alert_list_rules_since (self, "0");
+        assert (zmsg_size (reply) == 4);
+        zmsg_destroy (&reply);
+
+        reply = flexible_alert_list_rules_since (self, "1");
+        item = zmsg_popstr (reply);
+        assert (streq (item, "ERROR"));
+        zstr_free (&item);
+        zmsg_destroy (&reply);
+
+        reply = flexible_alert_list_rules_since (self, "nonsense");
+        item = zmsg_popstr (reply);
+        assert (streq (item, "ERROR"));
+        zstr_free (&item);
+        zmsg_destroy (&reply);
+
+        reply = flexible_alert_delete_rule (self, "second", rules_dir);
+        zmsg_destroy (&reply);
+        flexible_alert_destroy (&self);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test LIST pages are ordered by name and continue by offset
+        printf ("\t#13 LIST pages ");
+        char *rules_dir = zsys_sprintf ("%s/pages", SELFTEST_DIR_RW);
+        const char *names [] = {"rule3", "rule1", "rule5", "rule2", "rule4"};
+        for (int i = 0; i < 5; i++) {
+            char *json = zsys_sprintf (
+                "{\"name\":\"%s\",\"evaluation\":\"function main(x) return OK, 'yes' end\"}",
+                names [i]);
+            s_test_write_rule (rules_dir, names [i], json);
+            zstr_free (&json);
+        }
+        flexible_alert_t *self = flexible_alert_new ();
+        flexible_alert_load_rules (self, rules_dir);
+
+        const char *cursor = "";
+        const char *expected_next [] = {"rule2", "rule4", ""};
+        int page = 0, seen = 0;
+        char *next = NULL;
+        while (cursor) {
+            zmsg_t *reply = flexible_alert_list_rules_page (self, "all", "myclass", cursor, "2");
+            char *item = zmsg_popstr (reply);
+            assert (streq (item, "LIST"));
+            zstr_free (&item);
+            item = zmsg_popstr (reply);
+            zstr_free (&item);
+            item = zmsg_popstr (reply);
+            assert (streq (item, "myclass"));
+            zstr_free (&item);
+            zstr_free (&next);
+            next = zmsg_popstr (reply);
+            assert (streq (next, expected_next [page]));
+            while ((item = zmsg_popstr (reply))) {
+                char *name = zsys_sprintf ("\"rule%d\"", ++seen);
+                assert (strstr (item, name));
+                zstr_free (&name);
+                zstr_free (&item);
+            }
+            zmsg_destroy (&reply);
+            cursor = *next ? next : NULL;
+            page++;
+        }
+        zstr_free (&next);
+        assert (page == 3 && seen == 5);
+
+        // cursor past the last rule gives empty last page
+        zmsg_t *reply = flexible_alert_list_rules_page (self, "all", "", "rule9", NULL);
+        assert (zmsg_size (reply) == 4);
+        zmsg_destroy (&reply);
+
+        reply = flexible_alert_list_rules_page (self, "all", "", "", "-1");
+        char *item = zmsg_popstr (reply);
+        assert (streq (item, "ERROR"));
+        zstr_free (&item);
+        zmsg_destroy (&reply);
+
+        // rule set changed between pages: page continues after the cursor,
+        // rules before it are neither skipped nor repeated
+        reply = flexible_alert_list_rules_page (self, "all", "", "", "2");
+        assert (zmsg_size (reply) == 6);
+        zmsg_destroy (&reply);
+        reply = flexible_alert_delete_rule (self, "rule1", rules_dir);
+        zmsg_destroy (&reply);
+        reply = flexible_alert_add_rule (self,
+            "{\"name\":\"rule0\",\"evaluation\":\"function main(x) return OK, 'yes' end\"}",
+            NULL, rules_dir);
+        zmsg_destroy (&reply);
+        reply = flexible_alert_list_rules_page (self, "all", "", "rule2", "2");
+        for (int i = 0; i < 3; i++) {
+            item = zmsg_popstr (reply);
+            zstr_free (&item);
+        }
+        item = zmsg_popstr (reply);
+        assert (streq (item, "rule4"));
+        zstr_free (&item);
+        item = zmsg_popstr (reply);
+        assert (strstr (item, "\"rule3\""));
+        zstr_free (&item);
+        item = zmsg_popstr (reply);
+        assert (strstr (item, "\"rule4\""));
+        zstr_free (&item);
+        zmsg_destroy (&reply);
+
+        // view follows the rule set
+        reply = flexible_alert_list_rules_page (self, "all", "", "", "0");
+        assert (zmsg_size (reply) == 9);
+        zmsg_destroy (&reply);
+
+        flexible_alert_destroy (&self);
+        for (int i = 0; i < 5; i++) {
+            char *path = zsys_sprintf ("%s/%s.rule", rules_dir, names [i]);
+            zsys_file_delete (path);
+            zstr_free (&path);
+        }
+        char *path = zsys_sprintf ("%s/rule0.rule", rules_dir);
+        zsys_file_delete (path);
+        zstr_free (&path);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test directory is loaded by parallel loaders, broken file is skipped
+        printf ("\t#14 Parallel loading ");
+        char *rules_dir = zsys_sprintf ("%s/parallel", SELFTEST_DIR_RW);
+        const int count = LOADER_CHUNK * 4 + 7;
+        for (int i = 0; i < count; i++) {
+            char *name = zsys_sprintf ("rule%03d", i);
+            char *json = zsys_sprintf (
+                "{\"name\":\"%s\",\"metrics\":[\"load.default\"],"
+                "\"evaluation\":\"function main(x) return OK, 'yes' end\"}",
+                name);
+            s_test_write_rule (rules_dir, name, json);
+            zstr_free (&json);
+            zstr_free (&name);
+        }
+        s_test_write_rule (rules_dir, "broken", "{\"name\": ");
+
+        flexible_alert_t *self = flexible_alert_new ();
+        int64_t start = zclock_usecs ();
+        flexible_alert_load_rules (self, rules_dir);
+        if (verbose)
+            printf ("(%d rules in %.1f ms) ", count, (zclock_usecs () - start) / 1000.0);
+        assert (zhash_size (self->rules) == (size_t) count);
+        rule_t *rule = (rule_t *) zhash_lookup (self->rules, "rule123");
+        assert (rule);
+        assert (streq (rule_name (rule), "rule123"));
+        assert (zhashx_lookup (self->generations, "rule123"));
+        flexible_alert_destroy (&self);
+
+        for (int i = 0; i < count; i++) {
+            char *path = zsys_sprintf ("%s/rule%03d.rule", rules_dir, i);
+            zsys_file_delete (path);
+            zstr_free (&path);
+        }
+        char *path = zsys_sprintf ("%s/broken.rule", rules_dir);
+        zsys_file_delete (path);
+        zstr_free (&path);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test watched directory changes reload only the affected rule
+        printf ("\t#15 Hot reload ");
+        char *rules_dir = zsys_sprintf ("%s/hot", SELFTEST_DIR_RW);
+        const char *json1 = "{\"name\":\"hot1\",\"evaluation\":\"function main(x) return OK, 'one' end\"}";
+        const char *json2 = "{\"name\":\"hot2\",\"evaluation\":\"function main(x) return OK, 'two' end\"}";
+        s_test_write_rule (rules_dir, "hot1", json1);
+        flexible_alert_t *self = flexible_alert_new ();
+        zpoller_t *poller = zpoller_new (NULL);
+        s_watch_rules (self, poller, rules_dir);
+        flexible_alert_load_rules (self, rules_dir);
+        rule_t *hot1 = (rule_t *) zhash_lookup (self->rules, "hot1");
+        assert (hot1);
+
+        // new file
+        s_test_write_rule (rules_dir, "hot2", json2);
+        assert (zpoller_wait (poller, 1000) == self->watcher);
+        s_watcher_event (self, rules_dir);
+        rule_t *hot2 = (rule_t *) zhash_lookup (self->rules, "hot2");
+        assert (hot2);
+        assert (zhash_lookup (self->rules, "hot1") == hot1);
+
+        // changed file replaces just its rule
+        s_test_write_rule (rules_dir, "hot1",
+            "{\"name\":\"hot1\",\"evaluation\":\"function main(x) return WARNING, 'changed' end\"}");
+        assert (zpoller_wait (poller, 1000) == self->watcher);
+        s_watcher_event (self, rules_dir);
+        assert (zhash_lookup (self->rules, "hot1") != hot1);
+        assert (zhash_lookup (self->rules, "hot2") == hot2);
+        hot1 = (rule_t *) zhash_lookup (self->rules, "hot1");
+
+        // rule saved by ADD is not loaded again
+        zmsg_t *reply = flexible_alert_add_rule (self,
+            "{\"name\":\"hot3\",\"evaluation\":\"function main(x) return OK, 'three' end\"}",
+            NULL, rules_dir);
+        zmsg_destroy (&reply);
+        rule_t *hot3 = (rule_t *) zhash_lookup (self->rules, "hot3");
+        assert (hot3);
+        assert (zpoller_wait (poller, 1000) == self->watcher);
+        s_watcher_event (self, rules_dir);
+        assert (zhash_lookup (self->rules, "hot3") == hot3);
+
+        // deleted file removes its rule
+        char *path = zsys_sprintf ("%s/hot2.rule", rules_dir);
+        zsys_file_delete (path);
+        zstr_free (&path);
+        assert (zpoller_wait (poller, 1000) == self->watcher);
+        s_watcher_event (self, rules_dir);
+        assert (zhash_lookup (self->rules, "hot2") == NULL);
+        assert (zhash_lookup (self->rules, "hot1") == hot1);
+        assert (zhash_size (self->rules) == 2);
+
+        reply = flexible_alert_delete_rule (self, "hot3", rules_dir);
+        zmsg_destroy (&reply);
+        assert (zpoller_wait (poller, 1000) == self->watcher);
+        s_watcher_event (self, rules_dir);
+        assert (zhash_size (self->rules) == 1);
+
+        // rule renamed in its file replaces the old one
+        s_test_write_rule (rules_dir, "hot1",
+            "{\"name\":\"renamed\",\"evaluation\":\"function main(x) return OK, 'renamed' end\"}");
+        assert (zpoller_wait (poller, 1000) == self->watcher);
+        s_watcher_event (self, rules_dir);
+        assert (zhash_lookup (self->rules, "hot1") == NULL);
+        assert (zhash_lookup (self->rules, "renamed"));
+        assert (zhash_size (self->rules) == 1);
+
+        // and deleted file removes the new one
+        path = zsys_sprintf ("%s/hot1.rule", rules_dir);
+        zsys_file_delete (path);
+        zstr_free (&path);
+        assert (zpoller_wait (poller, 1000) == self->watcher);
+        s_watcher_event (self, rules_dir);
+        assert (zhash_size (self->rules) == 0);
+
+        zpoller_destroy (&poller);
+        flexible_alert_destroy (&self);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test added rule is bound to known assets, deleted one is unbound
+        printf ("\t#16 Rematch assets ");
+        char *rules_dir = zsys_sprintf ("%s/rematch", SELFTEST_DIR_RW);
+        zsys_dir_create (rules_dir);
+        flexible_alert_t *self = flexible_alert_new ();
+        const char *names [] = {"ups-7", "ups-8", "rack-7"};
+        const char *groups [] = {"all-upses", "all-upses", "all-racks"};
+        for (int i = 0; i < 3; i++) {
+            zm_proto_t *zmmsg = rule_index_test_asset (names [i], "group.1", groups [i]);
+            flexible_alert_handle_asset (self, zmmsg);
+            zm_proto_destroy (&zmmsg);
+        }
+        // no rules yet, assets are only remembered
+        assert (zhash_size (self->assets) == 0);
+
+        zmsg_t *reply = flexible_alert_add_rule (self,
+            "{\"name\":\"upses\",\"groups\":[\"all-upses\"],\"metrics\":[\"load.default\"],"
+            "\"evaluation\":\"function main(x) return OK, 'yes' end\"}",
+            NULL, rules_dir);
+        zmsg_destroy (&reply);
+        rule_t *rule = (rule_t *) zhash_lookup (self->rules, "upses");
+        assert (rule);
+        assert (zhash_size (self->assets) == 2);
+        asset_t *asset = (asset_t *) zhash_lookup (self->assets, "ups-7");
+        assert (asset && asset_has_rule (asset, rule));
+        assert (zhash_lookup (self->assets, "rack-7") == NULL);
+
+        // replaced rule with other groups moves to other assets
+        reply = flexible_alert_add_rule (self,
+            "{\"name\":\"upses\",\"groups\":[\"all-racks\"],\"metrics\":[\"load.default\"],"
+            "\"evaluation\":\"function main(x) return OK, 'yes' end\"}",
+            "upses", rules_dir);
+        zmsg_destroy (&reply);
+        rule = (rule_t *) zhash_lookup (self->rules, "upses");
+        assert (zhash_size (self->assets) == 1);
+        asset = (asset_t *) zhash_lookup (self->assets, "rack-7");
+        assert (asset && asset_has_rule (asset, rule));
+
+        // replaced rule matching the same asset keeps state of its binding,
+        // memoized result is dropped as the evaluation changed
+        asset_binding_t *binding = asset_binding (asset, rule);
+        binding->published_result = 1;
+        binding->memoized = true;
+        reply = flexible_alert_add_rule (self,
+            "{\"name\":\"upses\",\"groups\":[\"all-racks\"],\"metrics\":[\"load.default\"],"
+            "\"evaluation\":\"function main(x) return OK, 'no' end\"}",
+            "upses", rules_dir);
+        zmsg_destroy (&reply);
+        rule = (rule_t *) zhash_lookup (self->rules, "upses");
+        assert (asset_binding (asset, rule) == binding);
+        assert (binding->published_result == 1 && !binding->memoized);
+
+        reply = flexible_alert_delete_rule (self, "upses", rules_dir);
+        zmsg_destroy (&reply);
+        assert (zhash_size (self->assets) == 0);
+
+        flexible_alert_destroy (&self);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&rules_dir);
+        printf ("OK\n");
+    }
+    {
+        // test agent restarted with snapshot evaluates rule with inputs
+        // published before restart, without snapshot it waits for them
+        printf ("\t#17 Warm restart ");
+        char *rules_dir = zsys_sprintf ("%s/restart", SELFTEST_DIR_RW);
+        char *snapshot = zsys_sprintf ("%s/restart.snapshot", SELFTEST_DIR_RW);
+        zsys_file_delete (snapshot);
+        s_test_write_rule (rules_dir, "pair",
+            "{\"name\":\"pair\",\"metrics\":[\"load.input.L1\",\"load.input.L2\"],"
+            "\"assets\":[\"warm\"],\"evaluation\":\"function main(a, b) "
+            "if a + b > 100 then return HIGH_CRITICAL, 'pair is ' .. string.format ('%d', a + b) end "
+            "return OK, 'pair is ok' end\"}");
+        const char *both [] = {"load.input.L1", "60", "load.input.L2", "50", NULL};
+        const char *one [] = {"load.input.L1", "70", NULL};
+        double cold = 0, warm = 0, none = 0;
+
+        char *description = s_test_restart (endpoint, rules_dir, snapshot, "warm", true, both, &cold);
+        assert (description && streq (description, "pair is 110"));
+        zstr_free (&description);
+        assert (zsys_file_exists (snapshot));
+
+        // asset and L2 come from snapshot
+        description = s_test_restart (endpoint, rules_dir, snapshot, "warm", false, one, &warm);
+        assert (description && streq (description, "pair is 120"));
+        zstr_free (&description);
+
+        // without snapshot even announced asset waits for L2
+        description = s_test_restart (endpoint, rules_dir, NULL, "warm", true, one, &none);
+        assert (description == NULL);
+        if (verbose)
+            printf ("(first correct alert %.1f ms after restart with snapshot, "
+                "%.1f ms when asset and all metrics are published again) ", warm, cold);
+
+        // truncated snapshot is refused or applied partially, never crashes
+        FILE *file = fopen (snapshot, "r+");
+        assert (file);
+        fseek (file, 0, SEEK_END);
+        long size = ftell (file);
+        fclose (file);
+        assert (truncate (snapshot, size / 2) == 0);
+        description = s_test_restart (endpoint, rules_dir, snapshot, "warm", false, one, &none);
+        zstr_free (&description);
+
+        // with SNAPSHOT before WORKERS the worker keeps its shard, agent
+        // neither restores nor overwrites the snapshot
+        size = zsys_file_size (snapshot);
+        zactor_t *fs = zactor_new (flexible_alert_actor, NULL);
+        assert (fs);
+        zstr_sendx (fs, "SNAPSHOT", snapshot, NULL);
+        zstr_sendx (fs, "WORKERS", "1", NULL);
+        zactor_destroy (&fs);
+        char *shard = zsys_sprintf ("%s.0-of-1", snapshot);
+        assert (zsys_file_exists (shard));
+        assert (zsys_file_size (snapshot) == size);
+        zsys_file_delete (shard);
+        zstr_free (&shard);
+
+        zsys_file_delete (snapshot);
+        char *path = zsys_sprintf ("%s/pair.rule", rules_dir);
+        zsys_file_delete (path);
+        zstr_free (&path);
+        zsys_dir_delete (rules_dir);
+        zstr_free (&rules_dir);
+        zstr_free (&snapshot);
+        printf ("OK\n");
+    }
     //destroy malamute
     zactor_destroy (&malamute);
     //  @end
@@ -23,17 +23,143 @@
 @header
     metrics - List of metrics
 @discuss
+    Cache of the last received value of every metric. Metrics are kept in
+    a hash for lookup and in a binary min-heap ordered by expiration time
+    (time + ttl), so dropping expired metrics costs O(log n) per dropped
+    metric and checking for them is O(1), regardless of cache size.
+    Metrics are keyed by METRICS_KEY (asset id, quantity id), see atoms.
+    Value of metric is parsed to number once when it is stored, so rules
+    get it without any further conversion.
 @end
 */
 
 #include "zm_alert_classes.h"
 
+//  One cached metric
+
+typedef struct {
+    uint64_t key;               //  METRICS_KEY (asset, quantity)
+    zm_proto_t *zmmsg;          //  Last received message
+    rule_param_t value;         //  Parsed value of the message
+    uint64_t expires;           //  time + ttl of the message
+    size_t index;               //  Position in the heap
+} metric_t;
+
 //  Structure of our class
 
 struct _metrics_t {
-    int filler;     //  Declare class properties here
+    zhashx_t *items;            //  key -> metric_t
+    metric_t **heap;            //  min-heap ordered by expires
+    size_t heap_size;
+    size_t heap_capacity;
 };
 
+static void
+s_metric_destroy (metric_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        metric_t *self = *self_p;
+        zm_proto_destroy (&self->zmmsg);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Keys are pointers to uint64_t
+
+static size_t
+s_key_hash (const void *key)
+{
+    uint64_t k = *(const uint64_t *) key;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return (size_t) k;
+}
+
+static int
+s_key_compare (const void *key1, const void *key2)
+{
+    uint64_t k1 = *(const uint64_t *) key1;
+    uint64_t k2 = *(const uint64_t *) key2;
+    return k1 < k2 ? -1 : (k1 > k2 ? 1 : 0);
+}
+
+static uint64_t
+s_expires (zm_proto_t *zmmsg)
+{
+    return zm_proto_time (zmmsg) + zm_proto_ttl (zmmsg);
+}
+
+//  --------------------------------------------------------------------------
+//  Heap helpers
+
+static void
+s_heap_set (metrics_t *self, size_t index, metric_t *metric)
+{
+    self->heap [index] = metric;
+    metric->index = index;
+}
+
+static void
+s_heap_sift_up (metrics_t *self, size_t index)
+{
+    metric_t *metric = self->heap [index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (self->heap [parent]->expires <= metric->expires)
+            break;
+        s_heap_set (self, index, self->heap [parent]);
+        index = parent;
+    }
+    s_heap_set (self, index, metric);
+}
+
+static void
+s_heap_sift_down (metrics_t *self, size_t index)
+{
+    metric_t *metric = self->heap [index];
+    while (true) {
+        size_t child = 2 * index + 1;
+        if (child >= self->heap_size)
+            break;
+        if (child + 1 < self->heap_size
+        &&  self->heap [child + 1]->expires < self->heap [child]->expires)
+            child++;
+        if (metric->expires <= self->heap [child]->expires)
+            break;
+        s_heap_set (self, index, self->heap [child]);
+        index = child;
+    }
+    s_heap_set (self, index, metric);
+}
+
+static void
+s_heap_push (metrics_t *self, metric_t *metric)
+{
+    if (self->heap_size == self->heap_capacity) {
+        size_t capacity = self->heap_capacity ? self->heap_capacity * 2 : 256;
+        metric_t **heap = (metric_t **) realloc (self->heap, capacity * sizeof (metric_t *));
+        assert (heap);
+        self->heap = heap;
+        self->heap_capacity = capacity;
+    }
+    s_heap_set (self, self->heap_size++, metric);
+    s_heap_sift_up (self, metric->index);
+}
+
+static metric_t *
+s_heap_pop (metrics_t *self)
+{
+    assert (self->heap_size);
+    metric_t *top = self->heap [0];
+    if (--self->heap_size) {
+        s_heap_set (self, 0, self->heap [self->heap_size]);
+        s_heap_sift_down (self, 0);
+    }
+    return top;
+}
 
 //  --------------------------------------------------------------------------
 //  Create a new metrics
@@ -44,6 +170,14 @@ metrics_new (void)
     metrics_t *self = (metrics_t *) zmalloc (sizeof (metrics_t));
     assert (self);
     //  Initialize class properties here
+    self->items = zhashx_new ();
+    assert (self->items);
+    //  keys point to metric_t key
+    zhashx_set_key_duplicator (self->items, NULL);
+    zhashx_set_key_destructor (self->items, NULL);
+    zhashx_set_key_hasher (self->items, s_key_hash);
+    zhashx_set_key_comparator (self->items, s_key_compare);
+    zhashx_set_destructor (self->items, (zhashx_destructor_fn *) s_metric_destroy);
     return self;
 }
 
@@ -58,15 +192,161 @@ metrics_destroy (metrics_t **self_p)
     if (*self_p) {
         metrics_t *self = *self_p;
         //  Free class properties here
+        zhashx_destroy (&self->items);
+        free (self->heap);
         //  Free object itself
         free (self);
         *self_p = NULL;
     }
 }
 
+//  --------------------------------------------------------------------------
+//  Store metric under the key, replacing the previous value. Takes the
+//  ownership of the message, *zmmsg_p is set to NULL.
+
+void
+metrics_update (metrics_t *self, uint64_t key, zm_proto_t **zmmsg_p)
+{
+    assert (self);
+    assert (zmmsg_p);
+    if (!*zmmsg_p) return;
+
+    metric_t *metric = (metric_t *) zhashx_lookup (self->items, &key);
+    if (metric) {
+        uint64_t expires = metric->expires;
+        zm_proto_destroy (&metric->zmmsg);
+        metric->zmmsg = *zmmsg_p;
+        metric->expires = s_expires (metric->zmmsg);
+        rule_param_set (&metric->value, zm_proto_value (metric->zmmsg));
+        if (metric->expires < expires)
+            s_heap_sift_up (self, metric->index);
+        else
+            s_heap_sift_down (self, metric->index);
+    }
+    else {
+        metric = (metric_t *) zmalloc (sizeof (metric_t));
+        assert (metric);
+        metric->key = key;
+        metric->zmmsg = *zmmsg_p;
+        metric->expires = s_expires (metric->zmmsg);
+        rule_param_set (&metric->value, zm_proto_value (metric->zmmsg));
+        zhashx_insert (self->items, &metric->key, metric);
+        s_heap_push (self, metric);
+    }
+    *zmmsg_p = NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Return cached metric for the key or NULL if there is none. If value is
+//  not NULL, it is set to parsed value of the metric, valid until the metric
+//  is updated or expired.
+
+zm_proto_t *
+metrics_lookup (metrics_t *self, uint64_t key, rule_param_t *value)
+{
+    assert (self);
+
+    metric_t *metric = (metric_t *) zhashx_lookup (self->items, &key);
+    if (!metric) return NULL;
+    if (value) *value = metric->value;
+    return metric->zmmsg;
+}
+
+//  --------------------------------------------------------------------------
+//  Drop metrics which expired before now. Returns number of dropped metrics.
+
+size_t
+metrics_expire (metrics_t *self, uint64_t now)
+{
+    assert (self);
+
+    size_t dropped = 0;
+    while (self->heap_size && self->heap [0]->expires < now) {
+        metric_t *metric = s_heap_pop (self);
+        zhashx_delete (self->items, &metric->key);
+        ++dropped;
+    }
+    return dropped;
+}
+
+//  --------------------------------------------------------------------------
+//  Return number of cached metrics
+
+size_t
+metrics_size (metrics_t *self)
+{
+    assert (self);
+    return zhashx_size (self->items);
+}
+
+//  --------------------------------------------------------------------------
+//  Return first cached metric, in no particular order, or NULL
+
+zm_proto_t *
+metrics_first (metrics_t *self)
+{
+    assert (self);
+    metric_t *metric = (metric_t *) zhashx_first (self->items);
+    return metric ? metric->zmmsg : NULL;
+}
+
+//  --------------------------------------------------------------------------
+//  Return next cached metric or NULL
+
+zm_proto_t *
+metrics_next (metrics_t *self)
+{
+    assert (self);
+    metric_t *metric = (metric_t *) zhashx_next (self->items);
+    return metric ? metric->zmmsg : NULL;
+}
+
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
+static zm_proto_t *
+s_test_metric (const char *asset, const char *quantity, uint64_t time, uint32_t ttl)
+{
+    zmsg_t *msg = zm_proto_encode_metric_v1 (asset, time, ttl, NULL, quantity, "42", "");
+    zm_proto_t *zmmsg = zm_proto_decode (&msg);
+    assert (zmmsg);
+    return zmmsg;
+}
+
+//  Measure cost of update + expire per message with growing cache
+
+static void
+s_test_benchmark (void)
+{
+    const size_t sizes [] = { 1000, 10000, 100000, 200000, 0 };
+    const size_t messages = 100000;
+    const uint64_t now = 1000000;
+
+    zm_proto_t **zmmsgs = (zm_proto_t **) zmalloc (messages * sizeof (zm_proto_t *));
+    assert (zmmsgs);
+
+    for (int s = 0; sizes [s]; s++) {
+        metrics_t *self = metrics_new ();
+        for (size_t i = 0; i < sizes [s]; i++) {
+            zm_proto_t *zmmsg = s_test_metric ("asset", "load.default", now, 60 + i % 600);
+            metrics_update (self, METRICS_KEY (i + 1, 1), &zmmsg);
+        }
+        for (size_t i = 0; i < messages; i++)
+            zmmsgs [i] = s_test_metric ("asset", "load.default", now + 1, 60 + i % 600);
+
+        int64_t start = zclock_usecs ();
+        for (size_t i = 0; i < messages; i++) {
+            metrics_update (self, METRICS_KEY ((i * 7919) % sizes [s] + 1, 1), &zmmsgs [i]);
+            metrics_expire (self, now);
+        }
+        int64_t elapsed = zclock_usecs () - start;
+        printf ("        cache size %7zu: %.0f ns/message\n",
+            sizes [s], (double) elapsed * 1000.0 / messages);
+        metrics_destroy (&self);
+    }
+    free (zmmsgs);
+}
+
 void
 metrics_test (bool verbose)
 {
@@ -77,6 +357,48 @@ metrics_test (bool verbose)
     metrics_t *self = metrics_new ();
     assert (self);
     metrics_destroy (&self);
+
+    //  Expiration test
+    const uint64_t load_ups = METRICS_KEY (1, 1);
+    const uint64_t status_ups = METRICS_KEY (1, 2);
+    const uint64_t load_epdu = METRICS_KEY (2, 1);
+    self = metrics_new ();
+    zm_proto_t *zmmsg = s_test_metric ("ups", "load", 1000, 10);
+    metrics_update (self, load_ups, &zmmsg);
+    assert (zmmsg == NULL);
+    zmmsg = s_test_metric ("ups", "status", 1000, 20);
+    metrics_update (self, status_ups, &zmmsg);
+    zmmsg = s_test_metric ("epdu", "load", 1000, 5);
+    metrics_update (self, load_epdu, &zmmsg);
+    assert (metrics_size (self) == 3);
+    assert (metrics_lookup (self, load_ups, NULL));
+    assert (metrics_lookup (self, METRICS_KEY (1, 3), NULL) == NULL);
+    rule_param_t value;
+    assert (metrics_lookup (self, status_ups, &value));
+    assert (value.text == NULL && value.number == 42);
+
+    assert (metrics_expire (self, 1005) == 0);
+    assert (metrics_expire (self, 1006) == 1);
+    assert (metrics_lookup (self, load_epdu, NULL) == NULL);
+
+    //  refreshed metric moves back in the expiration order
+    zmmsg = s_test_metric ("ups", "load", 1030, 10);
+    metrics_update (self, load_ups, &zmmsg);
+    assert (metrics_size (self) == 2);
+    assert (metrics_expire (self, 1021) == 1);
+    assert (metrics_lookup (self, status_ups, NULL) == NULL);
+    assert (metrics_lookup (self, load_ups, NULL));
+    zmmsg = metrics_first (self);
+    assert (zmmsg && streq (zm_proto_device (zmmsg), "ups"));
+    assert (metrics_next (self) == NULL);
+    assert (metrics_expire (self, 1041) == 1);
+    assert (metrics_size (self) == 0);
+    metrics_destroy (&self);
+
+    if (verbose) {
+        printf ("\n");
+        s_test_benchmark ();
+    }
     //  @end
     printf ("OK\n");
 }
@@ -32,6 +32,10 @@ typedef struct _metrics_t metrics_t;
 #define METRICS_T_DEFINED
 #endif
 
+//  Cache key of metric, built from asset and quantity ids (see atoms)
+#define METRICS_KEY(asset_id,quantity_id) \
+    (((uint64_t) (asset_id) << 32) | (uint32_t) (quantity_id))
+
 //  @interface
 //  Create a new metrics
 ZM_ALERT_PRIVATE metrics_t *
@@ -41,6 +45,33 @@ ZM_ALERT_PRIVATE metrics_t *
 ZM_ALERT_PRIVATE void
     metrics_destroy (metrics_t **self_p);
 
+//  Store metric under the key, replacing the previous value. Takes the
+//  ownership of the message, *zmmsg_p is set to NULL.
+ZM_ALERT_PRIVATE void
+    metrics_update (metrics_t *self, uint64_t key, zm_proto_t **zmmsg_p);
+
+//  Return cached metric for the key or NULL if there is none. If value is
+//  not NULL, it is set to parsed value of the metric, valid until the metric
+//  is updated or expired.
+ZM_ALERT_PRIVATE zm_proto_t *
+    metrics_lookup (metrics_t *self, uint64_t key, rule_param_t *value);
+
+//  Drop metrics which expired before now. Returns number of dropped metrics.
+ZM_ALERT_PRIVATE size_t
+    metrics_expire (metrics_t *self, uint64_t now);
+
+//  Return number of cached metrics
+ZM_ALERT_PRIVATE size_t
+    metrics_size (metrics_t *self);
+
+//  Return first cached metric, in no particular order, or NULL
+ZM_ALERT_PRIVATE zm_proto_t *
+    metrics_first (metrics_t *self);
+
+//  Return next cached metric or NULL
+ZM_ALERT_PRIVATE zm_proto_t *
+    metrics_next (metrics_t *self);
+
 //  Self test of this class
 ZM_ALERT_PRIVATE void
     metrics_test (bool verbose);
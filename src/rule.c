@@ -31,6 +31,24 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include <sys/mman.h>
+#if defined (__SSE2__) || (defined (__GNUC__) && defined (__x86_64__))
+#include <immintrin.h>
+#endif
+
+//  Kinds of rule evaluation
+
+#define KIND_INVALID    -1      //  unknown "kind" in json
+#define KIND_LUA        0       //  lua "evaluation", the default
+#define KIND_THRESHOLD  1       //  native threshold check, see rule_evaluate
+#define KIND_EXPRESSION 2       //  compiled "expression", see expression
+
+//  Threshold variables in the order they are checked, with their results
+
+static const char *s_threshold_names [] = {
+    "low_critical", "low_warning", "high_critical", "high_warning"
+};
+static const int s_threshold_results [] = { -2, -1, 2, 1 };
 
 //  Structure of our class
 
@@ -38,14 +56,29 @@ struct _rule_t {
     char *name;
     char *description;
     zlist_t *metrics;
+    uint32_t *metric_ids;       //  interned metrics, see rule_intern
+    size_t metric_ids_size;
     zlist_t *assets;
     zlist_t *groups;
     zlist_t *models;
     zlist_t *types;
     zhash_t *result_actions;
     zhashx_t *variables;        //  lua context global variables
+    zhashx_t *descriptions;     //  result -> message template
+    int kind;                   //  KIND_LUA, KIND_THRESHOLD or KIND_EXPRESSION
+    char *expression_source;    //  "expression" of rule ...
+    expression_t *expression;   //  ... and its compiled form
+    double thresholds [4];      //  parsed threshold variables ...
+    bool has_thresholds [4];    //  ... in order of s_threshold_names
     char *evaluation;
-    lua_State *lua;
+    char *json;                 //  Cached rule_json, NULL if not valid
+    size_t json_size;
+    bool memoize;               //  evaluation is a pure function of metrics
+    int coalesce;               //  coalescing window in ms, 0 means none
+    lua_State *lua;             //  state the rule is compiled in
+    lua_State *shared;          //  shared state set by rule_set_lua, not owned
+    int env_ref;                //  registry refs of rule environment ...
+    int main_ref;               //  ... and its main function
 };
 
 
@@ -55,6 +88,22 @@ int string_comparefn (void *i1, void *i2)
     return strcmp ((char *)i1, (char *)i2);
 }
 
+//  Drop compiled lua context of rule. Private state is closed, in shared
+//  state only the references to rule environment are released.
+
+static void
+s_rule_release (rule_t *self)
+{
+    if (!self->lua) return;
+    if (self->shared) {
+        luaL_unref (self->lua, LUA_REGISTRYINDEX, self->env_ref);
+        luaL_unref (self->lua, LUA_REGISTRYINDEX, self->main_ref);
+    }
+    else
+        lua_close (self->lua);
+    self->lua = NULL;
+}
+
 //  --------------------------------------------------------------------------
 //  Create a new rule
 
@@ -85,6 +134,9 @@ rule_new (void)
     self->variables = zhashx_new ();
     zhashx_set_duplicator (self->variables, (zhashx_duplicator_fn *) strdup);
     zhashx_set_destructor (self->variables, (zhashx_destructor_fn *) zstr_free);
+    self->descriptions = zhashx_new ();
+    zhashx_set_duplicator (self->descriptions, (zhashx_duplicator_fn *) strdup);
+    zhashx_set_destructor (self->descriptions, (zhashx_destructor_fn *) zstr_free);
 
     return self;
 }
@@ -95,6 +147,7 @@ void rule_add_result_action (rule_t *self, const char *result, const char *actio
 {
     if (!self || !result) return;
     if (!action) action = "(null)";
+    zstr_free (&self->json);
 
     char *item = (char *) zhash_lookup (self->result_actions, result);
     if (item) {
@@ -110,7 +163,7 @@ void rule_add_result_action (rule_t *self, const char *result, const char *actio
 //  Rule loading callback
 
 static int
-rule_json_callback (const char *locator, const char *value, void *data)
+rule_json_callback (const char *locator, vsjson_view_t value, void *data)
 {
     if (!data) return 1;
 
@@ -122,59 +175,94 @@ rule_json_callback (const char *locator, const char *value, void *data)
 
     if (streq (mylocator, "name")) {
         zstr_free (&self -> name);
-        self -> name = vsjson_decode_string (value);
+        self -> name = vsjson_decode_view (value);
     }
     else if (streq (mylocator, "description")) {
         zstr_free (&self -> description);
-        self -> description = vsjson_decode_string (value);
+        self -> description = vsjson_decode_view (value);
     }
     else if (strncmp (mylocator, "metrics/", 7) == 0) {
-        char *metric = vsjson_decode_string (value);
+        char *metric = vsjson_decode_view (value);
         if (metric) zlist_append (self -> metrics, metric);
         zstr_free (&metric);
     }
     else if (strncmp (mylocator, "assets/", 7) == 0) {
-        char *asset = vsjson_decode_string (value);
+        char *asset = vsjson_decode_view (value);
         if (asset) zlist_append (self -> assets, asset);
         zstr_free (&asset);
     }
     else if (strncmp (mylocator, "groups/", 7) == 0) {
-        char *group = vsjson_decode_string (value);
+        char *group = vsjson_decode_view (value);
         if (group) zlist_append (self -> groups, group);
         zstr_free (&group);
     }
     else if (strncmp (mylocator, "models/", 7) == 0) {
-        char *model = vsjson_decode_string (value);
+        char *model = vsjson_decode_view (value);
         if (model && strlen (model) > 0)
             zlist_append (self->models, model);
         zstr_free (&model);
     }
     else if (strncmp (mylocator, "types/", 6) == 0) {
-        char *type = vsjson_decode_string (value);
+        char *type = vsjson_decode_view (value);
         if (type && strlen (type) > 0)
             zlist_append (self->types, type);
         zstr_free (&type);
     }
     else if (strncmp (mylocator, "results/", 8) == 0) {
         // results/[0/]low_warning/action/0
+        //  result name is between "results/" and end, never before it
         char *end = strstr (mylocator, "/action");
-        if (end) {
+        if (end && end > mylocator + 8) {
             char *start = end;
-            --start;
-            while (*start != '/') --start;
-            ++start;
+            while (start > mylocator + 8 && *(start - 1) != '/') --start;
             size_t size = end - start;
             char *key = (char *) zmalloc (size + 1);
             strncpy (key, start, size);
-            char *action = vsjson_decode_string (value);
+            char *action = vsjson_decode_view (value);
             rule_add_result_action (self, key, action);
             zstr_free (&key);
             zstr_free (&action);
         }
+        // results/low_warning/description
+        end = strstr (mylocator, "/description");
+        if (end && end > mylocator + 8 && streq (end, "/description")) {
+            const char *start = end;
+            while (start > mylocator + 8 && *(start - 1) != '/') --start;
+            char *key = (char *) zmalloc (end - start + 1);
+            memcpy (key, start, end - start);
+            char *description = vsjson_decode_view (value);
+            if (description) zhashx_update (self->descriptions, key, description);
+            zstr_free (&key);
+            zstr_free (&description);
+        }
+    }
+    else if (streq (mylocator, "kind")) {
+        char *kind = vsjson_decode_view (value);
+        if (kind && streq (kind, "lua"))
+            self -> kind = KIND_LUA;
+        else
+        if (kind && streq (kind, "threshold"))
+            self -> kind = KIND_THRESHOLD;
+        else
+            self -> kind = KIND_INVALID;
+        zstr_free (&kind);
+    }
+    else if (streq (mylocator, "expression")) {
+        zstr_free (&self -> expression_source);
+        self -> expression_source = vsjson_decode_view (value);
     }
     else if (streq (mylocator, "evaluation")) {
         zstr_free (&self -> evaluation);
-        self -> evaluation = vsjson_decode_string (value);
+        self -> evaluation = vsjson_decode_view (value);
+    }
+    else if (streq (mylocator, "memoize")) {
+        self -> memoize = value.size == 4 && memcmp (value.data, "true", 4) == 0;
+    }
+    else if (streq (mylocator, "coalesce")) {
+        char number [32];
+        snprintf (number, sizeof (number), "%.*s", (int) value.size, value.data ? value.data : "");
+        self -> coalesce = atoi (number);
+        if (self -> coalesce < 0) self -> coalesce = 0;
     }
     else
     if (strncmp (mylocator, "variables/", 10) == 0)
@@ -184,7 +272,7 @@ rule_json_callback (const char *locator, const char *value, void *data)
         if (!slash)
             return 0;
         slash = slash + 1;
-        char *variable_value = vsjson_decode_string (value);
+        char *variable_value = vsjson_decode_view (value);
         if (!variable_value || strlen (variable_value) == 0) {
             zstr_free (&variable_value);
             return 0;
@@ -199,9 +287,53 @@ rule_json_callback (const char *locator, const char *value, void *data)
 //  --------------------------------------------------------------------------
 //  Parse JSON into rule.
 
+static int
+s_rule_parse (rule_t *self, const char *json, size_t size)
+{
+    zstr_free (&self->json);
+    int result = vsjson_parse_views (json, size, rule_json_callback, self, true);
+    if (result != 0) return result;
+
+    if (self->kind == KIND_INVALID) {
+        zsys_error ("rule %s has unknown kind", self->name);
+        return -1;
+    }
+    if (self->kind == KIND_THRESHOLD) {
+        //  threshold compares exactly one metric with numeric variables
+        if (zlist_size (self->metrics) != 1) {
+            zsys_error ("threshold rule %s must have one metric", self->name);
+            return -1;
+        }
+        for (int i = 0; i < 4; i++) {
+            const char *variable = (const char *) zhashx_lookup (self->variables, s_threshold_names [i]);
+            self->has_thresholds [i] = variable != NULL;
+            if (!variable) continue;
+            rule_param_t param;
+            rule_param_set (&param, variable);
+            if (param.text) {
+                zsys_error ("threshold %s of rule %s is not a number", s_threshold_names [i], self->name);
+                return -1;
+            }
+            self->thresholds [i] = param.number;
+        }
+    }
+    if (self->expression_source) {
+        if (self->kind == KIND_THRESHOLD) {
+            zsys_error ("threshold rule %s can't have expression", self->name);
+            return -1;
+        }
+        self->kind = KIND_EXPRESSION;
+        expression_destroy (&self->expression);
+        self->expression = expression_new (self->expression_source, self->metrics, self->variables);
+        if (!self->expression) return -1;
+    }
+    return 0;
+}
+
 int rule_parse (rule_t *self, const char *json)
 {
-    return vsjson_parse (json, rule_json_callback, self, true);
+    if (!json) return -1;
+    return s_rule_parse (self, json, strlen (json));
 }
 
 //  --------------------------------------------------------------------------
@@ -214,6 +346,26 @@ rule_name (rule_t *self)
     return self->name;
 }
 
+//  --------------------------------------------------------------------------
+//  Can result of the last evaluation be reused while metrics do not change?
+
+bool
+rule_memoize (rule_t *self)
+{
+    assert (self);
+    return self->memoize;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return coalescing window of rule in milliseconds, 0 if there is none
+
+int
+rule_coalesce (rule_t *self)
+{
+    assert (self);
+    return self->coalesce;
+}
 
 //  --------------------------------------------------------------------------
 //  Does rule contain this asset name?
@@ -274,6 +426,55 @@ rule_metric_next (rule_t *self)
 }
 
 
+//  --------------------------------------------------------------------------
+//  Intern rule metrics into atoms table, so they can be accessed by
+//  rule_metric_ids.
+
+void
+rule_intern (rule_t *self, atoms_t *atoms)
+{
+    assert (self);
+    assert (atoms);
+
+    free (self->metric_ids);
+    self->metric_ids_size = zlist_size (self->metrics);
+    self->metric_ids = (uint32_t *) zmalloc ((self->metric_ids_size + 1) * sizeof (uint32_t));
+    assert (self->metric_ids);
+    size_t i = 0;
+    const char *metric = (const char *) zlist_first (self->metrics);
+    while (metric) {
+        self->metric_ids [i++] = atoms_intern (atoms, metric);
+        metric = (const char *) zlist_next (self->metrics);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return ids of rule metrics in the order of metrics in rule, size is set
+//  to the number of ids. Returns NULL if rule was not interned yet.
+
+const uint32_t *
+rule_metric_ids (rule_t *self, size_t *size)
+{
+    assert (self);
+    assert (size);
+    *size = self->metric_ids_size;
+    return self->metric_ids;
+}
+
+//  --------------------------------------------------------------------------
+//  Does rule contain metric with this id?
+
+bool
+rule_metric_id_exists (rule_t *self, uint32_t id)
+{
+    assert (self);
+    for (size_t i = 0; i < self->metric_ids_size; i++) {
+        if (self->metric_ids [i] == id)
+            return true;
+    }
+    return false;
+}
+
 //  --------------------------------------------------------------------------
 //  Does rule contain this model?
 
@@ -299,6 +500,86 @@ rule_type_exists (rule_t *self, const char *type)
     return zlist_exists (self->types, (void *) type);
 }
 
+//  --------------------------------------------------------------------------
+//  Return the first asset name of rule. If there are none, returns NULL.
+
+const char *
+rule_asset_first (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_first (self->assets);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the next asset name of rule. If there are no (more), returns NULL.
+
+const char *
+rule_asset_next (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_next (self->assets);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the first group of rule. If there are none, returns NULL.
+
+const char *
+rule_group_first (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_first (self->groups);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the next group of rule. If there are no (more), returns NULL.
+
+const char *
+rule_group_next (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_next (self->groups);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the first model of rule. If there are none, returns NULL.
+
+const char *
+rule_model_first (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_first (self->models);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the next model of rule. If there are no (more), returns NULL.
+
+const char *
+rule_model_next (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_next (self->models);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the first type of rule. If there are none, returns NULL.
+
+const char *
+rule_type_first (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_first (self->types);
+}
+
+//  --------------------------------------------------------------------------
+//  Return the next type of rule. If there are no (more), returns NULL.
+
+const char *
+rule_type_next (rule_t *self)
+{
+    assert (self);
+    return (const char *) zlist_next (self->types);
+}
+
 //  --------------------------------------------------------------------------
 //  Get rule actions
 
@@ -351,6 +632,36 @@ rule_global_variables (rule_t *self)
 //  --------------------------------------------------------------------------
 //  Load json rule from file
 
+//  Read whole file which can't be mapped. Returns buffer and sets its
+//  size, or NULL on error.
+
+static char *
+s_read_file (int fd, size_t *size_p)
+{
+    size_t capacity = 4096;
+    size_t size = 0;
+    char *buffer = (char *) malloc (capacity);
+    while (buffer) {
+        if (size == capacity) {
+            capacity *= 2;
+            char *bigger = (char *) realloc (buffer, capacity);
+            if (!bigger) break;
+            buffer = bigger;
+        }
+        ssize_t rc = read (fd, buffer + size, capacity - size);
+        if (rc == 0) {
+            *size_p = size;
+            return buffer;
+        }
+        if (rc == -1 && errno != EINTR) break;
+        if (rc > 0) size += rc;
+    }
+    free (buffer);
+    return NULL;
+}
+
+//  Regular file is mapped and parsed in place, without copying
+
 int rule_load (rule_t *self, const char *path)
 {
     int fd = open (path, O_RDONLY);
@@ -359,17 +670,27 @@ int rule_load (rule_t *self, const char *path)
     struct stat rstat;
     if (fstat (fd, &rstat) != 0) {
         zsys_error ("can't stat file %s", path);
+        close (fd);
+        return -1;
     }
-
-    int capacity = rstat.st_size + 1;
-    char *buffer = (char *) zmalloc (capacity + 1);
-    assert (buffer);
-
-    if (read (fd, buffer, capacity) == -1) {
-        zsys_error ("Error while reading rule %s", path);
+    int result = -1;
+    if (S_ISREG (rstat.st_mode) && rstat.st_size > 0) {
+        size_t size = (size_t) rstat.st_size;
+        void *map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close (fd);
+            result = s_rule_parse (self, (const char *) map, size);
+            munmap (map, size);
+            return result;
+        }
     }
+    size_t size;
+    char *buffer = s_read_file (fd, &size);
     close (fd);
-    int result = rule_parse (self, buffer);
+    if (buffer)
+        result = s_rule_parse (self, buffer, size);
+    else
+        zsys_error ("Error while reading rule %s", path);
     free (buffer);
     return result;
 }
@@ -382,344 +703,830 @@ int rule_save (rule_t *self, const char *path)
     int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC,  S_IRUSR | S_IWUSR);
     if (fd == -1) return -1;
 
-    char *json = rule_json (self);
-    if (! json) return -2;
-    if (write (fd, json, strlen(json)) == -1) {
+    size_t size;
+    const char *json = rule_json_cached (self, &size);
+    if (! json) {
+        close (fd);
+        return -2;
+    }
+    if (write (fd, json, size) != (ssize_t) size) {
         zsys_error ("Error while writting rule %s", path);
-        zstr_free (&json);
+        close (fd);
         return -3;
     }
-    zstr_free (&json);
     close (fd);
     return 0;
 }
 
-static int rule_compile (rule_t *self)
+//  --------------------------------------------------------------------------
+//  Use shared lua state for this rule. Rule is compiled into its own
+//  environment table inside the state, so it does not see globals of other
+//  rules. Passing NULL returns the rule to its own private lua state. Shared
+//  state must outlive the rule.
+
+void
+rule_set_lua (rule_t *self, lua_State *lua)
 {
-    if (!self) return 0;
-    // destroy old context
-    if (self -> lua) {
-        lua_close (self->lua);
-        self->lua = NULL;
-    }
-    // compile
+    if (!self || self->shared == lua) return;
+    s_rule_release (self);
+    self->shared = lua;
+}
+
 #if LUA_VERSION_NUM > 501
-    self -> lua = luaL_newstate();
+#   define s_push_globals(L) lua_pushglobaltable (L)
+#   define s_set_env(L,idx) lua_setupvalue (L, (idx), 1)
 #else
-    self -> lua = lua_open();
+#   define s_push_globals(L) lua_pushvalue (L, LUA_GLOBALSINDEX)
+#   define s_set_env(L,idx) lua_setfenv (L, (idx))
 #endif
-    if (!self->lua) return 0;
-    luaL_openlibs(self -> lua); // get functions like print();
-    if (luaL_dostring (self -> lua, self -> evaluation) != 0) {
-        zsys_error ("rule %s has an error", self -> name);
-        lua_close (self -> lua);
-        self -> lua = NULL;
-        return 0;
-    }
-    lua_getglobal (self -> lua, "main");
-    if (!lua_isfunction (self -> lua, -1)) {
-        zsys_error ("main function not found in rule %s", self -> name);
-        lua_close (self->lua);
-        self -> lua = NULL;
-        return 0;
-    }
-    lua_pushnumber(self -> lua, 0);
-    lua_setglobal(self -> lua, "OK");
-    lua_pushnumber(self -> lua, 1);
-    lua_setglobal(self -> lua, "WARNING");
-    lua_pushnumber(self -> lua, 1);
-    lua_setglobal(self -> lua, "HIGH_WARNING");
-    lua_pushnumber(self -> lua, 2);
-    lua_setglobal(self -> lua, "CRITICAL");
-    lua_pushnumber(self -> lua, 2);
-    lua_setglobal(self -> lua, "HIGH_CRITICAL");
-    lua_pushnumber(self -> lua, -1);
-    lua_setglobal(self -> lua, "LOW_WARNING");
-    lua_pushnumber(self -> lua, -2);
-    lua_setglobal(self -> lua, "LOW_CRITICAL");
-
-    //  set global variables
-    const char *item = (const char *) zhashx_first (self->variables);
-    while (item) {
-        const char *key = (const char *) zhashx_cursor (self->variables);
-        lua_pushstring (self->lua, item);
-        lua_setglobal (self->lua, key);
-        item = (const char *) zhashx_next (self->variables);
-    }
-
-    return 1;
-}
-
 
 //  --------------------------------------------------------------------------
-//  Evaluate rule
+//  Set parameter from metric value. Value is parsed as number if possible,
+//  otherwise parameter refers to value as text.
 
 void
-rule_evaluate (rule_t *self, zlist_t *params, const char *iname, const char *ename, int *result, char **message)
+rule_param_set (rule_param_t *param, const char *value)
 {
-    if (!self || !params || !iname || !result || !message) return;
-
-    *result = RULE_ERROR;
-    *message = NULL;
-    if (!self -> lua) {
-        if (! rule_compile (self)) return;
-    }
-    lua_pushstring(self -> lua, ename ? ename : iname);
-    lua_setglobal(self -> lua, "NAME");
-    lua_pushstring(self -> lua, iname);
-    lua_setglobal(self -> lua, "INAME");
-    lua_settop (self->lua, 0);
-    lua_getglobal (self->lua, "main");
-    char *value = (char *) zlist_first (params);
-    while (value) {
-        lua_pushstring (self -> lua, value);
-        value = (char *) zlist_next (params);
-    }
-    if (lua_pcall(self -> lua, zlist_size (params), 2, 0) == 0) {
-        // calculated
-        if (lua_isnumber (self -> lua, -1)) {
-            *result = lua_tointeger(self -> lua, -1);
-            const char *msg = lua_tostring (self->lua, -2);
-            if (msg) *message = strdup (msg);
-        }
-        else if (lua_isnumber (self -> lua, -2)) {
-            *result = lua_tointeger(self -> lua, -2);
-            const char *msg = lua_tostring (self->lua, -1);
-            if (msg) *message = strdup (msg);
-        }
-        lua_pop (self->lua, 2);
+    static const double powers [] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    assert (param);
+    param->number = 0;
+    param->text = value ? value : "";
+
+    //  plain decimals up to 15 digits are exact in the mantissa and the
+    //  division by exact power of ten rounds correctly
+    const char *p = param->text;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') p++;
+    uint64_t mantissa = 0;
+    int digits = 0, scale = 0;
+    for (; *p >= '0' && *p <= '9'; p++, digits++)
+        mantissa = mantissa * 10 + (*p - '0');
+    if (*p == '.')
+        for (p++; *p >= '0' && *p <= '9'; p++, digits++, scale++)
+            mantissa = mantissa * 10 + (*p - '0');
+    if (*p == 0 && digits > 0 && digits <= 15) {
+        double number = (double) mantissa / powers [scale];
+        param->number = negative ? -number : number;
+        param->text = NULL;
+        return;
     }
+    //  exponents, long numbers, surrounding spaces
+    char *end;
+    double number = strtod (param->text, &end);
+    if (end == param->text) return;
+    while (isspace ((unsigned char) *end)) end++;
+    if (*end || !isfinite (number)) return;
+    param->number = number;
+    param->text = NULL;
+}
+
+static void
+s_push_param (lua_State *lua, const rule_param_t *param)
+{
+    if (param->text)
+        lua_pushstring (lua, param->text);
+    else
+    //  integral values stay integers, so "64" is not printed as "64.0"
+    if (param->number >= -2147483648.0 && param->number <= 2147483647.0
+    &&  (lua_Integer) param->number == param->number)
+        lua_pushinteger (lua, (lua_Integer) param->number);
+    else
+        lua_pushnumber (lua, param->number);
 }
 
+#if LUA_VERSION_NUM > 501
 //  --------------------------------------------------------------------------
-//  Create json from rule
+//  Order of number and string, used by string metatable. Metric values are
+//  numbers while rule variables stay strings, so a rule can compare them
+//  directly as it did when both were strings.
 
-static char * s_string_append (char **string_p, size_t *capacity, const char *append)
+static int
+s_string_compare (lua_State *lua, bool equal)
 {
-    if (! string_p) return NULL;
-    if (! append) return *string_p;
-
-    char *string = *string_p;
-    if (!string) {
-        string = (char *) zmalloc (512);
-        *capacity = 512;
-    }
-    size_t l1 = strlen (string);
-    size_t l2 = strlen (append);
-    size_t required = l1+l2+1;
-    if (*capacity < required) {
-        size_t newcapacity = *capacity;
-        while (newcapacity < required) {
-            newcapacity += 512;
-        }
-        char *tmp = (char *) realloc (string, newcapacity);
-        if (!tmp) {
-            free (string);
-            *capacity = 0;
-            return NULL;
-        }
-        string = tmp;
-        *capacity = newcapacity;
-    }
-    strncat (string, append, *capacity);
-    *string_p = string;
-    return string;
+    if (!lua_isnumber (lua, 1) || !lua_isnumber (lua, 2))
+        return luaL_error (lua, "attempt to compare %s with %s",
+            luaL_typename (lua, 1), luaL_typename (lua, 2));
+    lua_Number a = lua_tonumber (lua, 1);
+    lua_Number b = lua_tonumber (lua, 2);
+    lua_pushboolean (lua, equal ? a <= b : a < b);
+    return 1;
 }
 
-static char * s_zlist_to_json_array (zlist_t* list)
+static int
+s_string_lt (lua_State *lua)
 {
-    if (!list) return strdup("[]");
-    char *item = (char *) zlist_first (list);
-    char *json = NULL;
-    size_t jsonsize = 0;
-    s_string_append (&json, &jsonsize, "[");
-    while (item) {
-        char *encoded = vsjson_encode_string (item);
-        s_string_append (&json, &jsonsize, encoded);
-        s_string_append (&json, &jsonsize, ", ");
-        zstr_free (&encoded);
-        item = (char *) zlist_next (list);
-    }
-    if (zlist_size (list)) {
-        size_t x = strlen (json);
-        json [x-2] = 0;
-    }
-    s_string_append (&json, &jsonsize, "]");
-    return json;
+    return s_string_compare (lua, false);
 }
 
-static char * s_actions_to_json_array (const char *actions)
+static int
+s_string_le (lua_State *lua)
 {
-    char *array = NULL;
-    char *a2 = strdup (actions);
-    size_t capacity = 0;
+    return s_string_compare (lua, true);
+}
 
-    char *start = a2;
-    s_string_append (&array, &capacity, "[");
-    while (start) {
-        char *end = strchr (start, '/');
-        if (end) {
-            *end = 0;
-            if (! streq (start, "(null)")) {
-                char *action = vsjson_encode_string (start);
-                s_string_append (&array, &capacity, action);
-                s_string_append (&array, &capacity, ", ");
-                zstr_free (&action);
-            }
-            start = end;
-            ++start;
-        } else {
-            if (! streq (start, "(null)")) {
-                char *action = vsjson_encode_string (start);
-                s_string_append (&array, &capacity, action);
-                zstr_free (&action);
-            }
-            start = NULL;
-        }
+static void
+s_set_string_compare (lua_State *lua)
+{
+    lua_pushliteral (lua, "");
+    if (lua_getmetatable (lua, -1)) {
+        lua_pushcfunction (lua, s_string_lt);
+        lua_setfield (lua, -2, "__lt");
+        lua_pushcfunction (lua, s_string_le);
+        lua_setfield (lua, -2, "__le");
+        lua_pop (lua, 1);
     }
-    zstr_free (&a2);
-    s_string_append (&array, &capacity, "]");
-    return array;
+    lua_pop (lua, 1);
 }
+#else
+//  lua 5.1 does not use metamethods to compare number with string
+#   define s_set_string_compare(L)
+#endif
 
+static void
+s_set_number (lua_State *lua, const char *name, lua_Number value)
+{
+    lua_pushnumber (lua, value);
+    lua_setfield (lua, -2, name);
+}
 
 //  --------------------------------------------------------------------------
-//  Convert rule back to json
-//  Caller is responsible for destroying the return value
+//  Bytecode cache file of lua source. Bytecode is not portable between lua
+//  versions, so version is a part of the name.
 
-char *
-rule_json (rule_t *self)
+static char *
+s_cache_path (const char *cachedir, const char *source)
 {
-    if (!self) return NULL;
+    zdigest_t *digest = zdigest_new ();
+    zdigest_update (digest, (const byte *) source, strlen (source));
+    char *path = zsys_sprintf ("%s/%s-%d.luac", cachedir, zdigest_string (digest), LUA_VERSION_NUM);
+    zdigest_destroy (&digest);
+    return path;
+}
 
-    char *json = NULL;
-    size_t jsonsize = 0;
-    {
-        //json start + name
-        char *jname = vsjson_encode_string (self->name);
-        s_string_append (&json, &jsonsize, "{\n\"name\":");
-        s_string_append (&json, &jsonsize, jname);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&jname);
-    }
-    {
-        char *desc = vsjson_encode_string (self->description ? self->description : "");
-        s_string_append (&json, &jsonsize, "\"description\":");
-        s_string_append (&json, &jsonsize, desc);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&desc);
-    }
-    {
-        //metrics
-        char *tmp = s_zlist_to_json_array (self->metrics);
-        s_string_append (&json, &jsonsize, "\"metrics\":");
-        s_string_append (&json, &jsonsize, tmp);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&tmp);
-    }
-    {
-        //assets
-        char *tmp = s_zlist_to_json_array (self->assets);
-        s_string_append (&json, &jsonsize, "\"assets\":");
-        s_string_append (&json, &jsonsize, tmp);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&tmp);
-    }
-    {
-        //models
-        char *tmp = s_zlist_to_json_array (self->models);
-        s_string_append (&json, &jsonsize, "\"models\":");
-        s_string_append (&json, &jsonsize, tmp);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&tmp);
-    }
-    {
-        //groups
-        char *tmp = s_zlist_to_json_array (self->groups);
-        s_string_append (&json, &jsonsize, "\"groups\":");
-        s_string_append (&json, &jsonsize, tmp);
-        s_string_append (&json, &jsonsize, ",\n");
-        zstr_free (&tmp);
+static int
+s_cache_writer (lua_State *lua, const void *data, size_t size, void *file)
+{
+    return fwrite (data, 1, size, (FILE *) file) == size ? 0 : 1;
+}
+
+//  Store compiled chunk on top of the stack to the cache
+
+static void
+s_cache_store (lua_State *lua, const char *path)
+{
+    //  unique temporary file, rules with the same source may be compiled
+    //  by parallel loaders
+    char *tmp = zsys_sprintf ("%s.XXXXXX", path);
+    int fd = mkstemp (tmp);
+    FILE *file = fd >= 0 ? fdopen (fd, "wb") : NULL;
+    if (fd >= 0 && !file) {
+        close (fd);
+        unlink (tmp);
     }
-    {
-        //results
-        s_string_append (&json, &jsonsize, "\"results\": {\n");
-        const void *result = zhash_first (self->result_actions);
-        bool first = true;
-        while (result) {
-            if (first) {
-                first = false;
-            } else {
-                s_string_append (&json, &jsonsize, ",\n");
-            }
-            char *key = vsjson_encode_string (zhash_cursor (self->result_actions));
-            s_string_append (&json, &jsonsize, key);
-            s_string_append (&json, &jsonsize, ": {\"action\":");
-            char *array = s_actions_to_json_array ( (const char *)result);
-            s_string_append (&json, &jsonsize, array);
-            s_string_append (&json, &jsonsize, "}");
-            zstr_free (&array);
-            zstr_free (&key);
-            result = zhash_next (self->result_actions);
+    if (file) {
+#if LUA_VERSION_NUM > 502
+        int rv = lua_dump (lua, s_cache_writer, file, 0);
+#else
+        int rv = lua_dump (lua, s_cache_writer, file);
+#endif
+        if (fclose (file) != 0 || rv != 0 || rename (tmp, path) != 0) {
+            zsys_warning ("can't write lua cache %s", path);
+            unlink (tmp);
         }
-        s_string_append (&json, &jsonsize, "},\n");
     }
-    {
-        //variables
-        if (zhashx_size (self->variables)) {
-            s_string_append (&json, &jsonsize, "\"variables\": {\n");
-            char *item = (char *)zhashx_first (self->variables);
-            bool first = true;
-            while (item) {
-                if (first) {
-                    first = false;
-                } else {
-                    s_string_append (&json, &jsonsize, ",\n");
-                }
-                char *key = vsjson_encode_string((char *)zhashx_cursor (self->variables));
-                char *value = vsjson_encode_string (item);
-                s_string_append (&json, &jsonsize, key);
-                s_string_append (&json, &jsonsize, ":");
-                s_string_append (&json, &jsonsize, value);
-                zstr_free (&key);
-                zstr_free (&value);
-                item = (char *) zhashx_next (self->variables);
-            }
-            s_string_append (&json, &jsonsize, "},\n");
+    zstr_free (&tmp);
+}
+
+//  Push compiled evaluation of rule, from the cache if it is there.
+//  Returns 0 on success, lua error code otherwise.
+
+static int
+s_rule_load_chunk (rule_t *self, lua_State *lua, const char *cachedir)
+{
+    const char *source = self->evaluation ? self->evaluation : "";
+    if (!cachedir)
+        return luaL_loadstring (lua, source);
+
+    int rv = -1;
+    char *path = s_cache_path (cachedir, source);
+    zchunk_t *chunk = zchunk_slurp (path, 0);
+    //  accept only binary chunks, never a source planted in the cache
+    if (chunk && zchunk_size (chunk) && zchunk_data (chunk) [0] == LUA_SIGNATURE [0]) {
+        rv = luaL_loadbuffer (lua, (const char *) zchunk_data (chunk), zchunk_size (chunk), self->name);
+        if (rv != 0) {
+            zsys_warning ("invalid lua cache %s of rule %s", path, self->name);
+            lua_pop (lua, 1);
         }
+        zchunk_destroy (&chunk);
     }
-    {
-        //json evaluation
-        char *eval = vsjson_encode_string (self->evaluation);
-        s_string_append (&json, &jsonsize, "\"evaluation\":");
-        s_string_append (&json, &jsonsize, eval);
-        s_string_append (&json, &jsonsize, "\n}\n");
-        zstr_free (&eval);
+    if (rv != 0) {
+        rv = luaL_loadstring (lua, source);
+        if (rv == 0)
+            s_cache_store (lua, path);
     }
-    return json;
+    zstr_free (&path);
+    return rv;
 }
 
 //  --------------------------------------------------------------------------
-//  Destroy the rule
+//  Compile rule evaluation. Compiled bytecode is stored to and loaded from
+//  cachedir, NULL means no cache. Returns 1 on success, 0 otherwise.
 
-void
-rule_destroy (rule_t **self_p)
+int
+rule_compile (rule_t *self, const char *cachedir)
 {
-    assert (self_p);
-    if (*self_p) {
-        rule_t *self = *self_p;
-        //  Free class properties here
-        zstr_free (&self->name);
-        zstr_free (&self->description);
-        zstr_free (&self->evaluation);
-        if (self->lua) lua_close (self->lua);
-        zlist_destroy (&self->metrics);
-        zlist_destroy (&self->assets);
-        zlist_destroy (&self->groups);
+    if (!self) return 0;
+    if (self->kind != KIND_LUA) return 1;
+    // destroy old context
+    s_rule_release (self);
+    // compile
+    lua_State *lua = self->shared;
+    if (!lua) {
+#if LUA_VERSION_NUM > 501
+        lua = luaL_newstate();
+#else
+        lua = lua_open();
+#endif
+        if (!lua) return 0;
+        luaL_openlibs(lua); // get functions like print();
+    }
+    s_set_string_compare (lua);
+    if (s_rule_load_chunk (self, lua, cachedir) != 0) {
+        zsys_error ("rule %s has an error", self -> name);
+        goto failure;
+    }
+    if (self->shared) {
+        // own environment, falling back to shared globals for libraries
+        lua_newtable (lua);
+        lua_newtable (lua);
+        s_push_globals (lua);
+        lua_setfield (lua, -2, "__index");
+        lua_setmetatable (lua, -2);
+        lua_pushvalue (lua, -1);
+        s_set_env (lua, -3);
+    }
+    else
+        s_push_globals (lua);
+    // stack: chunk, environment
+    lua_insert (lua, -2);
+    if (lua_pcall (lua, 0, 0, 0) != 0) {
+        zsys_error ("rule %s has an error", self -> name);
+        goto failure;
+    }
+    lua_getfield (lua, -1, "main");
+    if (!lua_isfunction (lua, -1)) {
+        zsys_error ("main function not found in rule %s", self -> name);
+        goto failure;
+    }
+    self->main_ref = luaL_ref (lua, LUA_REGISTRYINDEX);
+
+    s_set_number (lua, "OK", 0);
+    s_set_number (lua, "WARNING", 1);
+    s_set_number (lua, "HIGH_WARNING", 1);
+    s_set_number (lua, "CRITICAL", 2);
+    s_set_number (lua, "HIGH_CRITICAL", 2);
+    s_set_number (lua, "LOW_WARNING", -1);
+    s_set_number (lua, "LOW_CRITICAL", -2);
+
+    //  set global variables, as strings like in rule json
+    const char *item = (const char *) zhashx_first (self->variables);
+    while (item) {
+        const char *key = (const char *) zhashx_cursor (self->variables);
+        lua_pushstring (lua, item);
+        lua_setfield (lua, -2, key);
+        item = (const char *) zhashx_next (self->variables);
+    }
+    self->env_ref = luaL_ref (lua, LUA_REGISTRYINDEX);
+    self->lua = lua;
+    return 1;
+
+failure:
+    if (self->shared)
+        lua_settop (lua, 0);
+    else
+        lua_close (lua);
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Expand $NAME, $INAME and $VALUE in message template
+
+static char *
+s_expand (const char *template, const char *name, const char *iname, const char *value)
+{
+    const char *keys [] = { "$NAME", "$INAME", "$VALUE", NULL };
+    const char *values [] = { name, iname, value };
+    char *message = NULL;
+    //  first pass measures, second one copies
+    for (int pass = 0; pass < 2; pass++) {
+        size_t length = 0;
+        const char *p = template;
+        while (*p) {
+            int key = -1;
+            for (int i = 0; *p == '$' && keys [i]; i++)
+                if (strncmp (p, keys [i], strlen (keys [i])) == 0) {
+                    key = i;
+                    break;
+                }
+            if (key >= 0) {
+                size_t size = strlen (values [key]);
+                if (message) memcpy (message + length, values [key], size);
+                length += size;
+                p += strlen (keys [key]);
+            }
+            else {
+                if (message) message [length] = *p;
+                length++;
+                p++;
+            }
+        }
+        if (!message)
+            message = (char *) zmalloc (length + 1);
+    }
+    return message;
+}
+
+//  Message of native evaluation, from description of the result, if any
+
+static char *
+s_native_message (rule_t *self, const char *level, double value, const char *iname, const char *ename)
+{
+    //  numbers are formatted as lua does
+    char text [32];
+    snprintf (text, sizeof (text), "%.14g", value);
+    const char *template = (const char *) zhashx_lookup (self->descriptions, level);
+    if (template)
+        return s_expand (template, ename ? ename : iname, iname, text);
+    return zsys_sprintf ("%s of %s is %s (%s)", self->name, ename ? ename : iname, level, text);
+}
+
+//  Native evaluation of threshold rule, same checks as threshold.rule does
+//  in lua. Message is built from description of the result, if any.
+
+static void
+s_evaluate_threshold (rule_t *self, const rule_param_t *params, size_t params_size, const char *iname, const char *ename, int *result, char **message)
+{
+    if (params_size != 1 || params [0].text) return;
+
+    double value = params [0].number;
+    int index = -1;
+    for (int i = 0; i < 4; i++) {
+        if (!self->has_thresholds [i]) continue;
+        if (i < 2 ? value < self->thresholds [i] : value > self->thresholds [i]) {
+            index = i;
+            break;
+        }
+    }
+    *result = index < 0 ? 0 : s_threshold_results [index];
+    *message = s_native_message (self, index < 0 ? "ok" : s_threshold_names [index], value, iname, ename);
+}
+
+//  Evaluation of compiled expression, its value is the result. $VALUE in
+//  message is the value of the first metric.
+
+static void
+s_evaluate_expression (rule_t *self, const rule_param_t *params, size_t params_size, const char *iname, const char *ename, int *result, char **message)
+{
+    double value;
+    if (expression_evaluate (self->expression, params, params_size, &value) != 0) return;
+    if (value < INT_MIN || value > INT_MAX) return;
+
+    *result = (int) value;
+    *message = rule_message (self, *result, params_size && !params [0].text ? params [0].number : 0, iname, ename);
+}
+
+//  --------------------------------------------------------------------------
+//  Evaluate rule
+
+void
+rule_evaluate (rule_t *self, const rule_param_t *params, size_t params_size, const char *iname, const char *ename, int *result, char **message)
+{
+    if (!self || (!params && params_size) || !iname || !result || !message) return;
+
+    *result = RULE_ERROR;
+    *message = NULL;
+    if (self->kind == KIND_THRESHOLD) {
+        s_evaluate_threshold (self, params, params_size, iname, ename, result, message);
+        return;
+    }
+    if (self->kind == KIND_EXPRESSION) {
+        s_evaluate_expression (self, params, params_size, iname, ename, result, message);
+        return;
+    }
+    if (!self -> lua) {
+        if (! rule_compile (self, NULL)) return;
+    }
+    lua_State *lua = self->lua;
+    lua_settop (lua, 0);
+    lua_rawgeti (lua, LUA_REGISTRYINDEX, self->env_ref);
+    lua_pushstring (lua, ename ? ename : iname);
+    lua_setfield (lua, -2, "NAME");
+    lua_pushstring (lua, iname);
+    lua_setfield (lua, -2, "INAME");
+    lua_pop (lua, 1);
+    lua_rawgeti (lua, LUA_REGISTRYINDEX, self->main_ref);
+    for (size_t i = 0; i < params_size; i++)
+        s_push_param (lua, &params [i]);
+    if (lua_pcall(lua, params_size, 2, 0) == 0) {
+        // calculated
+        if (lua_isnumber (lua, -1)) {
+            *result = lua_tointeger(lua, -1);
+            const char *msg = lua_tostring (lua, -2);
+            if (msg) *message = strdup (msg);
+        }
+        else if (lua_isnumber (lua, -2)) {
+            *result = lua_tointeger(lua, -2);
+            const char *msg = lua_tostring (lua, -1);
+            if (msg) *message = strdup (msg);
+        }
+    }
+    lua_settop (lua, 0);
+}
+
+//  --------------------------------------------------------------------------
+//  Batch classification of values against thresholds, see
+//  rule_evaluate_batch. Missing low thresholds are -inf and missing high
+//  ones +inf, so their comparisons never hold. Results are blended from
+//  the least to the most important check, the last one that holds wins.
+
+static void
+s_classify_scalar (const double *thresholds, const double *values, size_t count, int *results)
+{
+    for (size_t i = 0; i < count; i++) {
+        double value = values [i];
+        results [i] =
+            value < thresholds [0] ? -2 :
+            value < thresholds [1] ? -1 :
+            value > thresholds [2] ? 2 :
+            value > thresholds [3] ? 1 : 0;
+    }
+}
+
+#if defined (__SSE2__)
+static size_t
+s_classify_sse2 (const double *thresholds, const double *values, size_t count, int *results)
+{
+    const __m128d low_critical = _mm_set1_pd (thresholds [0]);
+    const __m128d low_warning = _mm_set1_pd (thresholds [1]);
+    const __m128d high_critical = _mm_set1_pd (thresholds [2]);
+    const __m128d high_warning = _mm_set1_pd (thresholds [3]);
+    size_t i;
+    for (i = 0; i + 2 <= count; i += 2) {
+        __m128d value = _mm_loadu_pd (values + i);
+        __m128d result = _mm_and_pd (_mm_cmpgt_pd (value, high_warning), _mm_set1_pd (1));
+        __m128d mask = _mm_cmpgt_pd (value, high_critical);
+        result = _mm_or_pd (_mm_and_pd (mask, _mm_set1_pd (2)), _mm_andnot_pd (mask, result));
+        mask = _mm_cmplt_pd (value, low_warning);
+        result = _mm_or_pd (_mm_and_pd (mask, _mm_set1_pd (-1)), _mm_andnot_pd (mask, result));
+        mask = _mm_cmplt_pd (value, low_critical);
+        result = _mm_or_pd (_mm_and_pd (mask, _mm_set1_pd (-2)), _mm_andnot_pd (mask, result));
+        _mm_storel_epi64 ((__m128i *) (results + i), _mm_cvtpd_epi32 (result));
+    }
+    return i;
+}
+#endif
+
+#if defined (__GNUC__) && defined (__x86_64__)
+__attribute__ ((target ("avx")))
+static size_t
+s_classify_avx (const double *thresholds, const double *values, size_t count, int *results)
+{
+    const __m256d low_critical = _mm256_set1_pd (thresholds [0]);
+    const __m256d low_warning = _mm256_set1_pd (thresholds [1]);
+    const __m256d high_critical = _mm256_set1_pd (thresholds [2]);
+    const __m256d high_warning = _mm256_set1_pd (thresholds [3]);
+    size_t i;
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m256d value = _mm256_loadu_pd (values + i);
+        __m256d result = _mm256_setzero_pd ();
+        result = _mm256_blendv_pd (result, _mm256_set1_pd (1), _mm256_cmp_pd (value, high_warning, _CMP_GT_OQ));
+        result = _mm256_blendv_pd (result, _mm256_set1_pd (2), _mm256_cmp_pd (value, high_critical, _CMP_GT_OQ));
+        result = _mm256_blendv_pd (result, _mm256_set1_pd (-1), _mm256_cmp_pd (value, low_warning, _CMP_LT_OQ));
+        result = _mm256_blendv_pd (result, _mm256_set1_pd (-2), _mm256_cmp_pd (value, low_critical, _CMP_LT_OQ));
+        _mm_storeu_si128 ((__m128i *) (results + i), _mm256_cvtpd_epi32 (result));
+    }
+    return i;
+}
+
+//  CPU features are detected once before main, so evaluating threads only
+//  read the flag
+
+static bool s_avx;
+
+__attribute__ ((constructor))
+static void
+s_detect_avx (void)
+{
+    __builtin_cpu_init ();
+    s_avx = __builtin_cpu_supports ("avx");
+}
+#endif
+
+//  --------------------------------------------------------------------------
+//  Evaluate threshold rule for many values at once
+
+int
+rule_evaluate_batch (rule_t *self, const double *values, size_t count, int *results)
+{
+    if (!self || self->kind != KIND_THRESHOLD) return -1;
+
+    double thresholds [4];
+    for (int i = 0; i < 4; i++)
+        thresholds [i] = self->has_thresholds [i] ? self->thresholds [i] : (i < 2 ? -INFINITY : INFINITY);
+    size_t done = 0;
+#if defined (__GNUC__) && defined (__x86_64__)
+    if (s_avx)
+        done = s_classify_avx (thresholds, values, count, results);
+#endif
+#if defined (__SSE2__)
+    done += s_classify_sse2 (thresholds, values + done, count - done, results + done);
+#endif
+    s_classify_scalar (thresholds, values + done, count - done, results + done);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Message of result of native rule
+
+char *
+rule_message (rule_t *self, int result, double value, const char *iname, const char *ename)
+{
+    if (!self || !iname) return NULL;
+    const char *levels [] = { "low_critical", "low_warning", "ok", "high_warning", "high_critical" };
+    return s_native_message (self, result >= -2 && result <= 2 ? levels [result + 2] : "", value, iname, ename);
+}
+
+//  --------------------------------------------------------------------------
+//  Is rule native threshold rule?
+
+bool
+rule_threshold (rule_t *self)
+{
+    return self && self->kind == KIND_THRESHOLD;
+}
+
+//  --------------------------------------------------------------------------
+//  Create json from rule
+
+//  Growing string with tracked length, capacity doubles so appending costs
+//  amortized time of the appended text only
+
+typedef struct {
+    char *data;
+    size_t size;                //  Length without terminating zero
+    size_t capacity;
+} s_builder_t;
+
+static void
+s_builder_reserve (s_builder_t *self, size_t size)
+{
+    size_t required = self->size + size + 1;
+    if (required <= self->capacity) return;
+    size_t capacity = self->capacity ? self->capacity : 1024;
+    while (capacity < required) capacity *= 2;
+    self->data = (char *) realloc (self->data, capacity);
+    assert (self->data);
+    self->capacity = capacity;
+}
+
+static void
+s_builder_append_mem (s_builder_t *self, const char *data, size_t size)
+{
+    s_builder_reserve (self, size);
+    memcpy (self->data + self->size, data, size);
+    self->size += size;
+    self->data [self->size] = 0;
+}
+
+static void
+s_builder_append (s_builder_t *self, const char *string)
+{
+    s_builder_append_mem (self, string, strlen (string));
+}
+
+//  Append string encoded as json string, same as vsjson_encode_string
+
+static void
+s_builder_append_encoded (s_builder_t *self, const char *string)
+{
+    size_t length = strlen (string);
+    //  worst case every character is escaped
+    s_builder_reserve (self, 2 * length + 2);
+    char *p = self->data + self->size;
+    *p++ = '"';
+    for (; *string; string++) {
+        switch (*string) {
+            case '"':
+            case '\\':
+            case '/':
+                *p++ = '\\';
+                *p++ = *string;
+                break;
+            case '\b': *p++ = '\\'; *p++ = 'b'; break;
+            case '\f': *p++ = '\\'; *p++ = 'f'; break;
+            case '\n': *p++ = '\\'; *p++ = 'n'; break;
+            case '\r': *p++ = '\\'; *p++ = 'r'; break;
+            case '\t': *p++ = '\\'; *p++ = 't'; break;
+            default:
+                *p++ = *string;
+        }
+    }
+    *p++ = '"';
+    *p = 0;
+    self->size = p - self->data;
+}
+
+static void
+s_builder_append_list (s_builder_t *self, zlist_t *list)
+{
+    s_builder_append (self, "[");
+    char *item = list ? (char *) zlist_first (list) : NULL;
+    bool first = true;
+    while (item) {
+        if (!first) s_builder_append (self, ", ");
+        first = false;
+        s_builder_append_encoded (self, item);
+        item = (char *) zlist_next (list);
+    }
+    s_builder_append (self, "]");
+}
+
+//  Actions are stored as "action1/action2", "(null)" is no action
+
+static void
+s_builder_append_actions (s_builder_t *self, const char *actions)
+{
+    s_builder_append (self, "[");
+    bool first = true;
+    const char *start = actions;
+    while (start) {
+        const char *end = strchr (start, '/');
+        size_t size = end ? (size_t) (end - start) : strlen (start);
+        if (!(size == 6 && strncmp (start, "(null)", 6) == 0)) {
+            if (!first) s_builder_append (self, ", ");
+            first = false;
+            char *action = (char *) zmalloc (size + 1);
+            memcpy (action, start, size);
+            s_builder_append_encoded (self, action);
+            free (action);
+        }
+        start = end ? end + 1 : NULL;
+    }
+    s_builder_append (self, "]");
+}
+
+//  --------------------------------------------------------------------------
+//  Serialize rule into builder
+
+static void
+s_rule_build_json (rule_t *self, s_builder_t *json)
+{
+    s_builder_append (json, "{\n\"name\":");
+    s_builder_append_encoded (json, self->name ? self->name : "");
+    s_builder_append (json, ",\n\"description\":");
+    s_builder_append_encoded (json, self->description ? self->description : "");
+    s_builder_append (json, ",\n\"metrics\":");
+    s_builder_append_list (json, self->metrics);
+    s_builder_append (json, ",\n\"assets\":");
+    s_builder_append_list (json, self->assets);
+    s_builder_append (json, ",\n\"models\":");
+    s_builder_append_list (json, self->models);
+    s_builder_append (json, ",\n\"groups\":");
+    s_builder_append_list (json, self->groups);
+    s_builder_append (json, ",\n");
+    {
+        //results
+        s_builder_append (json, "\"results\": {\n");
+        const char *actions = (const char *) zhash_first (self->result_actions);
+        bool first = true;
+        while (actions) {
+            const char *name = zhash_cursor (self->result_actions);
+            if (!first) s_builder_append (json, ",\n");
+            first = false;
+            s_builder_append_encoded (json, name);
+            s_builder_append (json, ": {\"action\":");
+            s_builder_append_actions (json, actions);
+            const char *description = (const char *) zhashx_lookup (self->descriptions, name);
+            if (description) {
+                s_builder_append (json, ", \"description\":");
+                s_builder_append_encoded (json, description);
+            }
+            s_builder_append (json, "}");
+            actions = (const char *) zhash_next (self->result_actions);
+        }
+        //  results with description only
+        const char *description = (const char *) zhashx_first (self->descriptions);
+        while (description) {
+            const char *name = (const char *) zhashx_cursor (self->descriptions);
+            if (!zhash_lookup (self->result_actions, name)) {
+                if (!first) s_builder_append (json, ",\n");
+                first = false;
+                s_builder_append_encoded (json, name);
+                s_builder_append (json, ": {\"description\":");
+                s_builder_append_encoded (json, description);
+                s_builder_append (json, "}");
+            }
+            description = (const char *) zhashx_next (self->descriptions);
+        }
+        s_builder_append (json, "},\n");
+    }
+    if (zhashx_size (self->variables)) {
+        s_builder_append (json, "\"variables\": {\n");
+        const char *value = (const char *) zhashx_first (self->variables);
+        bool first = true;
+        while (value) {
+            if (!first) s_builder_append (json, ",\n");
+            first = false;
+            s_builder_append_encoded (json, (const char *) zhashx_cursor (self->variables));
+            s_builder_append (json, ":");
+            s_builder_append_encoded (json, value);
+            value = (const char *) zhashx_next (self->variables);
+        }
+        s_builder_append (json, "},\n");
+    }
+    if (self->memoize)
+        s_builder_append (json, "\"memoize\": true,\n");
+    if (self->coalesce) {
+        char coalesce [32];
+        snprintf (coalesce, sizeof (coalesce), "\"coalesce\": %d,\n", self->coalesce);
+        s_builder_append (json, coalesce);
+    }
+    if (self->kind == KIND_THRESHOLD)
+        s_builder_append (json, "\"kind\": \"threshold\",\n");
+    if (self->expression_source) {
+        s_builder_append (json, "\"expression\": ");
+        s_builder_append_encoded (json, self->expression_source);
+        s_builder_append (json, ",\n");
+    }
+    s_builder_append (json, "\"evaluation\":");
+    s_builder_append_encoded (json, self->evaluation ? self->evaluation : "");
+    s_builder_append (json, "\n}\n");
+}
+
+//  --------------------------------------------------------------------------
+//  Return json of rule, serialized once and cached until the rule changes.
+//  Size is set to its length if not NULL.
+
+const char *
+rule_json_cached (rule_t *self, size_t *size)
+{
+    if (!self) return NULL;
+    if (!self->json) {
+        s_builder_t json = { NULL, 0, 0 };
+        s_rule_build_json (self, &json);
+        self->json = json.data;
+        self->json_size = json.size;
+    }
+    if (size) *size = self->json_size;
+    return self->json;
+}
+
+//  --------------------------------------------------------------------------
+//  Convert rule back to json
+//  Caller is responsible for destroying the return value
+
+char *
+rule_json (rule_t *self)
+{
+    size_t size;
+    const char *json = rule_json_cached (self, &size);
+    if (!json) return NULL;
+    char *copy = (char *) malloc (size + 1);
+    assert (copy);
+    memcpy (copy, json, size + 1);
+    return copy;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the rule
+
+void
+rule_destroy (rule_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        rule_t *self = *self_p;
+        //  Free class properties here
+        zstr_free (&self->name);
+        zstr_free (&self->description);
+        zstr_free (&self->evaluation);
+        zstr_free (&self->json);
+        s_rule_release (self);
+        zlist_destroy (&self->metrics);
+        free (self->metric_ids);
+        zlist_destroy (&self->assets);
+        zlist_destroy (&self->groups);
         zlist_destroy (&self->models);
         zlist_destroy (&self->types);
         zhash_destroy (&self->result_actions);
         zhashx_destroy (&self->variables);
+        zhashx_destroy (&self->descriptions);
+        zstr_free (&self->expression_source);
+        expression_destroy (&self->expression);
         //  Free object itself
         free (self);
         *self_p = NULL;
@@ -729,10 +1536,222 @@ rule_destroy (rule_t **self_p)
 //  --------------------------------------------------------------------------
 //  Self test of this class
 
+//  Resident set size of process in kB, 0 if unknown
+
+static size_t
+s_rss_kb (void)
+{
+    size_t pages = 0, resident = 0;
+    FILE *file = fopen ("/proc/self/statm", "r");
+    if (file) {
+        if (fscanf (file, "%zu %zu", &pages, &resident) != 2)
+            resident = 0;
+        fclose (file);
+    }
+    return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+//  Load count copies of rule file and compile them lazily, eagerly from
+//  source or eagerly from bytecode cache, report start and first evaluation
+//  times
+
+static void
+s_startup_report (const char *rule_file, const char *cachedir, size_t count)
+{
+    const char *modes [] = { "lazy", "source", "cache" };
+    rule_param_t param;
+    rule_param_set (&param, "50");
+    for (int mode = 0; mode < 3; mode++) {
+        rule_t **rules = (rule_t **) zmalloc (count * sizeof (rule_t *));
+        int64_t start = zclock_usecs ();
+        for (size_t i = 0; i != count; i++) {
+            rules [i] = rule_new ();
+            rule_load (rules [i], rule_file);
+            if (mode)
+                rule_compile (rules [i], mode == 2 ? cachedir : NULL);
+        }
+        int64_t loaded = zclock_usecs ();
+        int result;
+        char *message;
+        rule_evaluate (rules [0], &param, 1, "rack", NULL, &result, &message);
+        int64_t first = zclock_usecs ();
+        assert (result == 1);
+        zstr_free (&message);
+        printf ("\n        %zu rules, %s: start %.1f ms, first evaluation %.3f ms",
+                count, modes [mode], (loaded - start) / 1000.0, (first - loaded) / 1000.0);
+        for (size_t i = 0; i != count; i++)
+            rule_destroy (&rules [i]);
+        free (rules);
+    }
+}
+
+//  Compile count copies of rule file either in private states or in one
+//  shared state and report memory used
+
+static void
+s_memory_report (const char *rule_file, size_t count, bool shared)
+{
+    lua_State *lua = NULL;
+    if (shared) {
+        lua = luaL_newstate ();
+        luaL_openlibs (lua);
+    }
+    size_t rss = s_rss_kb ();
+    rule_t **rules = (rule_t **) zmalloc (count * sizeof (rule_t *));
+    rule_param_t param;
+    rule_param_set (&param, "50");
+    for (size_t i = 0; i != count; i++) {
+        rules [i] = rule_new ();
+        rule_load (rules [i], rule_file);
+        rule_set_lua (rules [i], lua);
+        int result;
+        char *message;
+        rule_evaluate (rules [i], &param, 1, "rack", NULL, &result, &message);
+        assert (result == 1);
+        zstr_free (&message);
+    }
+    size_t heap = 0;
+    if (shared)
+        heap = lua_gc (lua, LUA_GCCOUNT, 0);
+    else
+        for (size_t i = 0; i != count; i++)
+            heap += lua_gc (rules [i]->lua, LUA_GCCOUNT, 0);
+    size_t delta = s_rss_kb () - rss;
+    printf ("\n        %zu rules, %s state: lua heap %zu kB, rss +%zu kB (%.1f kB/rule)",
+            count, shared ? "shared" : "private", heap, delta, (double) delta / count);
+    for (size_t i = 0; i != count; i++)
+        rule_destroy (&rules [i]);
+    free (rules);
+    if (lua)
+        lua_close (lua);
+}
+
+//  Collect locators and values of json into one string
+
+static int
+s_vsjson_test_collect (const char *locator, vsjson_view_t value, void *data)
+{
+    char **collected = (char **) data;
+    char *item = zsys_sprintf ("%s%s=%.*s;", *collected, locator,
+                               (int) value.size, value.data ? value.data : "");
+    zstr_free (collected);
+    *collected = item;
+    return 0;
+}
+
+static int
+s_vsjson_test_count (const char *locator, vsjson_view_t value, void *data)
+{
+    (*(size_t *) data)++;
+    return 0;
+}
+
+static int
+s_vsjson_test_count_classic (const char *locator, const char *value, void *data)
+{
+    (*(size_t *) data)++;
+    return 0;
+}
+
 void
 vsjson_test (bool verbose)
 {
-    printf (" * vsjson: skip\n");
+    printf (" * vsjson: ");
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+
+    //  locators and views of values
+    const char *json = "{\"a\":[1,{},[]],\"b\\\"c\":{\"d\":\"x\\ny\"},\"e\":true}";
+    char *collected = strdup ("");
+    assert (vsjson_parse_views (json, strlen (json), s_vsjson_test_collect, &collected, true) == 0);
+    assert (streq (collected, "a/0=1;a/1=;a/2=;b\"c/d=\"x\\ny\";e=true;"));
+    zstr_free (&collected);
+
+    //  input is bounded by size, it does not need to be terminated
+    collected = strdup ("");
+    assert (vsjson_parse_views ("[12]garbage", 4, s_vsjson_test_collect, &collected, true) == 0);
+    assert (streq (collected, "0=12;"));
+    zstr_free (&collected);
+
+    //  invalid json
+    const char *invalid [] = { "{\"a\":1}x", "[1 2]", "{\"a\" 1}", "{\"a\":}", "[1,", "\"abc", NULL };
+    size_t count = 0;
+    for (int i = 0; invalid [i]; i++)
+        assert (vsjson_parse_views (invalid [i], strlen (invalid [i]), s_vsjson_test_count, &count, true) != 0);
+    assert (vsjson_parse_views ("{\"a\":tru}", 9, s_vsjson_test_count, &count, true) == -3);
+
+    //  deep locators do not fit the stack buffer
+    char *deep = (char *) zmalloc (VSJSON_LOCATOR_STACK * 8 + 16);
+    for (int i = 0; i < VSJSON_LOCATOR_STACK; i++)
+        strcat (deep, "{\"key\":");
+    strcat (deep, "1");
+    for (int i = 0; i < VSJSON_LOCATOR_STACK; i++)
+        strcat (deep, "}");
+    count = 0;
+    assert (vsjson_parse (deep, s_vsjson_test_count_classic, &count, true) == 0);
+    assert (count == 1);
+    zstr_free (&deep);
+
+    //  decoding of string views
+    vsjson_view_t view = { "\"a\\tb\" tail", 6 };
+    char *decoded = vsjson_decode_view (view);
+    assert (streq (decoded, "a\tb"));
+    zstr_free (&decoded);
+    view.size = 3;
+    assert (vsjson_decode_view (view) == NULL);
+    decoded = vsjson_decode_string ("\"a\\\"b\\n\"");
+    assert (streq (decoded, "a\"b\n"));
+    zstr_free (&decoded);
+    assert (vsjson_decode_string ("\"") == NULL);
+    assert (vsjson_decode_string ("a") == NULL);
+
+    if (verbose) {
+        //  parse rules of selftest scaled to 10k files
+        char *dirname = zsys_sprintf ("%s/rules", SELFTEST_DIR_RO);
+        zlist_t *files = zlist_new ();
+        zlist_autofree (files);
+        DIR *dir = opendir (dirname);
+        assert (dir);
+        struct dirent *entry;
+        while ((entry = readdir (dir)) != NULL) {
+            size_t l = strlen (entry->d_name);
+            if (l > 5 && streq (entry->d_name + l - 5, ".rule")) {
+                char *path = zsys_sprintf ("%s/%s", dirname, entry->d_name);
+                zchunk_t *chunk = zchunk_slurp (path, 0);
+                assert (chunk);
+                zlist_append (files, zsys_sprintf ("%.*s", (int) zchunk_size (chunk), (char *) zchunk_data (chunk)));
+                zchunk_destroy (&chunk);
+                zstr_free (&path);
+            }
+        }
+        closedir (dir);
+        zstr_free (&dirname);
+
+        const int total = 10000;
+        double msecs [3];
+        for (int mode = 0; mode < 3; mode++) {
+            int64_t start = zclock_usecs ();
+            const char *text = (const char *) zlist_first (files);
+            for (int i = 0; i < total; i++) {
+                if (!text) text = (const char *) zlist_first (files);
+                if (mode == 0)
+                    vsjson_parse_views (text, strlen (text), s_vsjson_test_count, &count, true);
+                else
+                if (mode == 1)
+                    vsjson_parse (text, s_vsjson_test_count_classic, &count, true);
+                else {
+                    rule_t *rule = rule_new ();
+                    rule_parse (rule, text);
+                    rule_destroy (&rule);
+                }
+                text = (const char *) zlist_next (files);
+            }
+            msecs [mode] = (zclock_usecs () - start) / 1000.0;
+        }
+        printf ("\n    %d rules: views %.1f ms, callback %.1f ms, rule_parse %.1f ms ... ",
+                total, msecs [0], msecs [1], msecs [2]);
+        zlist_destroy (&files);
+    }
+    printf ("OK\n");
 }
 
 void
@@ -837,6 +1856,539 @@ rule_test (bool verbose)
         rule_destroy (&self);
         printf ("      OK\n");
     }
+
+    //  Intern test
+    {
+        printf ("      Intern test ... ");
+        rule_t *self = rule_new ();
+        assert (self);
+        rule_file = zsys_sprintf ("%s/rules/%s", SELFTEST_DIR_RO, "sts-voltage.rule");
+        assert (rule_file);
+        rule_load (self, rule_file);
+        zstr_free (&rule_file);
+
+        atoms_t *atoms = atoms_new ();
+        uint32_t input2 = atoms_intern (atoms, "status.input.2.voltage");
+        rule_intern (self, atoms);
+        size_t size;
+        const uint32_t *ids = rule_metric_ids (self, &size);
+        assert (size == 2);
+        assert (streq (atoms_name (atoms, ids [0]), "status.input.1.voltage"));
+        assert (ids [1] == input2);
+        assert (rule_metric_id_exists (self, input2));
+        assert (!rule_metric_id_exists (self, atoms_intern (atoms, "load.default")));
+        atoms_destroy (&atoms);
+        rule_destroy (&self);
+        printf ("      OK\n");
+    }
+    //  Param test
+    {
+        printf ("      Param test ... ");
+        rule_param_t param;
+        rule_param_set (&param, "42");
+        assert (param.text == NULL && param.number == 42);
+        rule_param_set (&param, "-0.125");
+        assert (param.text == NULL && param.number == -0.125);
+        rule_param_set (&param, "229.7");
+        assert (param.text == NULL && param.number == 229.7);
+        rule_param_set (&param, "1.5e3");
+        assert (param.text == NULL && param.number == 1500);
+        rule_param_set (&param, " 12 ");
+        assert (param.text == NULL && param.number == 12);
+        rule_param_set (&param, "12345678901234567890");
+        assert (param.text == NULL && param.number == 12345678901234567890.0);
+        rule_param_set (&param, "good");
+        assert (param.text && streq (param.text, "good"));
+        rule_param_set (&param, "12abc");
+        assert (param.text && streq (param.text, "12abc"));
+        rule_param_set (&param, "");
+        assert (param.text && streq (param.text, ""));
+        rule_param_set (&param, "-");
+        assert (param.text && streq (param.text, "-"));
+
+        //  values are compared as numbers, not as strings
+        rule_t *self = rule_new ();
+        rule_file = zsys_sprintf ("%s/rules/%s", SELFTEST_DIR_RO, "threshold.rule");
+        rule_load (self, rule_file);
+        zstr_free (&rule_file);
+        int result;
+        char *message;
+        rule_param_set (&param, "8");
+        rule_evaluate (self, &param, 1, "rack", NULL, &result, &message);
+        assert (result == -1);
+        assert (streq (message, "Humidity in rack is low (8%)"));
+        zstr_free (&message);
+        rule_param_set (&param, "40.5");
+        rule_evaluate (self, &param, 1, "rack", NULL, &result, &message);
+        assert (result == 1);
+        assert (streq (message, "Humidity in rack is high (40.5%)"));
+        zstr_free (&message);
+        rule_destroy (&self);
+
+        //  variables stay strings
+        self = rule_new ();
+        assert (rule_parse (self,
+            "{\"name\":\"limit\",\"metrics\":[\"load\"],\"variables\":{\"limit\":\"60\"},"
+            "\"evaluation\":\"function main (load) return load > tonumber (limit)"
+            " and HIGH_WARNING or OK, type (limit) end\"}") == 0);
+        rule_param_set (&param, "8");
+        rule_evaluate (self, &param, 1, "rack", NULL, &result, &message);
+        assert (result == 0);
+        assert (streq (message, "string"));
+        zstr_free (&message);
+        rule_destroy (&self);
+#if LUA_VERSION_NUM > 501
+        //  and compare with metric values as numbers
+        self = rule_new ();
+        assert (rule_parse (self,
+            "{\"name\":\"limit\",\"metrics\":[\"load\"],\"variables\":{\"limit\":\"60\"},"
+            "\"evaluation\":\"function main (load) if load > limit then"
+            " return HIGH_WARNING, 'high' end return OK, 'fine' end\"}") == 0);
+        rule_evaluate (self, &param, 1, "rack", NULL, &result, &message);
+        assert (result == 0);
+        zstr_free (&message);
+        rule_param_set (&param, "100");
+        rule_evaluate (self, &param, 1, "rack", NULL, &result, &message);
+        assert (result == 1);
+        zstr_free (&message);
+        rule_destroy (&self);
+#endif
+        printf ("      OK\n");
+    }
+
+    //  Shared lua state test
+    {
+        printf ("      Shared lua state test ... ");
+        lua_State *lua = luaL_newstate ();
+        luaL_openlibs (lua);
+        rule_t *self = rule_new ();
+        rule_file = zsys_sprintf ("%s/rules/%s", SELFTEST_DIR_RO, "threshold.rule");
+        rule_load (self, rule_file);
+        rule_set_lua (self, lua);
+        rule_t *other = rule_new ();
+        rule_parse (other,
+            "{\"name\":\"other\",\"metrics\":[\"humidity\"],\"evaluation\":"
+            "\"high_warning = '99' function main (humidity) "
+            "return OK, (high_critical == nil) and NAME or 'leaked' end\"}");
+        rule_set_lua (other, lua);
+
+        rule_param_t param;
+        rule_param_set (&param, "50");
+        int result;
+        char *message;
+        rule_evaluate (self, &param, 1, "rack", "Rack 1", &result, &message);
+        assert (result == 1);
+        assert (streq (message, "Humidity in Rack 1 is high (50%)"));
+        zstr_free (&message);
+        rule_evaluate (other, &param, 1, "rack", NULL, &result, &message);
+        assert (result == 0);
+        assert (streq (message, "rack"));
+        zstr_free (&message);
+        //  other rule's globals did not leak into this one
+        rule_evaluate (self, &param, 1, "rack", NULL, &result, &message);
+        assert (result == 1);
+        zstr_free (&message);
+        //  back to private state
+        rule_set_lua (other, NULL);
+        rule_evaluate (other, &param, 1, "rack", NULL, &result, &message);
+        assert (result == 0);
+        zstr_free (&message);
+
+        rule_destroy (&other);
+        rule_destroy (&self);
+        lua_close (lua);
+        if (verbose) {
+            s_memory_report (rule_file, 5000, true);
+            s_memory_report (rule_file, 5000, false);
+            printf ("\n");
+        }
+        zstr_free (&rule_file);
+        printf ("      OK\n");
+    }
+    //  Bytecode cache test
+    {
+        printf ("      Bytecode cache test ... ");
+        char *cachedir = zsys_sprintf ("%s/luacache", SELFTEST_DIR_RW);
+        zsys_dir_create (cachedir);
+        rule_file = zsys_sprintf ("%s/rules/%s", SELFTEST_DIR_RO, "threshold.rule");
+        rule_param_t param;
+        rule_param_set (&param, "50");
+        int result;
+        char *message;
+
+        rule_t *self = rule_new ();
+        rule_load (self, rule_file);
+        char *path = s_cache_path (cachedir, self->evaluation);
+        zsys_file_delete (path);
+        assert (rule_compile (self, cachedir));
+        assert (zsys_file_exists (path));
+        rule_destroy (&self);
+
+        //  loaded from cache
+        self = rule_new ();
+        rule_load (self, rule_file);
+        assert (rule_compile (self, cachedir));
+        rule_evaluate (self, &param, 1, "rack", NULL, &result, &message);
+        assert (result == 1);
+        assert (streq (message, "Humidity in rack is high (50%)"));
+        zstr_free (&message);
+        rule_destroy (&self);
+
+        //  broken cache falls back to the source
+        FILE *file = fopen (path, "w");
+        assert (file);
+        fputs ("function main () return OK, 'planted' end", file);
+        fclose (file);
+        self = rule_new ();
+        rule_load (self, rule_file);
+        assert (rule_compile (self, cachedir));
+        rule_evaluate (self, &param, 1, "rack", NULL, &result, &message);
+        assert (result == 1);
+        zstr_free (&message);
+        rule_destroy (&self);
+
+        if (verbose) {
+            s_startup_report (rule_file, cachedir, 5000);
+            printf ("\n");
+        }
+        zsys_file_delete (path);
+        zsys_dir_delete (cachedir);
+        zstr_free (&path);
+        zstr_free (&cachedir);
+        zstr_free (&rule_file);
+        printf ("      OK\n");
+    }
+    //  Native threshold test
+    {
+        printf ("      Native threshold test ... ");
+        const char *native_json =
+            "{\"name\":\"humidity\",\"kind\":\"threshold\",\"metrics\":[\"humidity\"],"
+            "\"results\":{"
+            "\"low_critical\":{\"action\":[\"EMAIL\",\"SMS\"],\"description\":\"Humidity in $NAME is critically low ($VALUE%)\"},"
+            "\"low_warning\":{\"action\":[\"EMAIL\"],\"description\":\"Humidity in $NAME is low ($VALUE%)\"},"
+            "\"high_critical\":{\"action\":[\"EMAIL\",\"SMS\"],\"description\":\"Humidity in $NAME is critically high ($VALUE%)\"},"
+            "\"high_warning\":{\"action\":[\"EMAIL\"],\"description\":\"Humidity in $NAME is high ($VALUE%)\"},"
+            "\"ok\":{\"description\":\"Humidity is within normal limits.\"}},"
+            "\"variables\":{\"low_critical\":\"5\",\"low_warning\":\"15\",\"high_warning\":\"40\",\"high_critical\":\"60\"}}";
+        rule_t *native = rule_new ();
+        assert (rule_parse (native, native_json) == 0);
+        //  description and action without result name are ignored
+        rule_t *unnamed = rule_new ();
+        assert (rule_parse (unnamed,
+            "{\"name\":\"unnamed\",\"kind\":\"threshold\",\"metrics\":[\"humidity\"],"
+            "\"results\":{\"description\":\"none\",\"action\":[\"EMAIL\"]}}") == 0);
+        rule_destroy (&unnamed);
+        rule_t *lua = rule_new ();
+        rule_file = zsys_sprintf ("%s/rules/%s", SELFTEST_DIR_RO, "threshold.rule");
+        rule_load (lua, rule_file);
+        zstr_free (&rule_file);
+
+        //  native evaluation gives the same results as lua one
+        const char *values [] = { "2", "5", "8", "15", "20", "40", "40.5", "60", "75", NULL };
+        for (int i = 0; values [i]; i++) {
+            rule_param_t param;
+            rule_param_set (&param, values [i]);
+            int native_result, lua_result;
+            char *native_message, *lua_message;
+            rule_evaluate (native, &param, 1, "rack", NULL, &native_result, &native_message);
+            rule_evaluate (lua, &param, 1, "rack", NULL, &lua_result, &lua_message);
+            assert (native_result == lua_result);
+            assert (streq (native_message, lua_message));
+            zstr_free (&native_message);
+            zstr_free (&lua_message);
+        }
+        //  text value is an error
+        {
+            rule_param_t param;
+            rule_param_set (&param, "dry");
+            int result;
+            char *message;
+            rule_evaluate (native, &param, 1, "rack", NULL, &result, &message);
+            assert (result == RULE_ERROR);
+            assert (message == NULL);
+        }
+
+        //  json round trip keeps kind and descriptions
+        char *json = rule_json (native);
+        rule_t *copy = rule_new ();
+        assert (rule_parse (copy, json) == 0);
+        char *json2 = rule_json (copy);
+        assert (streq (json, json2));
+        zstr_free (&json);
+        zstr_free (&json2);
+        rule_destroy (&copy);
+
+        //  invalid native rules are refused
+        rule_t *invalid = rule_new ();
+        assert (rule_parse (invalid, "{\"name\":\"x\",\"kind\":\"magic\",\"metrics\":[\"a\"]}") != 0);
+        rule_destroy (&invalid);
+        invalid = rule_new ();
+        assert (rule_parse (invalid, "{\"name\":\"x\",\"kind\":\"threshold\",\"metrics\":[\"a\",\"b\"]}") != 0);
+        rule_destroy (&invalid);
+        invalid = rule_new ();
+        assert (rule_parse (invalid, "{\"name\":\"x\",\"kind\":\"threshold\",\"metrics\":[\"a\"],"
+                                     "\"variables\":{\"high_warning\":\"warm\"}}") != 0);
+        rule_destroy (&invalid);
+
+        if (verbose) {
+            //  evaluations per second, native vs lua
+            const int count = 100000;
+            rule_t *rules [] = { native, lua };
+            double nsecs [2];
+            for (int r = 0; r < 2; r++) {
+                rule_param_t param;
+                int64_t start = zclock_usecs ();
+                for (int i = 0; i < count; i++) {
+                    char value [16];
+                    snprintf (value, sizeof (value), "%d", i % 80);
+                    rule_param_set (&param, value);
+                    int result;
+                    char *message;
+                    rule_evaluate (rules [r], &param, 1, "rack", NULL, &result, &message);
+                    zstr_free (&message);
+                }
+                nsecs [r] = (zclock_usecs () - start) * 1000.0 / count;
+            }
+            printf ("\n        native %.0f ns, lua %.0f ns per evaluation (%.1fx)",
+                    nsecs [0], nsecs [1], nsecs [1] / nsecs [0]);
+        }
+        rule_destroy (&lua);
+        rule_destroy (&native);
+        printf ("      OK\n");
+    }
+    //  Json cache test
+    {
+        printf ("      Json cache test ... ");
+        rule_t *self = rule_new ();
+        rule_file = zsys_sprintf ("%s/rules/%s", SELFTEST_DIR_RO, "threshold.rule");
+        rule_load (self, rule_file);
+        zstr_free (&rule_file);
+        size_t size;
+        const char *json = rule_json_cached (self, &size);
+        assert (json && strlen (json) == size);
+        assert (rule_json_cached (self, NULL) == json);
+        char *copy = rule_json (self);
+        assert (streq (copy, json));
+        zstr_free (&copy);
+
+        //  change of rule drops the cache
+        rule_add_result_action (self, "ok", "LOG");
+        json = rule_json_cached (self, &size);
+        assert (strlen (json) == size);
+        assert (strstr (json, "\"ok\": {\"action\":[\"LOG\"]}"));
+
+        //  escaping and actions without name
+        rule_t *other = rule_new ();
+        assert (rule_parse (other,
+            "{\"name\":\"a/\\\"b\\\"\",\"description\":\"tab\\there\","
+            "\"results\":{\"high_warning\":{\"action\":[\"EMAIL\",null]}}}") == 0);
+        json = rule_json_cached (other, NULL);
+        assert (strstr (json, "\"name\":\"a\\/\\\"b\\\"\""));
+        assert (strstr (json, "\"description\":\"tab\\there\""));
+        assert (strstr (json, "{\"action\":[\"EMAIL\"]}"));
+        rule_t *copy_rule = rule_new ();
+        assert (rule_parse (copy_rule, json) == 0);
+        assert (streq (rule_name (copy_rule), "a/\"b\""));
+        rule_destroy (&copy_rule);
+        rule_destroy (&other);
+        rule_destroy (&self);
+        printf ("      OK\n");
+    }
+
+    //  Large rule load test
+    {
+        printf ("      Large rule load test ... ");
+        zsys_dir_create (SELFTEST_DIR_RW);
+        rule_file = zsys_sprintf ("%s/large.rule", SELFTEST_DIR_RW);
+        FILE *file = fopen (rule_file, "w");
+        assert (file);
+        fputs ("{\"name\":\"large\",\"metrics\":[\"load.default\"],\"assets\":[", file);
+        const int count = 50000;
+        for (int i = 0; i < count; i++)
+            fprintf (file, "%s\"ups-%i\"", i ? "," : "", i);
+        fputs ("],\"evaluation\":\"function main (load) return OK, 'fine' end\"}", file);
+        fclose (file);
+
+        rule_t *self = rule_new ();
+        assert (rule_load (self, rule_file) == 0);
+        assert (streq (rule_name (self), "large"));
+        assert (rule_asset_exists (self, "ups-0"));
+        char *last = zsys_sprintf ("ups-%i", count - 1);
+        assert (rule_asset_exists (self, last));
+        zstr_free (&last);
+        if (verbose) {
+            int64_t start = zclock_usecs ();
+            size_t size;
+            rule_json_cached (self, &size);
+            int64_t built = zclock_usecs ();
+            rule_json_cached (self, &size);
+            printf ("\n        json of %zu bytes built in %.1f ms, cached in %.3f ms",
+                    size, (built - start) / 1000.0, (zclock_usecs () - built) / 1000.0);
+        }
+        rule_destroy (&self);
+        zsys_file_delete (rule_file);
+        zstr_free (&rule_file);
+
+        //  empty and missing files
+        rule_file = zsys_sprintf ("%s/empty.rule", SELFTEST_DIR_RW);
+        file = fopen (rule_file, "w");
+        assert (file);
+        fclose (file);
+        self = rule_new ();
+        assert (rule_load (self, rule_file) != 0);
+        rule_destroy (&self);
+        zsys_file_delete (rule_file);
+        self = rule_new ();
+        assert (rule_load (self, rule_file) != 0);
+        rule_destroy (&self);
+        zstr_free (&rule_file);
+        printf ("      OK\n");
+    }
+
+    //  Batch test
+    {
+        printf ("      Batch test ... ");
+        rule_t *self = rule_new ();
+        int rv = rule_parse (self,
+            "{\"name\":\"load\",\"kind\":\"threshold\",\"metrics\":[\"load.default\"],"
+            "\"variables\":{\"low_warning\":\"10\",\"high_warning\":\"60\",\"high_critical\":\"90\"}}");
+        assert (rv == 0);
+        assert (rule_threshold (self));
+
+        //  odd count exercises both vector and scalar paths
+        const size_t count = 1003;
+        double *values = (double *) zmalloc (count * sizeof (double));
+        int *results = (int *) zmalloc (count * sizeof (int));
+        for (size_t i = 0; i < count; i++)
+            values [i] = (double) (i % 101) - (i % 3 ? 0 : 0.5);
+        assert (rule_evaluate_batch (self, values, count, results) == 0);
+        for (size_t i = 0; i < count; i++) {
+            rule_param_t param = { values [i], NULL };
+            int result;
+            char *message;
+            rule_evaluate (self, &param, 1, "ups", NULL, &result, &message);
+            assert (result == results [i]);
+            char *batch_message = rule_message (self, results [i], values [i], "ups", NULL);
+            assert (streq (message, batch_message));
+            zstr_free (&message);
+            zstr_free (&batch_message);
+        }
+
+        //  lua rule can't be batched
+        rule_t *lua = rule_new ();
+        rule_file = zsys_sprintf ("%s/rules/%s", SELFTEST_DIR_RO, "threshold.rule");
+        rule_load (lua, rule_file);
+        zstr_free (&rule_file);
+        assert (!rule_threshold (lua));
+        assert (rule_evaluate_batch (lua, values, count, results) == -1);
+        rule_destroy (&lua);
+
+        if (verbose) {
+            const int rounds = 1000;
+            int64_t start = zclock_usecs ();
+            for (int r = 0; r < rounds; r++)
+                rule_evaluate_batch (self, values, count, results);
+            double batch = (zclock_usecs () - start) * 1000.0 / rounds / count;
+            start = zclock_usecs ();
+            for (int r = 0; r < rounds / 10; r++)
+                for (size_t i = 0; i < count; i++) {
+                    rule_param_t param = { values [i], NULL };
+                    char *message;
+                    rule_evaluate (self, &param, 1, "ups", NULL, &results [i], &message);
+                    zstr_free (&message);
+                }
+            double single = (zclock_usecs () - start) * 1000.0 / (rounds / 10) / count;
+            printf ("\n        batch %.2f ns, single %.1f ns per value", batch, single);
+        }
+        free (values);
+        free (results);
+        rule_destroy (&self);
+        printf ("      OK\n");
+    }
+
+    //  Expression test
+    {
+        printf ("      Expression test ... ");
+        const char *head =
+            "{\"name\":\"ups\",\"metrics\":[\"load\",\"realpower\"],"
+            "\"results\":{\"high_critical\":{\"description\":\"$NAME is critical\"},"
+            "\"high_warning\":{\"description\":\"$NAME is warning\"},"
+            "\"ok\":{\"description\":\"$NAME is ok\"}},"
+            "\"variables\":{\"high_warning\":\"60\",\"high_critical\":\"90\",\"max_power\":\"2000\"},";
+        char *json = zsys_sprintf ("%s%s", head,
+            "\"expression\":\"load > high_critical ? HIGH_CRITICAL :"
+            " load > high_warning || realpower > max_power ? HIGH_WARNING : OK\"}");
+        rule_t *compiled = rule_new ();
+        assert (rule_parse (compiled, json) == 0);
+        zstr_free (&json);
+        json = zsys_sprintf ("%s%s", head,
+            "\"evaluation\":\"function main (load, realpower)"
+            " if load > tonumber (high_critical) then return HIGH_CRITICAL, NAME .. ' is critical' end"
+            " if load > tonumber (high_warning) or realpower > tonumber (max_power) then return HIGH_WARNING, NAME .. ' is warning' end"
+            " return OK, NAME .. ' is ok' end\"}");
+        rule_t *lua = rule_new ();
+        assert (rule_parse (lua, json) == 0);
+        zstr_free (&json);
+
+        //  same results as lua
+        const char *values [][2] = {
+            { "10", "100" }, { "70", "100" }, { "95", "100" }, { "10", "2500" }, { "60", "2000" }, { NULL, NULL }
+        };
+        for (int i = 0; values [i][0]; i++) {
+            rule_param_t params [2];
+            rule_param_set (&params [0], values [i][0]);
+            rule_param_set (&params [1], values [i][1]);
+            int compiled_result, lua_result;
+            char *compiled_message, *lua_message;
+            rule_evaluate (compiled, params, 2, "ups-1", NULL, &compiled_result, &compiled_message);
+            rule_evaluate (lua, params, 2, "ups-1", NULL, &lua_result, &lua_message);
+            assert (compiled_result == lua_result);
+            assert (streq (compiled_message, lua_message));
+            zstr_free (&compiled_message);
+            zstr_free (&lua_message);
+        }
+
+        //  json round trip keeps expression
+        json = rule_json (compiled);
+        rule_t *copy = rule_new ();
+        assert (rule_parse (copy, json) == 0);
+        char *json2 = rule_json (copy);
+        assert (streq (json, json2));
+        zstr_free (&json);
+        zstr_free (&json2);
+        rule_destroy (&copy);
+
+        //  invalid expression is refused
+        rule_t *invalid = rule_new ();
+        assert (rule_parse (invalid, "{\"name\":\"x\",\"metrics\":[\"a\"],\"expression\":\"a >\"}") != 0);
+        rule_destroy (&invalid);
+
+        if (verbose) {
+            //  evaluations per second, expression vs lua
+            const int count = 100000;
+            rule_t *rules [] = { compiled, lua };
+            double nsecs [2];
+            for (int r = 0; r < 2; r++) {
+                rule_param_t params [2];
+                rule_param_set (&params [1], "1500");
+                int64_t start = zclock_usecs ();
+                for (int i = 0; i < count; i++) {
+                    params [0].number = i % 100;
+                    params [0].text = NULL;
+                    int result;
+                    char *message;
+                    rule_evaluate (rules [r], params, 2, "ups-1", NULL, &result, &message);
+                    zstr_free (&message);
+                }
+                nsecs [r] = (zclock_usecs () - start) * 1000.0 / count;
+            }
+            printf ("\n        expression %.0f ns, lua %.0f ns per evaluation (%.1fx)",
+                    nsecs [0], nsecs [1], nsecs [1] / nsecs [0]);
+        }
+        rule_destroy (&lua);
+        rule_destroy (&compiled);
+        printf ("      OK\n");
+    }
     //  @end
     printf ("OK\n");
 }
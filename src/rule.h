@@ -34,6 +34,13 @@ typedef struct _rule_t rule_t;
 #define RULE_T_DEFINED
 #endif
 
+//  Parameter of rule evaluation, metric value parsed as number or kept as
+//  text when it is not a number
+typedef struct {
+    double number;
+    const char *text;           //  NULL for numbers, not owned
+} rule_param_t;
+
 //  @interface
 //  Create a new rule
 ZM_ALERT_PRIVATE rule_t *
@@ -51,7 +58,11 @@ ZM_ALERT_PRIVATE void
 ZM_ALERT_PRIVATE void
     vsjson_test (bool verbose);
 
-//  Parse json rule from string
+//  Parse json rule from string. Rule with "kind": "threshold" is evaluated
+//  natively, without lua: its only metric is checked against variables
+//  low_critical, low_warning, high_critical and high_warning, and message is
+//  taken from "description" of the result, with $NAME, $INAME and $VALUE
+//  expanded. Returns -1 if such rule is not valid.
 ZM_ALERT_PRIVATE int
     rule_parse (rule_t *self, const char *json);
 
@@ -59,6 +70,18 @@ ZM_ALERT_PRIVATE int
 ZM_ALERT_PRIVATE const char *
     rule_name (rule_t *self);
 
+//  Can result of the last evaluation be reused while metrics do not change?
+//  Set by "memoize": true, for rules whose evaluation is a pure function of
+//  metrics and variables.
+ZM_ALERT_PRIVATE bool
+    rule_memoize (rule_t *self);
+
+//  Return coalescing window of rule in milliseconds, 0 if there is none.
+//  Set by "coalesce": ms. Rule with more metrics is evaluated once per
+//  window, or as soon as all its metrics were refreshed.
+ZM_ALERT_PRIVATE int
+    rule_coalesce (rule_t *self);
+
 //  Does rule contain this asset name?
 ZM_ALERT_PRIVATE bool
     rule_asset_exists (rule_t *self, const char *asset);
@@ -79,6 +102,20 @@ ZM_ALERT_PRIVATE const char *
 ZM_ALERT_PRIVATE const char *
     rule_metric_next (rule_t *self);
 
+//  Intern rule metrics into atoms table, so they can be accessed by
+//  rule_metric_ids.
+ZM_ALERT_PRIVATE void
+    rule_intern (rule_t *self, atoms_t *atoms);
+
+//  Return ids of rule metrics in the order of metrics in rule, size is set
+//  to the number of ids. Returns NULL if rule was not interned yet.
+ZM_ALERT_PRIVATE const uint32_t *
+    rule_metric_ids (rule_t *self, size_t *size);
+
+//  Does rule contain metric with this id?
+ZM_ALERT_PRIVATE bool
+    rule_metric_id_exists (rule_t *self, uint32_t id);
+
 //  Does rule contain this model?
 ZM_ALERT_PRIVATE bool
     rule_model_exists (rule_t *self, const char *model);
@@ -87,6 +124,38 @@ ZM_ALERT_PRIVATE bool
 ZM_ALERT_PRIVATE bool
     rule_type_exists (rule_t *self, const char *type);
 
+//  Return the first asset name of rule. If there are none, returns NULL.
+ZM_ALERT_PRIVATE const char *
+    rule_asset_first (rule_t *self);
+
+//  Return the next asset name of rule. If there are no (more), returns NULL.
+ZM_ALERT_PRIVATE const char *
+    rule_asset_next (rule_t *self);
+
+//  Return the first group of rule. If there are none, returns NULL.
+ZM_ALERT_PRIVATE const char *
+    rule_group_first (rule_t *self);
+
+//  Return the next group of rule. If there are no (more), returns NULL.
+ZM_ALERT_PRIVATE const char *
+    rule_group_next (rule_t *self);
+
+//  Return the first model of rule. If there are none, returns NULL.
+ZM_ALERT_PRIVATE const char *
+    rule_model_first (rule_t *self);
+
+//  Return the next model of rule. If there are no (more), returns NULL.
+ZM_ALERT_PRIVATE const char *
+    rule_model_next (rule_t *self);
+
+//  Return the first type of rule. If there are none, returns NULL.
+ZM_ALERT_PRIVATE const char *
+    rule_type_first (rule_t *self);
+
+//  Return the next type of rule. If there are no (more), returns NULL.
+ZM_ALERT_PRIVATE const char *
+    rule_type_next (rule_t *self);
+
 //  Get rule actions
 ZM_ALERT_PRIVATE const char *
     rule_result_actions (rule_t *self, int result);
@@ -96,7 +165,8 @@ ZM_ALERT_PRIVATE const char *
 ZM_ALERT_PRIVATE zhashx_t *
     rule_global_variables (rule_t *self);
 
-//  Load json rule from file
+//  Load json rule from file. Regular file is mapped into memory and parsed
+//  in place, other files are read whole. Returns 0 on success.
 ZM_ALERT_PRIVATE int
     rule_load (rule_t *self, const char *path);
 
@@ -109,9 +179,51 @@ ZM_ALERT_PRIVATE int
 ZM_ALERT_PRIVATE char *
     rule_json (rule_t *self);
 
-//  Evaluate rule
+//  Return json of rule without copying it. Json is serialized once and kept
+//  until the rule changes, size is set to its length if not NULL. Returned
+//  string is owned by rule.
+ZM_ALERT_PRIVATE const char *
+    rule_json_cached (rule_t *self, size_t *size);
+
+//  Use shared lua state for this rule. Rule is compiled into its own
+//  environment table, so rules sharing one state do not see each other's
+//  globals. NULL (default) means rule uses its own private lua state.
+//  Shared state is not owned by rule and must outlive it.
+ZM_ALERT_PRIVATE void
+    rule_set_lua (rule_t *self, lua_State *lua);
+
+//  Compile rule evaluation now instead of at the first evaluation. Compiled
+//  bytecode is stored to and loaded from cachedir, keyed by hash of the
+//  source; NULL means no cache. Cache directory must not be writable by
+//  untrusted users, lua loads bytecode without verification.
+//  Returns 1 on success, 0 otherwise.
+ZM_ALERT_PRIVATE int
+    rule_compile (rule_t *self, const char *cachedir);
+
+//  Set parameter from metric value. Value is parsed as number if possible,
+//  otherwise parameter refers to value as text.
 ZM_ALERT_PRIVATE void
-rule_evaluate (rule_t *self, zlist_t *params, const char *iname, const char *ename, int *result, char **message);
+    rule_param_set (rule_param_t *param, const char *value);
+
+//  Evaluate rule, parameters are passed to lua main function in order of
+//  rule metrics
+ZM_ALERT_PRIVATE void
+rule_evaluate (rule_t *self, const rule_param_t *params, size_t params_size, const char *iname, const char *ename, int *result, char **message);
+
+//  Is rule a native threshold rule (see rule_parse)?
+ZM_ALERT_PRIVATE bool
+    rule_threshold (rule_t *self);
+
+//  Evaluate threshold rule for count values of its metric at once, results
+//  are the same as rule_evaluate gives. Compares are vectorized where CPU
+//  supports it. Returns -1 if rule is not a threshold rule.
+ZM_ALERT_PRIVATE int
+    rule_evaluate_batch (rule_t *self, const double *values, size_t count, int *results);
+
+//  Return message of native rule for result and value, as rule_evaluate
+//  builds it. Caller is responsible for destroying the return value.
+ZM_ALERT_PRIVATE char *
+    rule_message (rule_t *self, int result, double value, const char *iname, const char *ename);
 
 //  @end
 
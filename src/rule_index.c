@@ -0,0 +1,291 @@
+/*  =========================================================================
+    rule_index - Index of rules by asset attributes
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    rule_index - Index of rules by asset attributes
+@discuss
+    Rule is valid for an asset when the asset name is in rule "assets", one
+    of asset groups (ext "group.*") is in rule "groups", asset "model" or
+    "device.part" is in rule "models", or asset "type" or "subtype" is in
+    rule "types". The index keeps hashes from each of these values to the
+    rules listing it, so rules for an asset are found by a few lookups
+    instead of testing every rule. Index does not own the rules, rule has
+    to be removed from the index before it is destroyed.
+@end
+*/
+
+#include "zm_alert_classes.h"
+
+//  Structure of our class
+
+struct _rule_index_t {
+    zhashx_t *assets;           //  asset name -> zlist_t of rule_t *
+    zhashx_t *groups;           //  group -> zlist_t of rule_t *
+    zhashx_t *models;           //  model or device.part -> zlist_t of rule_t *
+    zhashx_t *types;            //  type or subtype -> zlist_t of rule_t *
+};
+
+static void
+s_rules_destroy (zlist_t **rules_p)
+{
+    zlist_destroy (rules_p);
+}
+
+static zhashx_t *
+s_index_new (void)
+{
+    zhashx_t *index = zhashx_new ();
+    assert (index);
+    zhashx_set_destructor (index, (zhashx_destructor_fn *) s_rules_destroy);
+    return index;
+}
+
+static void
+s_index_add (zhashx_t *index, const char *key, rule_t *rule)
+{
+    zlist_t *rules = (zlist_t *) zhashx_lookup (index, key);
+    if (!rules) {
+        rules = zlist_new ();
+        zhashx_insert (index, key, rules);
+    }
+    if (!zlist_exists (rules, rule))
+        zlist_append (rules, rule);
+}
+
+static void
+s_index_remove (zhashx_t *index, const char *key, rule_t *rule)
+{
+    zlist_t *rules = (zlist_t *) zhashx_lookup (index, key);
+    if (!rules) return;
+    zlist_remove (rules, rule);
+    if (zlist_size (rules) == 0)
+        zhashx_delete (index, key);
+}
+
+//  Append rules indexed under key to result, skipping duplicates
+
+static void
+s_index_match (zhashx_t *index, const char *key, zlist_t *result)
+{
+    if (!key || !*key) return;
+    zlist_t *rules = (zlist_t *) zhashx_lookup (index, key);
+    if (!rules) return;
+    rule_t *rule = (rule_t *) zlist_first (rules);
+    while (rule) {
+        if (!zlist_exists (result, rule))
+            zlist_append (result, rule);
+        rule = (rule_t *) zlist_next (rules);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Create a new rule_index
+
+rule_index_t *
+rule_index_new (void)
+{
+    rule_index_t *self = (rule_index_t *) zmalloc (sizeof (rule_index_t));
+    assert (self);
+    //  Initialize class properties here
+    self->assets = s_index_new ();
+    self->groups = s_index_new ();
+    self->models = s_index_new ();
+    self->types = s_index_new ();
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destroy the rule_index
+
+void
+rule_index_destroy (rule_index_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        rule_index_t *self = *self_p;
+        //  Free class properties here
+        zhashx_destroy (&self->assets);
+        zhashx_destroy (&self->groups);
+        zhashx_destroy (&self->models);
+        zhashx_destroy (&self->types);
+        //  Free object itself
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Add rule to the index
+
+void
+rule_index_add (rule_index_t *self, rule_t *rule)
+{
+    assert (self);
+    assert (rule);
+
+    const char *key;
+    for (key = rule_asset_first (rule); key; key = rule_asset_next (rule))
+        s_index_add (self->assets, key, rule);
+    for (key = rule_group_first (rule); key; key = rule_group_next (rule))
+        s_index_add (self->groups, key, rule);
+    for (key = rule_model_first (rule); key; key = rule_model_next (rule))
+        s_index_add (self->models, key, rule);
+    for (key = rule_type_first (rule); key; key = rule_type_next (rule))
+        s_index_add (self->types, key, rule);
+}
+
+//  --------------------------------------------------------------------------
+//  Remove rule from the index
+
+void
+rule_index_remove (rule_index_t *self, rule_t *rule)
+{
+    assert (self);
+    assert (rule);
+
+    const char *key;
+    for (key = rule_asset_first (rule); key; key = rule_asset_next (rule))
+        s_index_remove (self->assets, key, rule);
+    for (key = rule_group_first (rule); key; key = rule_group_next (rule))
+        s_index_remove (self->groups, key, rule);
+    for (key = rule_model_first (rule); key; key = rule_model_next (rule))
+        s_index_remove (self->models, key, rule);
+    for (key = rule_type_first (rule); key; key = rule_type_next (rule))
+        s_index_remove (self->types, key, rule);
+}
+
+//  --------------------------------------------------------------------------
+//  Return list of rules valid for the asset message. Each rule is listed
+//  once. Caller is responsible for destroying the return value.
+
+zlist_t *
+rule_index_match (rule_index_t *self, zm_proto_t *zmmsg)
+{
+    assert (self);
+    assert (zmmsg);
+
+    zlist_t *result = zlist_new ();
+    s_index_match (self->assets, zm_proto_device (zmmsg), result);
+
+    zhash_t *ext = zm_proto_ext (zmmsg);
+    if (ext && zhashx_size (self->groups)) {
+        const char *value = (const char *) zhash_first (ext);
+        while (value) {
+            if (strncmp ("group.", zhash_cursor (ext), 6) == 0)
+                s_index_match (self->groups, value, result);
+            value = (const char *) zhash_next (ext);
+        }
+    }
+    s_index_match (self->models, zm_proto_ext_string (zmmsg, "model", NULL), result);
+    s_index_match (self->models, zm_proto_ext_string (zmmsg, "device.part", NULL), result);
+    s_index_match (self->types, zm_proto_ext_string (zmmsg, "type", NULL), result);
+    s_index_match (self->types, zm_proto_ext_string (zmmsg, "subtype", NULL), result);
+    return result;
+}
+
+//  --------------------------------------------------------------------------
+//  Return decoded device message of asset with one ext attribute, none if
+//  key is NULL. Used by selftests of classes matching assets.
+
+zm_proto_t *
+rule_index_test_asset (const char *name, const char *key, const char *value)
+{
+    zhash_t *ext = zhash_new ();
+    zhash_autofree (ext);
+    if (key) zhash_insert (ext, key, (void *) value);
+    zmsg_t *msg = zm_proto_encode_device_v1 (name, time (NULL), 3600, ext);
+    zhash_destroy (&ext);
+    zm_proto_t *zmmsg = zm_proto_decode (&msg);
+    assert (zmmsg);
+    return zmmsg;
+}
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static size_t
+s_test_match (rule_index_t *self, zm_proto_t *zmmsg, rule_t *expected)
+{
+    zlist_t *rules = rule_index_match (self, zmmsg);
+    size_t size = zlist_size (rules);
+    if (expected)
+        assert (zlist_exists (rules, expected));
+    zlist_destroy (&rules);
+    return size;
+}
+
+void
+rule_index_test (bool verbose)
+{
+    printf (" * rule_index: ");
+
+    //  @selftest
+    //  Simple create/destroy test
+    rule_index_t *self = rule_index_new ();
+    assert (self);
+    rule_index_destroy (&self);
+
+    rule_t *byname = rule_new ();
+    rule_parse (byname, "{\"name\":\"byname\",\"assets\":[\"ups-1\",\"ups-2\"],\"groups\":[\"all-upses\"]}");
+    rule_t *bygroup = rule_new ();
+    rule_parse (bygroup, "{\"name\":\"bygroup\",\"groups\":[\"all-upses\"]}");
+    rule_t *bymodel = rule_new ();
+    rule_parse (bymodel, "{\"name\":\"bymodel\",\"models\":[\"ePDU\"]}");
+    rule_t *bytype = rule_new ();
+    rule_parse (bytype, "{\"name\":\"bytype\",\"types\":[\"sts\"]}");
+
+    self = rule_index_new ();
+    rule_index_add (self, byname);
+    rule_index_add (self, bygroup);
+    rule_index_add (self, bymodel);
+    rule_index_add (self, bytype);
+
+    zm_proto_t *zmmsg = rule_index_test_asset ("ups-1", "group.1", "all-upses");
+    //  byname matches both by name and group, but is listed once
+    assert (s_test_match (self, zmmsg, byname) == 2);
+    zm_proto_destroy (&zmmsg);
+
+    zmmsg = rule_index_test_asset ("epdu-1", "device.part", "ePDU");
+    assert (s_test_match (self, zmmsg, bymodel) == 1);
+    zm_proto_destroy (&zmmsg);
+
+    zmmsg = rule_index_test_asset ("sts-1", "subtype", "sts");
+    assert (s_test_match (self, zmmsg, bytype) == 1);
+    zm_proto_destroy (&zmmsg);
+
+    zmmsg = rule_index_test_asset ("rack-1", "group.1", "all-racks");
+    assert (s_test_match (self, zmmsg, NULL) == 0);
+    zm_proto_destroy (&zmmsg);
+
+    rule_index_remove (self, byname);
+    zmmsg = rule_index_test_asset ("ups-1", "group.7", "all-upses");
+    assert (s_test_match (self, zmmsg, bygroup) == 1);
+    zm_proto_destroy (&zmmsg);
+
+    rule_index_destroy (&self);
+    rule_destroy (&byname);
+    rule_destroy (&bygroup);
+    rule_destroy (&bymodel);
+    rule_destroy (&bytype);
+    //  @end
+    printf ("OK\n");
+}
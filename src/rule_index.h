@@ -0,0 +1,72 @@
+/*  =========================================================================
+    rule_index - Index of rules by asset attributes
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#ifndef RULE_INDEX_H_INCLUDED
+#define RULE_INDEX_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Opaque class structures to allow forward references
+#ifndef RULE_INDEX_T_DEFINED
+typedef struct _rule_index_t rule_index_t;
+#define RULE_INDEX_T_DEFINED
+#endif
+
+//  @interface
+//  Create a new rule_index
+ZM_ALERT_PRIVATE rule_index_t *
+    rule_index_new (void);
+
+//  Destroy the rule_index
+ZM_ALERT_PRIVATE void
+    rule_index_destroy (rule_index_t **self_p);
+
+//  Add rule to the index
+ZM_ALERT_PRIVATE void
+    rule_index_add (rule_index_t *self, rule_t *rule);
+
+//  Remove rule from the index
+ZM_ALERT_PRIVATE void
+    rule_index_remove (rule_index_t *self, rule_t *rule);
+
+//  Return list of rules valid for the asset message. Each rule is listed
+//  once. Caller is responsible for destroying the return value.
+ZM_ALERT_PRIVATE zlist_t *
+    rule_index_match (rule_index_t *self, zm_proto_t *zmmsg);
+
+//  Return decoded device message of asset with one ext attribute, none if
+//  key is NULL. Used by selftests of classes matching assets.
+ZM_ALERT_PRIVATE zm_proto_t *
+    rule_index_test_asset (const char *name, const char *key, const char *value);
+
+//  Self test of this class
+ZM_ALERT_PRIVATE void
+    rule_index_test (bool verbose);
+
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
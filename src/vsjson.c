@@ -226,268 +226,342 @@ void vsjson_destroy (vsjson_t **self_p)
     *self_p = NULL;
 }
 
-int _vsjson_walk_array (vsjson_t *self, const char *prefix, vsjson_callback_t *func, void *data, bool callWhenEmpty);
+// zero-copy walker, tokens are views into json text, locator is built
+// in one buffer: key is appended when walker enters a value and the buffer
+// is cut back when it leaves it
+typedef struct {
+    const char *cursor;
+    const char *end;
+    vsjson_view_t token;
+    char *locator;
+    size_t locator_size;
+    size_t locator_capacity;
+    vsjson_view_callback_t *func;
+    void *data;
+    bool callWhenEmpty;
+} _vsjson_walker_t;
+
+#define _VSJSON_IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == '\f' || (c) == '\v')
+#define _VSJSON_IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define _VSJSON_IS_ALPHA(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z'))
+
+// read next token, returns 0 at the end of text or on invalid token
+static int _vsjson_next (_vsjson_walker_t *w)
+{
+    const char *p = w->cursor;
+    while (p < w->end && _VSJSON_IS_SPACE (*p)) ++p;
+    w->token.data = p;
+    w->token.size = 0;
+    if (p == w->end || *p == 0) return 0;
+
+    const char *start = p;
+    switch (*p) {
+    case '{': case '}': case '[': case ']': case ':': case ',':
+        ++p;
+        break;
+    case '"':
+        ++p;
+        while (true) {
+            if (p == w->end || *p == 0) return 0;
+            if (*p == '\\') {
+                ++p;
+                if (p == w->end || *p == 0) return 0;
+            }
+            else if (*p == '"') {
+                ++p;
+                break;
+            }
+            ++p;
+        }
+        break;
+    default:
+        if (_VSJSON_IS_DIGIT (*p) || *p == '-' || *p == '+') {
+            ++p;
+            while (p < w->end && (_VSJSON_IS_DIGIT (*p) || *p == '.' || *p == 'e' || *p == 'E' || *p == '-' || *p == '+')) ++p;
+        }
+        else if (_VSJSON_IS_ALPHA (*p)) {
+            ++p;
+            while (p < w->end && _VSJSON_IS_ALPHA (*p)) ++p;
+        }
+        else {
+            return 0;
+        }
+    }
+    w->token.data = start;
+    w->token.size = p - start;
+    w->cursor = p;
+    return 1;
+}
+
+static int _vsjson_view_is (vsjson_view_t view, const char *keyword)
+{
+    size_t len = strlen (keyword);
+    return view.size == len && memcmp (view.data, keyword, len) == 0;
+}
+
+// value token is a string, number or keyword
+static int _vsjson_value_is_valid (vsjson_view_t view)
+{
+    switch (view.data[0]) {
+    case '"':
+        return view.size >= 2 && view.data[view.size - 1] == '"';
+    case 't':
+        return _vsjson_view_is (view, "true");
+    case 'f':
+        return _vsjson_view_is (view, "false");
+    case 'n':
+        return _vsjson_view_is (view, "null");
+    }
+    return _VSJSON_IS_DIGIT (view.data[0]) || view.data[0] == '-' || view.data[0] == '+';
+}
+
+// decode string view without quotes into dst, returns decoded length
+static size_t _vsjson_decode_into (char *dst, const char *src, size_t size)
+{
+    char *d = dst;
+    const char *end = src + size;
+    while (src < end) {
+        if (*src == '\\' && src + 1 < end) {
+            ++src;
+            switch (*src) {
+            case '\\':
+            case '/':
+            case '"':
+                *d++ = *src;
+                break;
+            case 'b': *d++ = '\b'; break;
+            case 'f': *d++ = '\f'; break;
+            case 'n': *d++ = '\n'; break;
+            case 'r': *d++ = '\r'; break;
+            case 't': *d++ = '\t'; break;
+            //TODO \uXXXX
+            }
+        } else {
+            *d++ = *src;
+        }
+        ++src;
+    }
+    return d - dst;
+}
+
+// append separator and key (string token or array index) to locator
+static int _vsjson_locator_push (_vsjson_walker_t *w, const char *key, size_t size, bool decode)
+{
+    size_t required = w->locator_size + size + 2;
+    if (required > w->locator_capacity) {
+        size_t capacity = w->locator_capacity * 2;
+        while (capacity < required) capacity *= 2;
+        char *locator = (char *) malloc (capacity);
+        if (!locator) return -2;
+        memcpy (locator, w->locator, w->locator_size);
+        if (w->locator_capacity > VSJSON_LOCATOR_STACK) free (w->locator);
+        w->locator = locator;
+        w->locator_capacity = capacity;
+    }
+    char *p = w->locator + w->locator_size;
+    if (w->locator_size) *p++ = VSJSON_SEPARATOR;
+    if (decode)
+        p += _vsjson_decode_into (p, key, size);
+    else {
+        memcpy (p, key, size);
+        p += size;
+    }
+    *p = 0;
+    w->locator_size = p - w->locator;
+    return 0;
+}
+
+static void _vsjson_locator_pop (_vsjson_walker_t *w, size_t size)
+{
+    w->locator_size = size;
+    w->locator[size] = 0;
+}
+
+static int _vsjson_walk_object (_vsjson_walker_t *w);
+static int _vsjson_walk_array (_vsjson_walker_t *w);
+
+// walk value of current token
+static int _vsjson_walk_value (_vsjson_walker_t *w)
+{
+    switch (w->token.data[0]) {
+    case '{':
+        return _vsjson_walk_object (w);
+    case '[':
+        return _vsjson_walk_array (w);
+    case ':':
+    case ',':
+    case '}':
+    case ']':
+        return -1;
+    default:
+        if (!_vsjson_value_is_valid (w->token)) return -3;
+        return w->func (w->locator, w->token, w->data);
+    }
+}
 
-int _vsjson_walk_object (vsjson_t *self, const char *prefix, vsjson_callback_t *func, void *data, bool callWhenEmpty)
+static int _vsjson_walk_empty (_vsjson_walker_t *w)
+{
+    if (!w->callWhenEmpty) return 0;
+    vsjson_view_t empty = { NULL, 0 };
+    return w->func (w->locator, empty, w->data);
+}
+
+static int _vsjson_walk_object (_vsjson_walker_t *w)
 {
     int result = 0;
     int itemscount = 0;
-    char *locator = NULL;
-    char *key = NULL;
+    size_t prefix = w->locator_size;
 
-    const char *token = vsjson_next_token (self);
-    while (token) {
+    if (!_vsjson_next (w)) return -1;
+    while (true) {
         // token should be key or }
-        switch (token[0]) {
-        case '}':
-            if (itemscount == 0 && callWhenEmpty) {
-                result = func (&prefix[1], NULL, data);
-            }
-            goto cleanup;
-        case '"':
-            key = vsjson_decode_string (token);
-            ++itemscount;
-            token = vsjson_next_token (self);
-            if (strcmp (token, ":") != 0) {
-                result = -1;
-                goto cleanup;
-            }
-            token = vsjson_next_token (self);
-            if (!token) {
-                result = -1;
-                goto cleanup;
-            }
-            size_t s = strlen (prefix) + strlen (key) + 2;
-            locator = (char *)malloc (s);
-            if (!locator) {
-                result = -2;
-                goto cleanup;
-            }
-            snprintf(locator, s, "%s%c%s", prefix, VSJSON_SEPARATOR, key);
-            switch (token[0]) {
-            case '{':
-                result = _vsjson_walk_object (self, locator, func, data, callWhenEmpty);
-                if (result != 0) goto cleanup;
-                break;
-            case '[':
-                result = _vsjson_walk_array (self, locator, func, data, callWhenEmpty);
-                if (result != 0) goto cleanup;
-                break;
-            case ':':
-            case ',':
-            case '}':
-            case ']':
-                result = -1;
-                goto cleanup;
-            default:
-                // this is the value
-                if (vsjson_is_token_valid (self)) {
-                    result = func (&locator[1], token, data);
-                } else {
-                    result = -3;
-                }
-                if (result != 0) goto cleanup;
-                break;
-            }
-            free (locator);
-            locator = NULL;
-            free (key);
-            key = NULL;
-            break;
-        default:
-            // this is wrong
-            result = -1;
-            goto cleanup;
+        if (w->token.data[0] == '}') {
+            if (itemscount == 0) result = _vsjson_walk_empty (w);
+            return result;
         }
-        token = vsjson_next_token (self);
+        if (w->token.data[0] != '"' || w->token.size < 2) return -1;
+        ++itemscount;
+        vsjson_view_t key = w->token;
+        if (!_vsjson_next (w) || w->token.data[0] != ':') return -1;
+        if (!_vsjson_next (w)) return -1;
+        result = _vsjson_locator_push (w, key.data + 1, key.size - 2, true);
+        if (result != 0) return result;
+        result = _vsjson_walk_value (w);
+        if (result != 0) return result;
+        _vsjson_locator_pop (w, prefix);
+
         // now the token can be only '}' or ','
-        if (!token) {
-            result = -1;
-            goto cleanup;
-        }
-        switch (token[0]) {
+        if (!_vsjson_next (w)) return -1;
+        switch (w->token.data[0]) {
         case ',':
-            token = vsjson_next_token (self);
+            if (!_vsjson_next (w)) return -1;
             break;
         case '}':
-            break;
+            return 0;
         default:
-            result = -1;
-            goto cleanup;
+            return -1;
         }
     }
- cleanup:
-    if (locator) free (locator);
-    if (key) free (key);
-    return result;
 }
 
-int _vsjson_walk_array (vsjson_t *self, const char *prefix, vsjson_callback_t *func, void *data, bool callWhenEmpty)
+static int _vsjson_walk_array (_vsjson_walker_t *w)
 {
     int index = 0;
     int result = 0;
-    char *locator = NULL;
-
-    const char *token = vsjson_next_token (self);
-    while (token) {
-        size_t s = strlen (prefix) + 1 + sizeof (index)*3 + 1;
-        locator = (char *) malloc (s);
-        if (!locator) {
-            result = -2;
-            goto cleanup;
-        }
-        snprintf(locator, s, "%s%c%i", prefix, VSJSON_SEPARATOR, index);
+    size_t prefix = w->locator_size;
+
+    if (!_vsjson_next (w)) return -1;
+    while (true) {
         // token should be value or ]
-        switch (token[0]) {
-        case ']':
-            if (index == 0 && callWhenEmpty) {
-                result = func (&prefix[1], NULL, data);
-            }
-            goto cleanup;
-        case ':':
-        case ',':
-        case '}':
-            result = -1;
-            goto cleanup;
-        case '{':
-            result = _vsjson_walk_object (self, locator, func, data, callWhenEmpty);
-            ++index;
-            if (result != 0) goto cleanup;
-            break;
-        case '[':
-            result = _vsjson_walk_array (self, locator, func, data, callWhenEmpty);
-            ++index;
-            if (result != 0) goto cleanup;
-            break;
-        default:
-            if (vsjson_is_token_valid (self)) {
-                result = func (&locator[1], token, data);
-                ++index;
-            } else {
-                result = -3;
-            }
-            if (result != 0) goto cleanup;
-            break;
+        if (w->token.data[0] == ']') {
+            if (index == 0) result = _vsjson_walk_empty (w);
+            return result;
         }
-        free (locator);
-        locator = NULL;
+        char number [sizeof (index) * 3 + 1];
+        int size = snprintf (number, sizeof (number), "%i", index);
+        result = _vsjson_locator_push (w, number, size, false);
+        if (result != 0) return result;
+        result = _vsjson_walk_value (w);
+        if (result != 0) return result;
+        _vsjson_locator_pop (w, prefix);
+        ++index;
 
-        token = vsjson_next_token (self);
         // now the token can be only ']' or ','
-        if (!token) {
-            result = -1;
-            goto cleanup;
-        }
-        switch (token[0]) {
+        if (!_vsjson_next (w)) return -1;
+        switch (w->token.data[0]) {
         case ',':
-            token = vsjson_next_token (self);
+            if (!_vsjson_next (w)) return -1;
             break;
         case ']':
-            break;
+            return 0;
         default:
-            result = -1;
-            goto cleanup;
+            return -1;
         }
     }
- cleanup:
-    if (locator) free (locator);
-    return result;
 }
 
-int vsjson_walk_trough (vsjson_t *self, vsjson_callback_t *func, void *data, bool callWhenEmpty)
+int vsjson_parse_views (const char *json, size_t size, vsjson_view_callback_t *func, void *data, bool callWhenEmpty)
 {
-    if (!self || !func) return -1;
-
-    int result = 0;
+    if (!json || !func) return -1;
 
-    const char *token = vsjson_first_token (self);
-    if (token) {
-        switch (token[0]) {
-        case '{':
-            result = _vsjson_walk_object (self, "", func, data, callWhenEmpty);
-            break;
-        case '[':
-            result = _vsjson_walk_array (self, "", func, data, callWhenEmpty);
-            break;
-        default:
-            // this is simple json containing just string, number ...
-            if (vsjson_is_token_valid (self)) {
-                result = func ("", token, data);
-            } else {
-                result = -1;
-            }
-            break;
-        }
-    }
-    if (result == 0) {
-        token = vsjson_next_token (self);
-        if (token) result = -1;
+    char stack [VSJSON_LOCATOR_STACK];
+    _vsjson_walker_t w;
+    memset (&w, 0, sizeof (w));
+    w.cursor = json;
+    w.end = json + size;
+    w.locator = stack;
+    w.locator[0] = 0;
+    w.locator_capacity = sizeof (stack);
+    w.func = func;
+    w.data = data;
+    w.callWhenEmpty = callWhenEmpty;
+
+    int result = -1;
+    if (_vsjson_next (&w)) {
+        result = _vsjson_walk_value (&w);
+        // nothing may follow the value
+        if (result == 0 && (_vsjson_next (&w) || (w.token.data < w.end && *w.token.data)))
+            result = -1;
     }
+    if (w.locator != stack) free (w.locator);
     return result;
 }
 
-char *vsjson_decode_string (const char *string)
+// classic callback gets zero terminated copy of value, buffer is reused
+typedef struct {
+    vsjson_callback_t *func;
+    void *data;
+    char *value;
+    size_t capacity;
+} _vsjson_classic_t;
+
+static int _vsjson_classic_callback (const char *locator, vsjson_view_t value, void *data)
 {
-    if (!string) return NULL;
+    _vsjson_classic_t *classic = (_vsjson_classic_t *) data;
+    if (!value.data) return classic->func (locator, NULL, classic->data);
+    if (value.size + 1 > classic->capacity) {
+        size_t capacity = classic->capacity ? classic->capacity * 2 : 256;
+        while (capacity < value.size + 1) capacity *= 2;
+        char *buffer = (char *) realloc (classic->value, capacity);
+        if (!buffer) return -2;
+        classic->value = buffer;
+        classic->capacity = capacity;
+    }
+    memcpy (classic->value, value.data, value.size);
+    classic->value[value.size] = 0;
+    return classic->func (locator, classic->value, classic->data);
+}
 
-    char *decoded = (char *) malloc (strlen (string));
-    if (!decoded) return NULL;
+static int _vsjson_parse_classic (const char *json, size_t size, vsjson_callback_t *func, void *data, bool callWhenEmpty)
+{
+    _vsjson_classic_t classic = { func, data, NULL, 0 };
+    int result = vsjson_parse_views (json, size, _vsjson_classic_callback, &classic, callWhenEmpty);
+    free (classic.value);
+    return result;
+}
 
-    memset (decoded, 0, strlen (string));
-    const char *src = string;
-    char *dst = decoded;
+int vsjson_walk_trough (vsjson_t *self, vsjson_callback_t *func, void *data, bool callWhenEmpty)
+{
+    if (!self || !func) return -1;
+    return _vsjson_parse_classic (self->text, strlen (self->text), func, data, callWhenEmpty);
+}
 
-    if (string[0] != '"' || string[strlen (string)-1] != '"') {
-        // no quotes, this is not json string
-        free (decoded);
-        return NULL;
-    }
-    ++src;
-    while(*src) {
-        switch (*src) {
-        case '\\':
-            ++src;
-            switch (*src) {
-            case '\\':
-            case '/':
-            case '"':
-                *dst = *src;
-                ++dst;
-                break;
-            case 'b':
-                *dst = '\b';
-                ++dst;
-                break;
-            case 'f':
-                *dst = '\f';
-                ++dst;
-                break;
-            case 'n':
-                *dst = '\n';
-                ++dst;
-                break;
-            case 'r':
-                *dst = '\r';
-                ++dst;
-                break;
-            case 't':
-                *dst = '\t';
-                ++dst;
-                break;
-            //TODO \uXXXX
-            }
-            break;
-        default:
-            *dst = *src;
-            ++dst;
-        }
-        ++src;
-    }
-    --dst;
-    *dst = 0;
+char *vsjson_decode_view (vsjson_view_t view)
+{
+    if (!view.data || view.size < 2 || view.data[0] != '"' || view.data[view.size - 1] != '"') return NULL;
+    char *decoded = (char *) malloc (view.size - 1);
+    if (!decoded) return NULL;
+    decoded [_vsjson_decode_into (decoded, view.data + 1, view.size - 2)] = 0;
     return decoded;
 }
 
+char *vsjson_decode_string (const char *string)
+{
+    if (!string) return NULL;
+    vsjson_view_t view = { string, strlen (string) };
+    return vsjson_decode_view (view);
+}
+
 
 char *vsjson_encode_string (const char *string)
 {
@@ -555,8 +629,5 @@ char *vsjson_encode_string (const char *string)
 int vsjson_parse (const char *json, vsjson_callback_t *func, void *data, bool callWhenEmpty)
 {
     if (!json || !func) return -1;
-    vsjson_t *v = vsjson_new (json);
-    int r = vsjson_walk_trough (v, func, data, callWhenEmpty);
-    vsjson_destroy (&v);
-    return r;
+    return _vsjson_parse_classic (json, strlen (json), func, data, callWhenEmpty);
 }
@@ -17,6 +17,7 @@ extern "C" {
 
 #define VSJSON_SEPARATOR '/'
 #include <stdbool.h>
+#include <stddef.h>
 
 //  Opaque class structures to allow forward references
 #ifndef VSJSON_T_DEFINED
@@ -25,6 +26,16 @@ typedef struct _vsjson_t vsjson_t;
 #endif
 typedef int (vsjson_callback_t)(const char *locator, const char *value, void *data);
 
+// token view into json text, not zero terminated
+typedef struct {
+    const char *data;
+    size_t size;
+} vsjson_view_t;
+typedef int (vsjson_view_callback_t)(const char *locator, vsjson_view_t value, void *data);
+
+// locators up to this size are built on stack
+#define VSJSON_LOCATOR_STACK 256
+
 // minimalized json parser class
 // returns new parser object
 // parameter is json string
@@ -55,6 +66,16 @@ int vsjson_walk_trough (vsjson_t *self, vsjson_callback_t *func, void *data, boo
 
 int vsjson_parse (const char *json, vsjson_callback_t *func, void *data, bool callWhenEmpty);
 
+// zero-copy parse of size bytes of json, nothing is copied or allocated
+// unless the locator is deeper than VSJSON_LOCATOR_STACK. Callback gets
+// views of value tokens into json (quotes of strings included, data is
+// NULL for empty object or array) and locator valid only during the call.
+// vsjson_parse is a wrapper of this function.
+int vsjson_parse_views (const char *json, size_t size, vsjson_view_callback_t *func, void *data, bool callWhenEmpty);
+
+// decode json string view, returns NULL if view is not a string
+char *vsjson_decode_view (vsjson_view_t view);
+
 char *vsjson_decode_string (const char *string);
 
 char *vsjson_encode_string (const char *string);
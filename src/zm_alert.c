@@ -31,10 +31,15 @@
 static const char *ACTOR_NAME = "zm-alert-flexible";
 static const char *ENDPOINT = "ipc://@/malamute";
 static const char *RULES_DIR = "./rules";
+static const char *WORKERS = "0";
+static const char *LUA_CACHE = NULL;
+static const char *BATCH = NULL;
+static const char *SNAPSHOT = NULL;
 
 int main (int argc, char *argv [])
 {
     bool verbose = false;
+    bool shared_lua = false;
     int argn;
     for (argn = 1; argn < argc; argn++) {
         const char *param = NULL;
@@ -47,6 +52,14 @@ int main (int argc, char *argv [])
             puts ("  --help / -h            this information");
             puts ("  --endpoint / -e        malamute endpoint [ipc://@/malamute]");
             puts ("  --rules / -r           directory with rules [./rules]");
+            puts ("  --workers / -w         number of evaluation threads, 0 evaluates");
+            puts ("                         in the main agent thread [0]");
+            puts ("  --shared-lua / -s      compile all rules into one lua state");
+            puts ("  --lua-cache / -c       directory for compiled rules cache [none]");
+            puts ("  --batch / -b           evaluate threshold rules in batches every");
+            puts ("                         given ms instead of on every metric [0]");
+            puts ("  --snapshot / -n        file to keep assets and metrics in for");
+            puts ("                         restart [none]");
             return 0;
         }
         else if (streq (argv [argn], "--verbose") || streq (argv [argn], "-v")) {
@@ -60,6 +73,25 @@ int main (int argc, char *argv [])
             if (param) RULES_DIR = param;
             ++argn;
         }
+        else if (streq (argv [argn], "--workers") || streq (argv [argn], "-w")) {
+            if (param) WORKERS = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--shared-lua") || streq (argv [argn], "-s")) {
+            shared_lua = true;
+        }
+        else if (streq (argv [argn], "--lua-cache") || streq (argv [argn], "-c")) {
+            if (param) LUA_CACHE = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--batch") || streq (argv [argn], "-b")) {
+            if (param) BATCH = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--snapshot") || streq (argv [argn], "-n")) {
+            if (param) SNAPSHOT = param;
+            ++argn;
+        }
         else {
             printf ("Unknown option: %s\n", argv [argn]);
             return 1;
@@ -70,11 +102,20 @@ int main (int argc, char *argv [])
         zsys_info ("zm_alert - started");
     zactor_t *server = zactor_new (flexible_alert_actor, NULL);
     assert (server);
+    if (shared_lua)
+        zstr_send (server, "SHAREDLUA");
+    if (LUA_CACHE)
+        zstr_sendx (server, "LUACACHE", LUA_CACHE, NULL);
+    if (BATCH)
+        zstr_sendx (server, "BATCH", BATCH, NULL);
+    zstr_sendx (server, "WORKERS", WORKERS, NULL);
     zstr_sendx (server, "BIND", ENDPOINT, ACTOR_NAME, NULL);
     zstr_sendx (server, "PRODUCER", ZM_PROTO_ALERT_STREAM, NULL);
     zstr_sendx (server, "CONSUMER", ZM_PROTO_METRIC_STREAM, ".*", NULL);
     zstr_sendx (server, "CONSUMER", ZM_PROTO_DEVICE_STREAM, ".*", NULL);
     zstr_sendx (server, "LOADRULES", RULES_DIR, NULL);
+    if (SNAPSHOT)
+        zstr_sendx (server, "SNAPSHOT", SNAPSHOT, NULL);
     while (!zsys_interrupted) {
         zmsg_t *msg = zactor_recv (server);
         zmsg_destroy (&msg);
@@ -0,0 +1,423 @@
+/*  =========================================================================
+    zm_alert_bench - End-to-end benchmark of the alert agent
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    zm_alert_bench - End-to-end benchmark of the alert agent
+@discuss
+    Starts malamute and flexible_alert_actor in process, generates assets
+    and rules from templates and publishes metrics at given rate. Every
+    metric changes the message of its rule, so every metric produces one
+    alert. Reports throughput, percentiles of metric to alert latency, CPU
+    time and memory of the whole process (broker, agent and generator).
+
+    Assets are in group "bench", rule j uses metric "bench.metric.<j>" and
+    is valid for the group, so each metric evaluates exactly one rule.
+    Metrics go round robin over all asset and rule pairs, value of a pair
+    changes each round and crosses the warning threshold.
+@end
+*/
+
+#include "zm_alert_classes.h"
+#include <sys/resource.h>
+
+static const char *ENDPOINT = "inproc://zm-alert-bench";
+static const char *AGENT_NAME = "zm-alert-bench-agent";
+static int ASSETS = 1000;
+static int RULES = 100;
+static int RATE = 10000;
+static int DURATION = 10;
+static const char *WORKERS = "0";
+static const char *KIND = "lua";
+static const char *BATCH = NULL;
+
+//  Write rule j of given kind to directory
+
+static int
+s_write_rule (const char *dir, const char *kind, int j)
+{
+    char *json;
+    if (streq (kind, "threshold"))
+        json = zsys_sprintf (
+            "{\"name\":\"bench-rule-%d\",\"kind\":\"threshold\","
+            "\"metrics\":[\"bench.metric.%d\"],\"groups\":[\"bench\"],"
+            "\"variables\":{\"high_warning\":\"50\",\"high_critical\":\"95\"},"
+            "\"results\":{\"ok\":{\"description\":\"$NAME is $VALUE\"},"
+            "\"high_warning\":{\"description\":\"$NAME is $VALUE\"},"
+            "\"high_critical\":{\"description\":\"$NAME is $VALUE\"}}}",
+            j, j);
+    else
+    if (streq (kind, "expression"))
+        json = zsys_sprintf (
+            "{\"name\":\"bench-rule-%d\",\"metrics\":[\"bench.metric.%d\"],"
+            "\"groups\":[\"bench\"],"
+            "\"expression\":\"bench.metric.%d > 50 ? HIGH_WARNING : OK\"}",
+            j, j, j);
+    else
+    if (streq (kind, "lua"))
+        json = zsys_sprintf (
+            "{\"name\":\"bench-rule-%d\",\"metrics\":[\"bench.metric.%d\"],"
+            "\"groups\":[\"bench\"],\"evaluation\":\""
+            "function main (x) "
+            "if x > 50 then return HIGH_WARNING, NAME .. ' is ' .. string.format ('%%d', x) end "
+            "return OK, NAME .. ' is ' .. string.format ('%%d', x) end\"}",
+            j, j);
+    else
+        return -1;
+
+    char *path = zsys_sprintf ("%s/bench-rule-%d.rule", dir, j);
+    FILE *file = fopen (path, "w");
+    int rv = -1;
+    if (file) {
+        rv = fputs (json, file) < 0 ? -1 : 0;
+        if (fclose (file) != 0) rv = -1;
+    }
+    zstr_free (&path);
+    zstr_free (&json);
+    return rv;
+}
+
+static void
+s_remove_rules (const char *dir)
+{
+    for (int j = 0; j < RULES; j++) {
+        char *path = zsys_sprintf ("%s/bench-rule-%d.rule", dir, j);
+        zsys_file_delete (path);
+        zstr_free (&path);
+    }
+    zsys_dir_delete (dir);
+}
+
+static void
+s_send_asset (mlm_client_t *client, int i)
+{
+    char *name = zsys_sprintf ("bench-asset-%d", i);
+    zhash_t *ext = zhash_new ();
+    zhash_autofree (ext);
+    zhash_insert (ext, "group.1", "bench");
+    zmsg_t *msg = zm_proto_encode_device_v1 (name, time (NULL), 3600, ext);
+    mlm_client_send (client, name, &msg);
+    zmsg_destroy (&msg);
+    zhash_destroy (&ext);
+    zstr_free (&name);
+}
+
+static void
+s_send_metric (mlm_client_t *client, int i, int j, int value)
+{
+    char asset [32], quantity [32], subject [64], text [16];
+    snprintf (asset, sizeof (asset), "bench-asset-%d", i);
+    snprintf (quantity, sizeof (quantity), "bench.metric.%d", j);
+    snprintf (subject, sizeof (subject), "%s@%s", quantity, asset);
+    snprintf (text, sizeof (text), "%d", value);
+    zmsg_t *msg = zm_proto_encode_metric_v1 (asset, time (NULL), 300, NULL, quantity, text, "%");
+    mlm_client_send (client, subject, &msg);
+    zmsg_destroy (&msg);
+}
+
+//  Find asset and rule index of alert from its subject
+//  rule/severity@asset, returns pair index or -1
+
+static int64_t
+s_alert_pair (const char *subject)
+{
+    const char *at = subject ? strchr (subject, '@') : NULL;
+    if (!at
+    ||  strncmp (subject, "bench-rule-", 11) != 0
+    ||  strncmp (at + 1, "bench-asset-", 12) != 0)
+        return -1;
+    long j = strtol (subject + 11, NULL, 10);
+    long i = strtol (at + 13, NULL, 10);
+    if (i < 0 || i >= ASSETS || j < 0 || j >= RULES)
+        return -1;
+    return (int64_t) j * ASSETS + i;
+}
+
+static int
+s_compare_latency (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static size_t
+s_rss_kb (void)
+{
+    size_t pages = 0, resident = 0;
+    FILE *file = fopen ("/proc/self/statm", "r");
+    if (file) {
+        if (fscanf (file, "%zu %zu", &pages, &resident) != 2)
+            resident = 0;
+        fclose (file);
+    }
+    return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+static double
+s_cpu_seconds (struct rusage *usage, bool system)
+{
+    struct timeval *tv = system ? &usage->ru_stime : &usage->ru_utime;
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+int main (int argc, char *argv [])
+{
+    bool verbose = false;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        const char *param = NULL;
+        if (argn < argc - 1) param = argv [argn+1];
+
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("zm-alert-bench [options] ...");
+            puts ("  --verbose / -v         verbose output");
+            puts ("  --help / -h            this information");
+            puts ("  --assets / -a          number of assets [1000]");
+            puts ("  --rules / -r           number of rules [100]");
+            puts ("  --kind / -k            kind of rules: lua, threshold or");
+            puts ("                         expression [lua]");
+            puts ("  --rate / -R            metrics per second, 0 is as fast as");
+            puts ("                         possible [10000]");
+            puts ("  --duration / -d        seconds of publishing metrics [10]");
+            puts ("  --workers / -w         number of evaluation threads [0]");
+            puts ("  --batch / -b           batch tick of threshold rules in ms [0]");
+            return 0;
+        }
+        else if (streq (argv [argn], "--verbose") || streq (argv [argn], "-v")) {
+            verbose = true;
+        }
+        else if (streq (argv [argn], "--assets") || streq (argv [argn], "-a")) {
+            if (param) ASSETS = atoi (param);
+            ++argn;
+        }
+        else if (streq (argv [argn], "--rules") || streq (argv [argn], "-r")) {
+            if (param) RULES = atoi (param);
+            ++argn;
+        }
+        else if (streq (argv [argn], "--kind") || streq (argv [argn], "-k")) {
+            if (param) KIND = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--rate") || streq (argv [argn], "-R")) {
+            if (param) RATE = atoi (param);
+            ++argn;
+        }
+        else if (streq (argv [argn], "--duration") || streq (argv [argn], "-d")) {
+            if (param) DURATION = atoi (param);
+            ++argn;
+        }
+        else if (streq (argv [argn], "--workers") || streq (argv [argn], "-w")) {
+            if (param) WORKERS = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--batch") || streq (argv [argn], "-b")) {
+            if (param) BATCH = param;
+            ++argn;
+        }
+        else {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+    }
+    if (ASSETS < 1 || RULES < 1 || RATE < 0 || DURATION < 1) {
+        printf ("Invalid number of assets, rules, rate or duration\n");
+        return 1;
+    }
+
+    //  rules from template
+    char dir [] = "/tmp/zm-alert-bench-XXXXXX";
+    if (!mkdtemp (dir)) {
+        printf ("Can't create rule directory\n");
+        return 1;
+    }
+    for (int j = 0; j < RULES; j++) {
+        if (s_write_rule (dir, KIND, j) != 0) {
+            printf ("Can't write rule of kind %s\n", KIND);
+            s_remove_rules (dir);
+            return 1;
+        }
+    }
+
+    zactor_t *malamute = zactor_new (mlm_server, (void *) "Malamute");
+    zstr_sendx (malamute, "BIND", ENDPOINT, NULL);
+    if (verbose) zstr_send (malamute, "VERBOSE");
+
+    int64_t start = zclock_usecs ();
+    zactor_t *agent = zactor_new (flexible_alert_actor, NULL);
+    assert (agent);
+    if (BATCH) zstr_sendx (agent, "BATCH", BATCH, NULL);
+    zstr_sendx (agent, "WORKERS", WORKERS, NULL);
+    zstr_sendx (agent, "BIND", ENDPOINT, AGENT_NAME, NULL);
+    zstr_sendx (agent, "PRODUCER", ZM_PROTO_ALERT_STREAM, NULL);
+    zstr_sendx (agent, "CONSUMER", ZM_PROTO_METRIC_STREAM, ".*", NULL);
+    zstr_sendx (agent, "CONSUMER", ZM_PROTO_DEVICE_STREAM, ".*", NULL);
+    zstr_sendx (agent, "LOADRULES", dir, NULL);
+
+    mlm_client_t *devices = mlm_client_new ();
+    mlm_client_connect (devices, ENDPOINT, 5000, "bench-devices");
+    mlm_client_set_producer (devices, ZM_PROTO_DEVICE_STREAM);
+    mlm_client_t *metrics = mlm_client_new ();
+    mlm_client_connect (metrics, ENDPOINT, 5000, "bench-metrics");
+    mlm_client_set_producer (metrics, ZM_PROTO_METRIC_STREAM);
+    mlm_client_t *alerts = mlm_client_new ();
+    mlm_client_connect (alerts, ENDPOINT, 5000, "bench-alerts");
+    mlm_client_set_consumer (alerts, ZM_PROTO_ALERT_STREAM, ".*");
+    zpoller_t *poller = zpoller_new (mlm_client_msgpipe (alerts), NULL);
+
+    //  agent answers the mailbox when its commands are done and rules loaded
+    mlm_client_sendtox (alerts, AGENT_NAME, "stats", "STATS", NULL);
+    if (zpoller_wait (poller, 60000)) {
+        zmsg_t *msg = mlm_client_recv (alerts);
+        zmsg_destroy (&msg);
+    }
+    double startup = (zclock_usecs () - start) / 1000.0;
+
+    //  announce assets, then repeat metric of the last one until its alert
+    //  arrives, so all assets are known to the agent
+    for (int i = 0; i < ASSETS; i++)
+        s_send_asset (devices, i);
+    bool ready = false;
+    for (int attempt = 0; attempt < 100 && !ready && !zsys_interrupted; attempt++) {
+        s_send_metric (metrics, ASSETS - 1, 0, attempt % 2 ? 10 : 90);
+        while (zpoller_wait (poller, 100)) {
+            zmsg_t *msg = mlm_client_recv (alerts);
+            if (streq (mlm_client_command (alerts), "STREAM DELIVER")
+            &&  s_alert_pair (mlm_client_subject (alerts)) == ASSETS - 1)
+                ready = true;
+            zmsg_destroy (&msg);
+        }
+        if (!ready && attempt % 10 == 9)
+            s_send_asset (devices, ASSETS - 1);
+    }
+    if (!ready) {
+        printf ("Agent did not produce any alert, giving up\n");
+        zpoller_destroy (&poller);
+        mlm_client_destroy (&alerts);
+        mlm_client_destroy (&metrics);
+        mlm_client_destroy (&devices);
+        zactor_destroy (&agent);
+        zactor_destroy (&malamute);
+        s_remove_rules (dir);
+        return 1;
+    }
+
+    size_t pairs = (size_t) ASSETS * RULES;
+    int64_t *sent_at = (int64_t *) zmalloc (pairs * sizeof (int64_t));
+    size_t latencies_capacity = 1024;
+    size_t latencies_size = 0;
+    int64_t *latencies = (int64_t *) malloc (latencies_capacity * sizeof (int64_t));
+    assert (sent_at && latencies);
+
+    struct rusage usage_start, usage_end;
+    getrusage (RUSAGE_SELF, &usage_start);
+    int64_t publish_start = zclock_usecs ();
+    int64_t publish_end = publish_start + (int64_t) DURATION * 1000000;
+    uint64_t sent = 0, received = 0, unmatched = 0;
+    int64_t now = publish_start;
+    int64_t drain_end = 0;
+
+    while (!zsys_interrupted) {
+        now = zclock_usecs ();
+        bool publishing = now < publish_end;
+        if (!publishing && !drain_end)
+            drain_end = now + 2000000;
+        if (!publishing && (received + unmatched >= sent || now >= drain_end))
+            break;
+
+        //  publish metrics which are due
+        while (publishing) {
+            int64_t due = RATE ? publish_start + (int64_t) (sent * 1000000 / RATE) : now;
+            if (due > now) break;
+            size_t pair = sent % pairs;
+            int i = (int) (pair % ASSETS);
+            int j = (int) (pair / ASSETS);
+            int round = (int) (sent / pairs);
+            sent_at [(size_t) j * ASSETS + i] = zclock_usecs ();
+            s_send_metric (metrics, i, j, 10 + round % 80);
+            sent++;
+            if (!RATE && sent % 64 == 0) break;
+        }
+
+        //  collect alerts until the next metric is due
+        int timeout = 0;
+        if (!publishing)
+            timeout = 100;
+        else
+        if (RATE) {
+            int64_t due = publish_start + (int64_t) (sent * 1000000 / RATE);
+            timeout = due > now ? (int) ((due - now) / 1000) : 0;
+        }
+        while (zpoller_wait (poller, timeout)) {
+            zmsg_t *msg = mlm_client_recv (alerts);
+            if (streq (mlm_client_command (alerts), "STREAM DELIVER")) {
+                int64_t pair = s_alert_pair (mlm_client_subject (alerts));
+                if (pair >= 0 && sent_at [pair]) {
+                    if (latencies_size == latencies_capacity) {
+                        latencies_capacity *= 2;
+                        latencies = (int64_t *) realloc (latencies, latencies_capacity * sizeof (int64_t));
+                        assert (latencies);
+                    }
+                    latencies [latencies_size++] = zclock_usecs () - sent_at [pair];
+                    sent_at [pair] = 0;
+                    received++;
+                }
+                else
+                    unmatched++;
+            }
+            zmsg_destroy (&msg);
+            timeout = 0;
+        }
+    }
+    double elapsed = (zclock_usecs () - publish_start) / 1e6;
+    getrusage (RUSAGE_SELF, &usage_end);
+    size_t rss = s_rss_kb ();
+
+    qsort (latencies, latencies_size, sizeof (int64_t), s_compare_latency);
+    #define PERCENTILE(p) (latencies_size ? latencies [(size_t) ((latencies_size - 1) * (p))] : 0)
+    double user = s_cpu_seconds (&usage_end, false) - s_cpu_seconds (&usage_start, false);
+    double system = s_cpu_seconds (&usage_end, true) - s_cpu_seconds (&usage_start, true);
+
+    printf ("zm-alert-bench: %d assets, %d %s rules, %s workers, rate %d/s, %d s\n",
+        ASSETS, RULES, KIND, WORKERS, RATE, DURATION);
+    printf ("startup        %.1f ms to load rules and connect\n", startup);
+    printf ("sent           %llu metrics, %llu alerts in %.2f s (%llu lost or late)\n",
+        (unsigned long long) sent, (unsigned long long) received, elapsed,
+        (unsigned long long) (sent - received));
+    printf ("throughput     %.0f metrics/s, %.0f alerts/s\n", sent / elapsed, received / elapsed);
+    printf ("latency        p50 %lld us, p99 %lld us, p999 %lld us, max %lld us\n",
+        (long long) PERCENTILE (0.5), (long long) PERCENTILE (0.99),
+        (long long) PERCENTILE (0.999), (long long) PERCENTILE (1.0));
+    printf ("cpu            %.2f s user, %.2f s system, %.0f %% of one core\n",
+        user, system, (user + system) * 100 / elapsed);
+    printf ("memory         %zu kB resident, %ld kB peak\n", rss, usage_end.ru_maxrss);
+
+    free (latencies);
+    free (sent_at);
+    zpoller_destroy (&poller);
+    mlm_client_destroy (&alerts);
+    mlm_client_destroy (&metrics);
+    mlm_client_destroy (&devices);
+    zactor_destroy (&agent);
+    zactor_destroy (&malamute);
+    s_remove_rules (dir);
+    return 0;
+}
@@ -47,11 +47,36 @@ typedef struct _vsjson_t vsjson_t;
 typedef struct _metrics_t metrics_t;
 #define METRICS_T_DEFINED
 #endif
+#ifndef ATOMS_T_DEFINED
+typedef struct _atoms_t atoms_t;
+#define ATOMS_T_DEFINED
+#endif
+#ifndef ASSET_T_DEFINED
+typedef struct _asset_t asset_t;
+#define ASSET_T_DEFINED
+#endif
+#ifndef RULE_INDEX_T_DEFINED
+typedef struct _rule_index_t rule_index_t;
+#define RULE_INDEX_T_DEFINED
+#endif
+#ifndef EXPRESSION_T_DEFINED
+typedef struct _expression_t expression_t;
+#define EXPRESSION_T_DEFINED
+#endif
+#ifndef ASSET_INDEX_T_DEFINED
+typedef struct _asset_index_t asset_index_t;
+#define ASSET_INDEX_T_DEFINED
+#endif
 
 //  Internal API
 #include "rule.h"
 #include "vsjson.h"
 #include "metrics.h"
+#include "atoms.h"
+#include "asset.h"
+#include "rule_index.h"
+#include "expression.h"
+#include "asset_index.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef ZM_ALERT_BUILD_DRAFT_API
@@ -71,6 +96,31 @@ ZM_ALERT_PRIVATE void
 ZM_ALERT_PRIVATE void
     metrics_test (bool verbose);
 
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ALERT_PRIVATE void
+    atoms_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ALERT_PRIVATE void
+    asset_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ALERT_PRIVATE void
+    rule_index_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ALERT_PRIVATE void
+    expression_test (bool verbose);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+ZM_ALERT_PRIVATE void
+    asset_index_test (bool verbose);
+
 //  Self test for private classes
 ZM_ALERT_PRIVATE void
     zm_alert_private_selftest (bool verbose);
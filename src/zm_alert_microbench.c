@@ -0,0 +1,412 @@
+/*  =========================================================================
+    zm_alert_microbench - Microbenchmarks of json parser and rules
+
+    Copyright (C) 2016 - 2017 Tomas Halman
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    zm_alert_microbench - Microbenchmarks of json parser and rules
+@discuss
+    Measures vsjson_parse, vsjson_decode_string, vsjson_encode_string,
+    rule_parse, rule_json, rule_compile and rule_evaluate over every rule
+    file of the given directory (src/selftest-ro/rules by default) and over
+    generated large inputs. Reports ns/op, allocations/op and bytes/op.
+    Rule keeps its json once serialized, so rule_parse_json serializes a
+    freshly parsed rule (subtract rule_parse), rule_json_cached measures
+    the cached copy.
+
+    The private classes are not exported from the library, so their
+    sources are compiled into this program (see src/Makemodule-local.am).
+    Allocations are counted by malloc, calloc and realloc defined here,
+    which replace the glibc ones for the whole process, lua and czmq
+    included. Counters are not atomic, benchmarks run in one thread.
+
+    Run it with "make bench".
+@end
+*/
+
+#include "zm_alert_classes.h"
+#include <time.h>
+
+//  --------------------------------------------------------------------------
+//  Counting malloc shim, forwards to glibc allocator
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+static uint64_t s_allocations;
+static uint64_t s_allocated;
+
+void *
+malloc (size_t size)
+{
+    s_allocations++;
+    s_allocated += size;
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t count, size_t size)
+{
+    s_allocations++;
+    s_allocated += count * size;
+    return __libc_calloc (count, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    //  shrinking or freeing by realloc is not an allocation
+    if (size) {
+        s_allocations++;
+        s_allocated += size;
+    }
+    return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+    __libc_free (ptr);
+}
+
+//  --------------------------------------------------------------------------
+//  Benchmark input, one rule json with everything derived from it
+
+typedef struct {
+    char *name;                 //  file name or name of generated input
+    char *json;                 //  rule json
+    char *encoded;              //  json encoded as json string
+    rule_t *rule;               //  parsed rule
+    bool compiled;              //  rule compiles
+    rule_param_t *params;       //  one param per metric of rule
+    size_t params_size;
+} input_t;
+
+typedef void (bench_fn_t) (input_t *input);
+
+static int
+s_input_add (zlistx_t *inputs, const char *name, char *json)
+{
+    input_t *input = (input_t *) zmalloc (sizeof (input_t));
+    input->name = strdup (name);
+    input->json = json;
+    input->encoded = vsjson_encode_string (json);
+    input->rule = rule_new ();
+    if (rule_parse (input->rule, json) != 0) {
+        printf ("%s: rule can't be parsed, skipped\n", name);
+        rule_destroy (&input->rule);
+    }
+    else {
+        for (const char *metric = rule_metric_first (input->rule); metric; metric = rule_metric_next (input->rule))
+            input->params_size++;
+        input->params = (rule_param_t *) zmalloc ((input->params_size + 1) * sizeof (rule_param_t));
+        for (size_t i = 0; i < input->params_size; i++)
+            rule_param_set (&input->params [i], "42.5");
+        input->compiled = rule_compile (input->rule, NULL) == 1;
+        if (!input->compiled)
+            printf ("%s: rule can't be compiled, rule_compile and rule_evaluate skipped\n", name);
+    }
+    zlistx_add_end (inputs, input);
+    return 0;
+}
+
+static void
+s_input_destroy (input_t **self_p)
+{
+    input_t *self = *self_p;
+    if (!self) return;
+    rule_destroy (&self->rule);
+    free (self->params);
+    free (self->encoded);
+    free (self->json);
+    free (self->name);
+    free (self);
+    *self_p = NULL;
+}
+
+//  Read whole file, returns NULL on failure
+
+static char *
+s_read_file (const char *path)
+{
+    FILE *file = fopen (path, "r");
+    if (!file) return NULL;
+    char *data = NULL;
+    if (fseek (file, 0, SEEK_END) == 0) {
+        long size = ftell (file);
+        if (size >= 0 && fseek (file, 0, SEEK_SET) == 0) {
+            data = (char *) zmalloc (size + 1);
+            if (fread (data, 1, size, file) != (size_t) size)
+                zstr_free (&data);
+        }
+    }
+    fclose (file);
+    return data;
+}
+
+//  Large generated rule: many assets and groups, long evaluation with
+//  escaped strings
+
+static char *
+s_generate_large (int assets, int branches)
+{
+    zchunk_t *chunk = zchunk_new (NULL, 0);
+    const char *text = "{\"name\":\"generated\",\"description\":\"generated \\\"large\\\" rule\\n\","
+        "\"metrics\":[\"generated.a\",\"generated.b\"],\"assets\":[";
+    zchunk_extend (chunk, text, strlen (text));
+    for (int i = 0; i < assets; i++) {
+        char *item = zsys_sprintf ("%s\"asset-%d\"", i ? "," : "", i);
+        zchunk_extend (chunk, item, strlen (item));
+        zstr_free (&item);
+    }
+    text = "],\"groups\":[\"generated\"],\"results\":{\"high_warning\":{\"action\":[\"EMAIL\"]}},"
+        "\"variables\":{\"limit\":\"100\"},\"evaluation\":\"function main (a, b) ";
+    zchunk_extend (chunk, text, strlen (text));
+    for (int i = 0; i < branches; i++) {
+        char *item = zsys_sprintf (
+            "if a + b == %d then return HIGH_WARNING, 'branch \\\\t%d of ' .. NAME end ", i, i);
+        zchunk_extend (chunk, item, strlen (item));
+        zstr_free (&item);
+    }
+    text = "return OK, 'sum of ' .. NAME .. ' is ' .. (a + b) end\"}";
+    zchunk_extend (chunk, text, strlen (text) + 1);
+    char *json = strdup ((char *) zchunk_data (chunk));
+    zchunk_destroy (&chunk);
+    return json;
+}
+
+//  --------------------------------------------------------------------------
+//  Benchmarked operations
+
+static int
+s_parse_callback (const char *locator, const char *value, void *data)
+{
+    (*(size_t *) data)++;
+    return 0;
+}
+
+static void
+s_bench_vsjson_parse (input_t *input)
+{
+    size_t count = 0;
+    vsjson_parse (input->json, s_parse_callback, &count, true);
+}
+
+static void
+s_bench_vsjson_decode_string (input_t *input)
+{
+    char *decoded = vsjson_decode_string (input->encoded);
+    free (decoded);
+}
+
+static void
+s_bench_vsjson_encode_string (input_t *input)
+{
+    char *encoded = vsjson_encode_string (input->json);
+    free (encoded);
+}
+
+//  includes rule_new and rule_destroy, parse needs fresh rule
+
+static void
+s_bench_rule_parse (input_t *input)
+{
+    rule_t *rule = rule_new ();
+    rule_parse (rule, input->json);
+    rule_destroy (&rule);
+}
+
+//  json is cached by rule after the first call, so it is serialized from
+//  a fresh rule each time
+
+static void
+s_bench_rule_parse_json (input_t *input)
+{
+    rule_t *rule = rule_new ();
+    rule_parse (rule, input->json);
+    char *json = rule_json (rule);
+    free (json);
+    rule_destroy (&rule);
+}
+
+static void
+s_bench_rule_json_cached (input_t *input)
+{
+    char *json = rule_json (input->rule);
+    free (json);
+}
+
+static void
+s_bench_rule_compile (input_t *input)
+{
+    rule_compile (input->rule, NULL);
+}
+
+static void
+s_bench_rule_evaluate (input_t *input)
+{
+    int result;
+    char *message;
+    rule_evaluate (input->rule, input->params, input->params_size, "asset-1", "Asset 1", &result, &message);
+    free (message);
+}
+
+//  Run operation in growing batches until it takes at least min_usecs,
+//  then report the last batch
+
+static void
+s_bench (const char *operation, bench_fn_t *fn, input_t *input, int64_t min_usecs)
+{
+    //  warm up caches and lazy initialization
+    fn (input);
+
+    uint64_t iterations = 1;
+    while (true) {
+        uint64_t allocations = s_allocations;
+        uint64_t allocated = s_allocated;
+        struct timespec start, end;
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        for (uint64_t i = 0; i < iterations; i++)
+            fn (input);
+        clock_gettime (CLOCK_MONOTONIC, &end);
+        int64_t nsecs = (int64_t) (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+        if (nsecs >= min_usecs * 1000 || iterations >= (1ULL << 40)) {
+            printf ("%-24s %-28s %12.1f ns/op %10.2f allocs/op %12.1f B/op\n",
+                operation, input->name,
+                (double) nsecs / iterations,
+                (double) (s_allocations - allocations) / iterations,
+                (double) (s_allocated - allocated) / iterations);
+            return;
+        }
+        //  aim a bit over the limit from the measured speed
+        uint64_t next = nsecs > 0 ? (uint64_t) (iterations * 1.2 * min_usecs * 1000 / nsecs) : iterations * 100;
+        if (next > iterations * 100) next = iterations * 100;
+        iterations = next > iterations ? next : iterations * 2;
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    const char *dir = "src/selftest-ro/rules";
+    const char *filter = NULL;
+    int64_t min_usecs = 200000;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        const char *param = NULL;
+        if (argn < argc - 1) param = argv [argn+1];
+
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("zm-alert-microbench [options] [rule directory]");
+            puts ("  --help / -h            this information");
+            puts ("  --filter / -f          run operations containing this text only");
+            puts ("  --time / -t            minimal time of each benchmark in ms [200]");
+            puts ("  rule directory         rules to benchmark [src/selftest-ro/rules]");
+            return 0;
+        }
+        else if (streq (argv [argn], "--filter") || streq (argv [argn], "-f")) {
+            if (param) filter = param;
+            ++argn;
+        }
+        else if (streq (argv [argn], "--time") || streq (argv [argn], "-t")) {
+            if (param) min_usecs = atoi (param) * 1000LL;
+            ++argn;
+        }
+        else if (*argv [argn] == '-') {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+        else
+            dir = argv [argn];
+    }
+
+    zlistx_t *inputs = zlistx_new ();
+    zlistx_set_destructor (inputs, (zlistx_destructor_fn *) s_input_destroy);
+
+    //  fixtures, sorted for stable output
+    DIR *dh = opendir (dir);
+    if (!dh) {
+        printf ("Can't open rule directory %s\n", dir);
+        zlistx_destroy (&inputs);
+        return 1;
+    }
+    zlistx_t *names = zlistx_new ();
+    zlistx_set_destructor (names, (zlistx_destructor_fn *) zstr_free);
+    zlistx_set_comparator (names, (zlistx_comparator_fn *) strcmp);
+    struct dirent *entry;
+    while ((entry = readdir (dh)) != NULL) {
+        size_t length = strlen (entry->d_name);
+        if (length > 5 && streq (entry->d_name + length - 5, ".rule"))
+            zlistx_add_end (names, strdup (entry->d_name));
+    }
+    closedir (dh);
+    zlistx_sort (names);
+    for (char *name = (char *) zlistx_first (names); name; name = (char *) zlistx_next (names)) {
+        char *path = zsys_sprintf ("%s/%s", dir, name);
+        char *json = s_read_file (path);
+        if (json)
+            s_input_add (inputs, name, json);
+        else
+            printf ("%s: can't be read, skipped\n", path);
+        zstr_free (&path);
+    }
+    zlistx_destroy (&names);
+
+    //  generated inputs
+    s_input_add (inputs, "generated-10k-assets", s_generate_large (10000, 10));
+    s_input_add (inputs, "generated-1k-branches", s_generate_large (10, 1000));
+    s_input_add (inputs, "generated-threshold", strdup (
+        "{\"name\":\"threshold\",\"kind\":\"threshold\",\"metrics\":[\"generated\"],"
+        "\"groups\":[\"generated\"],\"variables\":{\"low_critical\":\"5\",\"low_warning\":\"15\","
+        "\"high_warning\":\"40\",\"high_critical\":\"60\"},"
+        "\"results\":{\"high_warning\":{\"action\":[\"EMAIL\"],\"description\":\"$NAME is $VALUE\"}}}"));
+    s_input_add (inputs, "generated-expression", strdup (
+        "{\"name\":\"expression\",\"metrics\":[\"generated.a\",\"generated.b\"],"
+        "\"groups\":[\"generated\"],\"variables\":{\"limit\":\"80\"},"
+        "\"expression\":\"generated.a + generated.b > limit ? HIGH_WARNING : OK\"}"));
+
+    struct {
+        const char *name;
+        bench_fn_t *fn;
+        bool needs_rule;
+        bool needs_compiled;
+    } operations [] = {
+        { "vsjson_parse", s_bench_vsjson_parse, false, false },
+        { "vsjson_decode_string", s_bench_vsjson_decode_string, false, false },
+        { "vsjson_encode_string", s_bench_vsjson_encode_string, false, false },
+        { "rule_parse", s_bench_rule_parse, true, false },
+        { "rule_parse_json", s_bench_rule_parse_json, true, false },
+        { "rule_json_cached", s_bench_rule_json_cached, true, false },
+        { "rule_compile", s_bench_rule_compile, true, true },
+        { "rule_evaluate", s_bench_rule_evaluate, true, true },
+    };
+    for (size_t i = 0; i < sizeof (operations) / sizeof (operations [0]); i++) {
+        if (filter && !strstr (operations [i].name, filter)) continue;
+        for (input_t *input = (input_t *) zlistx_first (inputs); input; input = (input_t *) zlistx_next (inputs)) {
+            if (operations [i].needs_rule && !input->rule) continue;
+            if (operations [i].needs_compiled && !input->compiled) continue;
+            s_bench (operations [i].name, operations [i].fn, input, min_usecs);
+        }
+    }
+    zlistx_destroy (&inputs);
+    return 0;
+}
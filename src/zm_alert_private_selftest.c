@@ -41,6 +41,11 @@ zm_alert_private_selftest (bool verbose)
     rule_test (verbose);
     vsjson_test (verbose);
     metrics_test (verbose);
+    atoms_test (verbose);
+    asset_test (verbose);
+    rule_index_test (verbose);
+    expression_test (verbose);
+    asset_index_test (verbose);
 }
 /*
 ################################################################################